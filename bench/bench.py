@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+#
+# Sweeps the pasters over -t against a local mock_server.py and prints one
+# CSV row per run: wall and CPU time of the paster, what the server sent,
+# and how much of it was duplicates the paster threw away.
+#
+#   python3 bench/bench.py --threads 1,4,16 --runs 3 --latency 0.2 > results.csv
+#
+# A program can carry options of its own after a colon, to set versions of
+# one paster against each other, e.g. the curl and io_uring engines with
+#
+#   python3 bench/bench.py --programs paster_nbio,paster_nbio:-U --threads 64,256
+#
+# Server options (--latency, --bandwidth, --error-rate, ...) are passed
+# through to mock_server.py; see its --help.
+
+import argparse
+import csv
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+import urllib.request
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+BIN = os.path.join(HERE, '..', 'bin')
+N_FRAGMENTS = 20
+
+# the sequential paster has no -t
+SEQUENTIAL = {'paster'}
+
+FIELDS = ['program', 'threads', 'run', 'status', 'wall_s', 'cpu_s',
+          'requests', 'errors', 'drops', 'fragments', 'bytes', 'duplicate_rate']
+
+
+def start_server(opts, server_args):
+    server = subprocess.Popen(
+        [sys.executable, os.path.join(HERE, 'mock_server.py'),
+         '--port', str(opts.port)] + server_args,
+        stdout=subprocess.PIPE, text=True)
+    line = server.stdout.readline()
+    if not line.startswith('serving on'):
+        server.kill()
+        sys.exit('mock server failed to start')
+    return server
+
+
+def server_stats(port, reset=False):
+    url = 'http://127.0.0.1:%d/stats%s' % (port, '?reset=1' if reset else '')
+    with urllib.request.urlopen(url) as response:
+        return json.load(response)
+
+
+def split_program(spec):
+    name, _, args = spec.partition(':')
+    return name, args.split()
+
+
+def run(opts, program, threads, workdir):
+    name, args = split_program(program)
+    argv = [os.path.join(BIN, name), '-c', '127.0.0.1:%d' % opts.port,
+            '-i', str(opts.image)] + args + opts.extra
+    if name not in SEQUENTIAL:
+        argv += ['-t', str(threads)]
+
+    server_stats(opts.port, reset=True)
+    start = time.monotonic()
+    child = subprocess.Popen(argv, cwd=workdir, stdout=subprocess.DEVNULL,
+                             stderr=subprocess.DEVNULL)
+    _, status, usage = os.wait4(child.pid, 0)
+    wall = time.monotonic() - start
+    stats = server_stats(opts.port)
+
+    # every full body past the first N_FRAGMENTS was a duplicate
+    fragments = stats['fragments']
+    duplicates = max(fragments - N_FRAGMENTS, 0)
+    return dict(
+        status=os.waitstatus_to_exitcode(status),
+        wall_s='%.3f' % wall,
+        cpu_s='%.3f' % (usage.ru_utime + usage.ru_stime),
+        requests=stats['requests'], errors=stats['errors'], drops=stats['drops'],
+        fragments=fragments, bytes=stats['bytes'],
+        duplicate_rate='%.3f' % (duplicates / fragments if fragments else 0.0))
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Benchmark the pasters against a local mock server.',
+        epilog='Unrecognised options are passed on to mock_server.py; '
+               'put paster options after --.')
+    parser.add_argument('--programs', default='paster,paster_parallel,paster_nbio',
+                        help='comma-separated binaries from bin/, each with options after a colon if need be')
+    parser.add_argument('--threads', default='1,2,4,8,16',
+                        help='comma-separated values of -t')
+    parser.add_argument('--runs', type=int, default=3)
+    parser.add_argument('--image', type=int, default=1)
+    parser.add_argument('--port', type=int, default=4600)
+    parser.add_argument('--output', help='CSV file, standard output by default')
+    opts, rest = parser.parse_known_args()
+    if '--' in rest:
+        split = rest.index('--')
+        server_args, opts.extra = rest[:split], rest[split + 1:]
+    else:
+        server_args, opts.extra = rest, []
+    server_args += ['--images', str(opts.image)]
+
+    programs = opts.programs.split(',')
+    threads = [int(t) for t in opts.threads.split(',')]
+    for program in programs:
+        name, _ = split_program(program)
+        if not os.access(os.path.join(BIN, name), os.X_OK):
+            sys.exit('%s not built; run make first' % name)
+
+    out = open(opts.output, 'w', newline='') if opts.output else sys.stdout
+    writer = csv.DictWriter(out, fieldnames=FIELDS)
+    writer.writeheader()
+
+    server = start_server(opts, server_args)
+    try:
+        with tempfile.TemporaryDirectory() as workdir:
+            for program in programs:
+                sweep = [1] if split_program(program)[0] in SEQUENTIAL else threads
+                for t in sweep:
+                    for i in range(opts.runs):
+                        row = dict(program=program, threads=t, run=i + 1)
+                        row.update(run(opts, program, t, workdir))
+                        writer.writerow(row)
+                        out.flush()
+    finally:
+        server.terminate()
+        server.wait()
+        if out is not sys.stdout:
+            out.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+#
+# Runs bin/assembler with 1, 2, ... paster_nbio -D workers against a local
+# mock_server.py and prints one CSV row per run: how long the batch took,
+# images per second, and how many of the fragments the workers fetched
+# went to waste.
+#
+#   python3 bench/distributed.py --workers 1,2,4 --images 1-4 --latency 0.2 > results.csv
+#
+# Everything runs on this machine, so the workers share its CPUs and the
+# one server; --bandwidth stands in for each node's own link. Server
+# options are passed through to mock_server.py as in bench.py, and worker
+# options after --.
+
+import argparse
+import csv
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+from bench import BIN, server_stats, start_server
+
+N_FRAGMENTS = 20
+
+FIELDS = ['workers', 'threads', 'run', 'status', 'wall_s', 'images_per_s',
+          'requests', 'fragments', 'bytes', 'duplicate_rate']
+
+
+def image_list(spec):
+    imgs = []
+    for part in spec.split(','):
+        first, _, last = part.partition('-')
+        imgs += range(int(first), int(last or first) + 1)
+    return imgs
+
+
+def run(opts, workers, workdir):
+    assembler = subprocess.Popen(
+        [os.path.join(BIN, 'assembler'), '-l', str(opts.link_port), '-b', opts.images],
+        cwd=workdir, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, text=True)
+    if not assembler.stdout.readline().startswith('assembling on'):
+        assembler.kill()
+        sys.exit('assembler failed to start')
+
+    server_stats(opts.port, reset=True)
+    start = time.monotonic()
+    argv = [os.path.join(BIN, 'paster_nbio'), '-c', '127.0.0.1:%d' % opts.port,
+            '-D', '127.0.0.1:%d' % opts.link_port, '-b', opts.images, '-d',
+            '-t', str(opts.threads)] + opts.extra
+    children = [subprocess.Popen(argv, cwd=workdir, stdout=subprocess.DEVNULL,
+                                 stderr=subprocess.DEVNULL) for _ in range(workers)]
+    assembler.communicate()
+    wall = time.monotonic() - start
+    status = max([assembler.returncode] + [abs(child.wait()) for child in children])
+    stats = server_stats(opts.port)
+
+    # every full body past the first N_FRAGMENTS of each image was wasted
+    fragments = stats['fragments']
+    needed = N_FRAGMENTS * len(image_list(opts.images))
+    return dict(
+        status=status,
+        wall_s='%.3f' % wall,
+        images_per_s='%.3f' % (len(image_list(opts.images)) / wall),
+        requests=stats['requests'], fragments=fragments, bytes=stats['bytes'],
+        duplicate_rate='%.3f' % (max(fragments - needed, 0) / fragments if fragments else 0.0))
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Benchmark distributed fetching against a local mock server.',
+        epilog='Unrecognised options are passed on to mock_server.py; '
+               'put paster_nbio options after --.')
+    parser.add_argument('--workers', default='1,2,4',
+                        help='comma-separated numbers of workers')
+    parser.add_argument('--threads', type=int, default=4, help='-t of every worker')
+    parser.add_argument('--images', default='1-4', help='the -b list')
+    parser.add_argument('--runs', type=int, default=3)
+    parser.add_argument('--port', type=int, default=4600)
+    parser.add_argument('--link-port', type=int, default=4591)
+    parser.add_argument('--output', help='CSV file, standard output by default')
+    opts, rest = parser.parse_known_args()
+    if '--' in rest:
+        split = rest.index('--')
+        server_args, opts.extra = rest[:split], rest[split + 1:]
+    else:
+        server_args, opts.extra = rest, []
+    server_args += ['--images'] + [str(img) for img in image_list(opts.images)]
+
+    for program in ('assembler', 'paster_nbio'):
+        if not os.access(os.path.join(BIN, program), os.X_OK):
+            sys.exit('%s not built; run make first' % program)
+
+    out = open(opts.output, 'w', newline='') if opts.output else sys.stdout
+    writer = csv.DictWriter(out, fieldnames=FIELDS)
+    writer.writeheader()
+
+    server = start_server(opts, server_args)
+    try:
+        with tempfile.TemporaryDirectory() as workdir:
+            for workers in [int(w) for w in opts.workers.split(',')]:
+                for i in range(opts.runs):
+                    row = dict(workers=workers, threads=opts.threads, run=i + 1)
+                    row.update(run(opts, workers, workdir))
+                    writer.writerow(row)
+                    out.flush()
+    finally:
+        server.terminate()
+        server.wait()
+        if out is not sys.stdout:
+            out.close()
+
+
+if __name__ == '__main__':
+    main()
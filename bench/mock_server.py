@@ -0,0 +1,237 @@
+#!/usr/bin/env python3
+#
+# Local stand-in for the ECE 459 fragment servers.
+#
+# Answers GET /image?img=N like the real mirrors do: with a random one of
+# the N_FRAGMENTS stripes of image N as a PNG, and the stripe's index in an
+# X-Ece459-Fragment header. The stripes are generated once at startup, so
+# every run downloads the same bytes.
+#
+# Latency, bandwidth and errors are configurable, per mirror if need be
+# (the mirror is whatever the client put in the Host header, so run the
+# pasters with -c 127.0.0.1:PORT).
+#
+# GET /stats returns the counters as JSON; GET /stats?reset=1 also zeroes
+# them.
+
+import argparse
+import http.server
+import json
+import random
+import socketserver
+import struct
+import sys
+import threading
+import time
+import urllib.parse
+import zlib
+
+WIDTH, HEIGHT, N_FRAGMENTS = 4000, 3000, 20
+STRIPE = WIDTH // N_FRAGMENTS
+
+
+def png(width, height, rows):
+    def chunk(kind, data):
+        return (struct.pack('>I', len(data)) + kind + data +
+                struct.pack('>I', zlib.crc32(kind + data) & 0xffffffff))
+
+    raw = b''.join(b'\x00' + row for row in rows)
+    return (b'\x89PNG\r\n\x1a\n' +
+            chunk(b'IHDR', struct.pack('>IIBBBBB', width, height, 8, 6, 0, 0, 0)) +
+            chunk(b'IDAT', zlib.compress(raw, 6)) +
+            chunk(b'IEND', b''))
+
+
+def fragment(img, n, noise_bits):
+    # a gradient per stripe, plus noise in the low bits of every colour so
+    # the PNGs don't compress to nothing the way the real photos don't
+    rng = random.Random(img * 1000 + n)
+    size = STRIPE * 4
+    mask = int.from_bytes(bytes([(1 << noise_bits) - 1] * 3 + [0]) * STRIPE, 'big')
+    rows = []
+    for y in range(HEIGHT):
+        px = bytes([(n * 12 + img * 50) % 256, (y // 12) % 256, (n * 37 + y) % 256, 255])
+        row = int.from_bytes(px * STRIPE, 'big') ^ (int.from_bytes(rng.randbytes(size), 'big') & mask)
+        rows.append(row.to_bytes(size, 'big'))
+    return png(STRIPE, HEIGHT, rows)
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.reset()
+
+    def reset(self):
+        self.requests = 0
+        self.fragments = 0        # bodies sent in full
+        self.bytes = 0
+        self.errors = 0
+        self.drops = 0
+        self.corrupted = 0
+
+    def add(self, **counts):
+        with self.lock:
+            for key, value in counts.items():
+                setattr(self, key, getattr(self, key) + value)
+
+    def snapshot(self, reset):
+        with self.lock:
+            data = dict(requests=self.requests, fragments=self.fragments,
+                        bytes=self.bytes, errors=self.errors, drops=self.drops,
+                        corrupted=self.corrupted)
+            if reset:
+                self.reset()
+        return data
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, *args):
+        pass
+
+    def mirror_setting(self, overrides, default):
+        host = self.headers.get('Host', '').split(':')[0]
+        return overrides.get(host, default)
+
+    def do_GET(self):
+        url = urllib.parse.urlparse(self.path)
+        query = urllib.parse.parse_qs(url.query)
+        if url.path == '/stats':
+            body = json.dumps(self.server.stats.snapshot('reset' in query)).encode()
+            self.send_response(200)
+            self.send_header('Content-Type', 'application/json')
+            self.send_header('Content-Length', str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+            return
+        if url.path != '/image':
+            self.send_error(404)
+            return
+
+        opts = self.server.opts
+        self.server.stats.add(requests=1)
+        time.sleep(self.mirror_setting(opts.host_latency, opts.latency))
+
+        if random.random() < self.mirror_setting(opts.host_error_rate, opts.error_rate):
+            self.server.stats.add(errors=1)
+            self.send_response(503)
+            self.send_header('Content-Length', '0')
+            self.end_headers()
+            return
+
+        img = int(query.get('img', ['1'])[0])
+        n = random.randrange(N_FRAGMENTS)
+        body = self.server.fragments(img)[n]
+        self.send_response(200)
+        self.send_header('Content-Type', 'image/png')
+        self.send_header('Content-Length', str(len(body)))
+        self.send_header('X-Ece459-Fragment', str(n))
+        self.end_headers()
+
+        # garble a byte past the PNG signature now and then, which the
+        # zlib or chunk CRCs catch
+        if random.random() < opts.corrupt_rate:
+            at = random.randrange(8, len(body))
+            body = body[:at] + bytes([body[at] ^ 0xff]) + body[at + 1:]
+            self.server.stats.add(corrupted=1)
+
+        # cut the connection partway through the body now and then
+        if random.random() < opts.drop_rate:
+            body = body[:random.randrange(len(body))]
+            dropped = True
+        else:
+            dropped = False
+
+        bandwidth = self.mirror_setting(opts.host_bandwidth, opts.bandwidth)
+        chunk = 16384
+        sent = 0
+        start = time.monotonic()
+        try:
+            while sent < len(body):
+                self.wfile.write(body[sent:sent + chunk])
+                sent += min(chunk, len(body) - sent)
+                if bandwidth:
+                    lag = sent / bandwidth - (time.monotonic() - start)
+                    if lag > 0:
+                        time.sleep(lag)
+        except (BrokenPipeError, ConnectionResetError):
+            # the client gave up on this one, e.g. a discarded duplicate
+            pass
+        self.server.stats.add(bytes=sent)
+        if dropped:
+            self.server.stats.add(drops=1)
+            self.close_connection = True
+        elif sent == len(body):
+            self.server.stats.add(fragments=1)
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+    def __init__(self, opts):
+        super().__init__((opts.bind, opts.port), Handler)
+        self.opts = opts
+        self.stats = Stats()
+        self.cache = {}
+        self.cache_lock = threading.Lock()
+
+    def handle_error(self, request, client_address):
+        # clients hang up on keep-alive connections all the time
+        if not isinstance(sys.exc_info()[1], ConnectionError):
+            super().handle_error(request, client_address)
+
+    def fragments(self, img):
+        with self.cache_lock:
+            if img not in self.cache:
+                self.cache[img] = [fragment(img, n, self.opts.noise_bits) for n in range(N_FRAGMENTS)]
+            return self.cache[img]
+
+
+def per_host(kind):
+    def parse(spec):
+        host, _, value = spec.partition('=')
+        if not value:
+            raise argparse.ArgumentTypeError('expected HOST=VALUE, got %r' % spec)
+        return host, kind(value)
+    return parse
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Local stand-in for the ECE 459 fragment servers.')
+    parser.add_argument('--bind', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=4590)
+    parser.add_argument('--latency', type=float, default=0.0,
+                        help='seconds before the response headers')
+    parser.add_argument('--bandwidth', type=float, default=0,
+                        help='bytes/s per connection, 0 for unlimited')
+    parser.add_argument('--error-rate', type=float, default=0.0,
+                        help='fraction of requests answered with 503')
+    parser.add_argument('--drop-rate', type=float, default=0.0,
+                        help='fraction of bodies cut short by closing the connection')
+    parser.add_argument('--corrupt-rate', type=float, default=0.0,
+                        help='fraction of bodies sent in full with one byte flipped')
+    parser.add_argument('--noise-bits', type=int, default=2, choices=range(9),
+                        help='random low bits per colour, which sets the fragment size')
+    parser.add_argument('--host-latency', type=per_host(float), action='append', default=[],
+                        metavar='HOST=SECONDS')
+    parser.add_argument('--host-bandwidth', type=per_host(float), action='append', default=[],
+                        metavar='HOST=BYTES_PER_S')
+    parser.add_argument('--host-error-rate', type=per_host(float), action='append', default=[],
+                        metavar='HOST=FRACTION')
+    parser.add_argument('--images', type=int, nargs='*', default=[1],
+                        help='images to generate before accepting requests')
+    opts = parser.parse_args()
+    for name in ('host_latency', 'host_bandwidth', 'host_error_rate'):
+        setattr(opts, name, dict(getattr(opts, name)))
+
+    server = Server(opts)
+    for img in opts.images:
+        server.fragments(img)
+    print('serving on %s:%d' % (opts.bind, opts.port), flush=True)
+    server.serve_forever()
+
+
+if __name__ == '__main__':
+    main()
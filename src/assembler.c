@@ -0,0 +1,559 @@
+/*
+ * Assemble images out of the fragments that paster_nbio -D workers send
+ * in, from as many machines as you like:
+ *
+ *   assembler -l 4591 -b 1-10
+ *   paster_nbio -d -D assembler-host:4591 -b 1-10     on every worker
+ *
+ * Every fragment is painted into its image as it arrives, and every
+ * worker hears about it (see link.h), so between them they fetch each
+ * fragment about once. Each image is written as output.png, or with -b
+ * as output-N.png, as soon as it is complete, and once the last one is
+ * written the assembler exits.
+ *
+ * Nothing in the poll loop blocks, as every worker waits on it: the
+ * clients' sockets are non-blocking, with what they are sent queued until
+ * they take it, and the images are encoded on a thread of their own.
+ *
+ * This software may be freely redistributed under the terms of the X11
+ * license.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <png.h>
+
+#include "geometry.h"
+#include "link.h"
+
+#define MAX_QUEUED_BYTES (1 << 20)     // a worker this far behind isn't reading
+#define LINGER_MS 5000                 // for the last updates to go out
+
+struct image {
+  int img;
+  uint64_t have;                // fragments painted
+  png_bytep pixels;             // allocated with the first fragment, until it goes to the writer
+  bool complete;
+  char file_name[32];
+};
+
+struct client {
+  int fd;
+  struct linkbuf lb;
+  struct linkbuf out;           // queued for it; taken is how much of that has gone
+  bool gone;
+  int fragments, duplicates, corrupt;
+};
+
+/* complete images waiting for the writer thread, in the order they were
+ * finished */
+struct write_job {
+  png_bytep pixels;
+  const char * file_name;
+  struct write_job * next;
+};
+
+struct writer {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  struct write_job * head, * tail;
+  int to_go;                    // images not written yet
+};
+
+static struct image * images;
+static int num_images;
+static struct client * clients;
+static int num_clients;
+static struct writer writer;
+
+/* error handling macro */
+void abort_(const char * s, ...)
+{
+  va_list args;
+  va_start(args, s);
+  vfprintf(stderr, s, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+  abort();
+}
+
+double get_time (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* parse a list like 1-5,8 into *imgs; returns how many, or 0 if it's
+ * malformed */
+int parse_image_list (char * spec, int ** imgs)
+{
+  int num_imgs = 0, max_imgs = 16;
+  unsigned long first, last;
+  char * end;
+
+  *imgs = malloc(max_imgs * sizeof(int));
+  if (!*imgs)
+    abort_("[parse_image_list] malloc failed");
+
+  for (;;) {
+    first = last = strtoul(spec, &end, 10);
+    if (end == spec || first == 0)
+      return 0;
+    if (*end == '-') {
+      spec = end + 1;
+      last = strtoul(spec, &end, 10);
+      if (end == spec || last < first)
+	return 0;
+    }
+    for (; first <= last; ++first) {
+      if (num_imgs == max_imgs) {
+	max_imgs *= 2;
+	*imgs = realloc(*imgs, max_imgs * sizeof(int));
+	if (!*imgs)
+	  abort_("[parse_image_list] realloc failed");
+      }
+      (*imgs)[num_imgs++] = first;
+    }
+    if (*end == '\0')
+      return num_imgs;
+    if (*end != ',')
+      return 0;
+    spec = end + 1;
+  }
+}
+
+uint64_t all_fragments (void)
+{
+  return N == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << N) - 1;
+}
+
+struct image * find_image (int img)
+{
+  int i;
+
+  for (i = 0; i < num_images; ++i)
+    if (images[i].img == img)
+      return &images[i];
+  return NULL;
+}
+
+/* one worker talking nonsense (a stale -b list, another geometry) is no
+ * reason to throw away what everyone else has painted */
+void drop_client (struct client * c, const char * why)
+{
+  fprintf(stderr, "dropping a worker: %s\n", why);
+  c->gone = true;
+}
+
+/* queue a message for c, which flush_client sends once its socket will
+ * take it; a hung-up client is dropped on the next round of poll */
+void send_to (struct client * c, int type, int img, uint64_t arg)
+{
+  struct linkbuf * out = &c->out;
+  size_t size;
+  png_bytep buf;
+
+  if (c->gone)
+    return;
+  if (out->len - out->taken + LINK_HEADER_BYTES > MAX_QUEUED_BYTES) {
+    drop_client(c, "it isn't reading what it is sent");
+    return;
+  }
+  if (out->taken) {
+    memmove(out->buf, out->buf + out->taken, out->len - out->taken);
+    out->len -= out->taken;
+    out->taken = 0;
+  }
+  if (out->len + LINK_HEADER_BYTES > out->size) {
+    size = out->size ? out->size * 2 : 1 << 12;
+    buf = realloc(out->buf, size);
+    if (!buf)
+      abort_("[send_to] realloc failed");
+    out->buf = buf;
+    out->size = size;
+  }
+  pack_link_header(out->buf + out->len, type, img, arg, 0);
+  out->len += LINK_HEADER_BYTES;
+}
+
+/* send as much of c's queue as its socket takes without blocking */
+void flush_client (struct client * c)
+{
+  struct linkbuf * out = &c->out;
+  ssize_t sent;
+
+  while (!c->gone && out->taken < out->len) {
+    sent = send(c->fd, out->buf + out->taken, out->len - out->taken, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent > 0)
+      out->taken += sent;
+    else if (sent < 0 && errno == EINTR)
+      continue;
+    else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    else
+      c->gone = true;
+  }
+  if (out->taken == out->len)
+    out->taken = out->len = 0;
+}
+
+void close_client (struct client * c)
+{
+  close(c->fd);
+  free(c->lb.buf);
+  free(c->out.buf);
+}
+
+/* decode a fragment into its stripe of the image; false if it's corrupt
+ * or the wrong size */
+bool paint_fragment (struct image * im, int n, png_const_bytep png, size_t len)
+{
+  png_image stripe;
+
+  memset(&stripe, 0, sizeof(stripe));
+  stripe.version = PNG_IMAGE_VERSION;
+  if (!png_image_begin_read_from_memory(&stripe, png, len))
+    return false;
+  if (stripe.width != (png_uint_32) BUF_WIDTH || stripe.height != (png_uint_32) HEIGHT) {
+    png_image_free(&stripe);
+    return false;
+  }
+  stripe.format = PNG_FORMAT_RGBA;
+  return png_image_finish_read(&stripe, NULL, &im->pixels[(size_t) n*BUF_WIDTH*4], WIDTH*4, NULL);
+}
+
+/* encoding a whole image takes long enough to hold up every worker's
+ * updates, so the writer thread does it while the loop goes on */
+void *writer_function (void * arg)
+{
+  struct write_job * job;
+  png_image png;
+
+  for (;;) {
+    pthread_mutex_lock(&writer.lock);
+    while (!writer.head && writer.to_go)
+      pthread_cond_wait(&writer.ready, &writer.lock);
+    job = writer.head;
+    if (job)
+      writer.head = job->next;
+    pthread_mutex_unlock(&writer.lock);
+    if (!job)
+      return NULL;
+
+    memset(&png, 0, sizeof(png));
+    png.version = PNG_IMAGE_VERSION;
+    png.width = WIDTH;
+    png.height = HEIGHT;
+    png.format = PNG_FORMAT_RGBA;
+    if (!png_image_write_to_file(&png, job->file_name, 0, job->pixels, WIDTH*4, NULL))
+      abort_("[writer_function] %s: %s", job->file_name, png.message);
+
+    pthread_mutex_lock(&writer.lock);
+    writer.to_go--;
+    printf("wrote %s, %d to go\n", job->file_name, writer.to_go);
+    fflush(stdout);
+    pthread_mutex_unlock(&writer.lock);
+    free(job->pixels);
+    free(job);
+  }
+}
+
+void start_writer (int num_images)
+{
+  writer.to_go = num_images;
+  if (pthread_mutex_init(&writer.lock, NULL) || pthread_cond_init(&writer.ready, NULL) ||
+      pthread_create(&writer.thread, NULL, writer_function, NULL))
+    abort_("[start_writer] could not start the writer thread");
+}
+
+/* hand a complete image to the writer; its pixels are the writer's now */
+void write_image (struct image * im)
+{
+  struct write_job * job = malloc(sizeof(struct write_job));
+
+  if (!job)
+    abort_("[write_image] malloc failed");
+  job->pixels = im->pixels;
+  job->file_name = im->file_name;
+  job->next = NULL;
+  im->pixels = NULL;
+  im->complete = true;
+
+  pthread_mutex_lock(&writer.lock);
+  if (writer.head)
+    writer.tail->next = job;
+  else
+    writer.head = job;
+  writer.tail = job;
+  pthread_cond_signal(&writer.ready);
+  pthread_mutex_unlock(&writer.lock);
+}
+
+/* wait for the last image to be written */
+void stop_writer (void)
+{
+  pthread_join(writer.thread, NULL);
+  pthread_mutex_destroy(&writer.lock);
+  pthread_cond_destroy(&writer.ready);
+}
+
+/* a fragment from c; true if it finished its image */
+bool take_fragment (struct client * c, struct link_message * msg)
+{
+  struct image * im = find_image(msg->img);
+  char why[96];
+  uint64_t bit;
+  int i;
+
+  if (!im || msg->arg >= (uint64_t) N) {
+    snprintf(why, sizeof(why), "it sent fragment %llu of image %d, which isn't being assembled",
+	     (unsigned long long) msg->arg, msg->img);
+    drop_client(c, why);
+    return false;
+  }
+  bit = (uint64_t) 1 << msg->arg;
+
+  // another worker's copy got here first
+  if (im->complete || im->have & bit) {
+    c->duplicates++;
+    return false;
+  }
+
+  if (!im->pixels) {
+    im->pixels = calloc((size_t) WIDTH*HEIGHT*4, 1);
+    if (!im->pixels)
+      abort_("[take_fragment] image %d: malloc failed", im->img);
+  }
+  if (!paint_fragment(im, msg->arg, msg->body, msg->length)) {
+    // the next copy paints over whatever rows this one got to
+    c->corrupt++;
+    send_to(c, LINK_REJECT, im->img, msg->arg);
+    return false;
+  }
+  c->fragments++;
+  im->have |= bit;
+
+  // everybody can stop fetching it, and the image if that was the last
+  for (i = 0; i < num_clients; ++i)
+    send_to(&clients[i], LINK_HAVE, im->img, im->have);
+  if (im->have != all_fragments())
+    return false;
+  write_image(im);
+  return true;
+}
+
+void accept_client (int listen_fd)
+{
+  struct client * c;
+  int fd, one = 1, i;
+
+  fd = accept(listen_fd, NULL, NULL);
+  if (fd < 0)
+    return;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  clients = realloc(clients, (num_clients + 1) * sizeof(struct client));
+  if (!clients)
+    abort_("[accept_client] realloc failed");
+  c = &clients[num_clients++];
+  memset(c, 0, sizeof(*c));
+  c->fd = fd;
+
+  // a latecomer needn't fetch what the others have
+  for (i = 0; i < num_images; ++i)
+    if (images[i].have)
+      send_to(c, LINK_HAVE, images[i].img, images[i].complete ? all_fragments() : images[i].have);
+}
+
+int main(int argc, char **argv)
+{
+  int c, i, j, ready;
+  int img = 1;
+  int * imgs = NULL;
+  int remaining;
+  int listen_fd;
+  char * listen_spec = DEFAULT_LINK_PORT;
+  struct pollfd * fds = NULL;
+  struct link_message msg;
+  struct client * cl;
+  bool alive;
+  double start = 0;
+  int fragments = 0, duplicates = 0, corrupt = 0;
+
+  set_geometry(DEFAULT_WIDTH, DEFAULT_HEIGHT, DEFAULT_FRAGMENTS);
+  while ((c = getopt(argc, argv, "l:i:b:g:")) != -1) {
+    switch (c) {
+    case 'l':
+      listen_spec = optarg;
+      break;
+    case 'i':
+      img = strtoul(optarg, NULL, 10);
+      if (img == 0) {
+	printf("%s: option requires an argument > 0 -- 'i'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'b':
+      free(imgs);
+      num_images = parse_image_list(optarg, &imgs);
+      if (num_images == 0) {
+	printf("%s: option requires a list of images like 1-5,8 -- 'b'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'g':
+      if (!parse_geometry(optarg)) {
+	printf("%s: option requires an argument WIDTHxHEIGHT/N, N <= %d dividing WIDTH -- 'g'\n", argv[0], MAX_FRAGMENTS);
+	return -1;
+      }
+      break;
+    default:
+      printf("usage: %s [-l [host:]port] [-i img | -b list] [-g WIDTHxHEIGHT/N]\n", argv[0]);
+      return -1;
+    }
+  }
+
+  // without -b the batch is just the -i image, written where the
+  // pasters would write it
+  images = calloc(num_images ? num_images : 1, sizeof(struct image));
+  if (!images)
+    abort_("[main] images malloc failed");
+  if (!num_images) {
+    images[0].img = img;
+    strcpy(images[0].file_name, "output.png");
+    num_images = 1;
+  } else {
+    for (i = 0; i < num_images; ++i) {
+      images[i].img = imgs[i];
+      snprintf(images[i].file_name, sizeof(images[i].file_name), "output-%d.png", imgs[i]);
+    }
+  }
+  remaining = num_images;
+  start_writer(num_images);
+
+  listen_fd = open_link_socket(listen_spec, true);
+  if (listen_fd < 0)
+    abort_("[main] could not listen on %s", listen_spec);
+  printf("assembling on %s\n", listen_spec);
+  fflush(stdout);
+
+  while (remaining) {
+    fds = realloc(fds, (num_clients + 1) * sizeof(struct pollfd));
+    if (!fds)
+      abort_("[main] realloc failed");
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    for (i = 0; i < num_clients; ++i) {
+      fds[i+1].fd = clients[i].fd;
+      fds[i+1].events = POLLIN | (clients[i].out.len ? POLLOUT : 0);
+    }
+    if (poll(fds, num_clients + 1, -1) < 0) {
+      if (errno == EINTR)
+	continue;
+      abort_("[main] poll failed");
+    }
+
+    for (i = 0; i < num_clients && remaining; ++i) {
+      if (!(fds[i+1].revents & ~POLLOUT))
+	continue;
+      cl = &clients[i];
+      alive = fill_linkbuf(cl->fd, &cl->lb);
+      while (remaining && !cl->gone && take_link_message(&cl->lb, &msg)) {
+	if (msg.type != LINK_FRAGMENT) {
+	  drop_client(cl, "garbled message");
+	  break;
+	}
+	if (!start)
+	  start = get_time();
+	if (take_fragment(cl, &msg))
+	  remaining--;
+      }
+      if (!alive)
+	cl->gone = true;
+    }
+
+    // whatever that queued, and whatever was waiting for room
+    for (i = 0; i < num_clients; ++i)
+      flush_client(&clients[i]);
+
+    // drop whoever hung up, keeping their counts
+    for (i = j = 0; i < num_clients; ++i) {
+      if (clients[i].gone) {
+	close_client(&clients[i]);
+	fragments += clients[i].fragments;
+	duplicates += clients[i].duplicates;
+	corrupt += clients[i].corrupt;
+      } else {
+	clients[j++] = clients[i];
+      }
+    }
+    num_clients = j;
+
+    // only now, as dropping a client moves the others
+    if (fds[0].revents & POLLIN)
+      accept_client(listen_fd);
+  }
+
+  // The workers see the last image finished and hang up themselves, once
+  // they've had the last HAVE. Hanging up on one first, with what it sent
+  // since still unread, would reset the connection and could lose it that
+  // HAVE, so until it goes whatever it sends is read and thrown away; one
+  // that goes quiet for LINGER_MS gets hung up on
+  fds = realloc(fds, (num_clients + 1) * sizeof(struct pollfd));
+  if (!fds)
+    abort_("[main] realloc failed");
+  for (;;) {
+    for (i = j = 0; i < num_clients; ++i) {
+      flush_client(&clients[i]);
+      fds[i].fd = clients[i].gone ? -1 : clients[i].fd;
+      fds[i].events = POLLIN | (clients[i].out.len ? POLLOUT : 0);
+      if (!clients[i].gone)
+	j++;
+    }
+    if (!j)
+      break;
+    ready = poll(fds, num_clients, LINGER_MS);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready <= 0)
+      break;
+    for (i = 0; i < num_clients; ++i) {
+      if (!(fds[i].revents & ~POLLOUT))
+	continue;
+      cl = &clients[i];
+      if (!fill_linkbuf(cl->fd, &cl->lb))
+	cl->gone = true;
+      cl->lb.len = cl->lb.taken = 0;
+    }
+  }
+  for (i = 0; i < num_clients; ++i) {
+    close_client(&clients[i]);
+    fragments += clients[i].fragments;
+    duplicates += clients[i].duplicates;
+    corrupt += clients[i].corrupt;
+  }
+  close(listen_fd);
+  stop_writer();
+
+  printf("%d images in %.2f s, from %d fragments; %d duplicates, %d corrupt\n",
+	 num_images, start ? get_time() - start : 0.0, fragments, duplicates, corrupt);
+
+  free(fds);
+  free(clients);
+  free(images);
+  free(imgs);
+  return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * Adaptive concurrency (-A), shared by paster_parallel and paster_nbio:
+ * the controller that decides how many transfers to run at once. How a
+ * paster holds to the limit is its own business; paster_parallel's threads
+ * queue for permits, and paster_nbio's loop just starts no more.
+ *
+ * This software may be freely redistributed under the terms of the X11
+ * license.
+ */
+
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fetch.h"
+
+/***********************************************************************************/
+/* adaptive concurrency                                                            */
+
+/* With -A max, the number of transfers isn't fixed by -t but found while
+ * downloading. It starts at AUTOTUNE_START and is reconsidered after every
+ * window of completions, one per transfer but at least AUTOTUNE_MIN_WINDOW.
+ * Goodput is fragments per second, not counting races: duplicates of a
+ * fragment another transfer was still fetching. Duplicates of fragments
+ * already painted come at the same rate however many transfers there
+ * are, but races are concurrency's fault. While more transfers win more
+ * goodput, there are more, doubling at first and then one at a time; when
+ * mirrors fail or races pile up, the number halves. After AUTOTUNE_PATIENCE
+ * increases in a row that don't pay off, it settles on the best so far.
+ * None of this locks; a paster with more than one thread reporting
+ * outcomes keeps the controller under a lock of its own. */
+
+#define AUTOTUNE_START 2
+#define AUTOTUNE_MIN_WINDOW 8
+#define AUTOTUNE_GAIN 0.05          // an increase has to win 5% more goodput
+#define AUTOTUNE_PATIENCE 3
+#define AUTOTUNE_MAX_FAILURES 0.1   // per completion
+#define AUTOTUNE_MAX_RACES 0.1      // per completion
+
+enum outcome {OUTCOME_NONE, OUTCOME_NEW, OUTCOME_DUPLICATE, OUTCOME_RACED, OUTCOME_FAILED};
+
+struct autotune {
+  int limit, max;
+  bool slow_start;      // doubling until the first increase that doesn't pay
+  bool settled;
+  int misses;           // increases in a row that didn't pay
+  int best_limit;
+  double best_goodput;
+  long window_start_us;
+  int completions, failures, races;
+};
+
+static void init_autotune (struct autotune * at, int max)
+{
+  memset(at, 0, sizeof(*at));
+  at->max = max;
+  at->limit = at->best_limit = max < AUTOTUNE_START ? max : AUTOTUNE_START;
+  at->slow_start = true;
+  at->window_start_us = get_time_us();
+}
+
+static void end_window (struct autotune * at)
+{
+  double seconds = (get_time_us() - at->window_start_us) / 1e6;
+  double goodput = (at->completions - at->failures - at->races) / seconds;
+  int limit = at->limit;
+  bool settled = at->settled;
+
+  if (at->failures > AUTOTUNE_MAX_FAILURES * at->completions ||
+      at->races > AUTOTUNE_MAX_RACES * at->completions) {
+    // back off, then climb again one at a time
+    limit = at->limit > 1 ? at->limit / 2 : 1;
+    at->best_limit = limit;
+    at->best_goodput = 0;
+    at->misses = 0;
+    at->slow_start = false;
+    at->settled = false;
+  } else if (goodput > at->best_goodput * (1 + AUTOTUNE_GAIN)) {
+    at->best_goodput = goodput;
+    at->best_limit = at->limit;
+    at->misses = 0;
+    if (!at->settled)
+      limit = at->slow_start ? at->limit * 2 : at->limit + 1;
+  } else if (at->slow_start) {
+    // doubling overshot; look just above the best instead
+    at->slow_start = false;
+    limit = at->best_limit + 1;
+  } else if (!at->settled && ++at->misses >= AUTOTUNE_PATIENCE) {
+    at->settled = true;
+    limit = at->best_limit;
+  } else if (!at->settled) {
+    limit = at->limit + 1;
+  }
+
+  if (limit > at->max)
+    limit = at->max;
+  if (verbose && (limit != at->limit || at->settled != settled))
+    printf("%.1f fragments/s at %d transfers, %s %d\n", goodput, at->limit,
+	   at->settled ? "settled on" : "trying", limit);
+  at->limit = limit;
+
+  at->window_start_us = get_time_us();
+  at->completions = at->failures = at->races = 0;
+}
+
+static void record_outcome (struct autotune * at, enum outcome outcome)
+{
+  if (outcome == OUTCOME_NONE)
+    return;
+
+  at->completions++;
+  if (outcome == OUTCOME_FAILED)
+    at->failures++;
+  if (outcome == OUTCOME_RACED)
+    at->races++;
+  if (at->completions >= at->limit && at->completions >= AUTOTUNE_MIN_WINDOW)
+    end_window(at);
+}
+
+#endif
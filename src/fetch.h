@@ -0,0 +1,601 @@
+/*
+ * Fetching fragments, shared by all the pasters: the options every
+ * transfer's handle gets, curl's header callback that claims a fragment
+ * for the transfer, the pool of download buffers and the write callback
+ * that fills them, the counts of decoded and discarded fragments, and the
+ * timing histograms. All of it may be called from several threads at
+ * once.
+ *
+ * This software may be freely redistributed under the terms of the X11
+ * license.
+ */
+
+#ifndef FETCH_H
+#define FETCH_H
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <png.h>
+#include <curl/curl.h>
+
+#include "geometry.h"
+
+/* error handling macro */
+static void abort_(const char * s, ...)
+{
+  va_list args;
+  va_start(args, s);
+  vfprintf(stderr, s, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+  abort();
+}
+
+#ifdef DEBUG
+#define DEBUG_PRINT(x) (printf x)
+#else
+#define DEBUG_PRINT(x) /* DEBUG is not defined/enabled */
+#endif
+
+#define ECE459_HEADER "X-Ece459-Fragment: "
+#define CONTENT_LENGTH_HEADER "Content-Length: "
+
+// give up on a mirror that takes this long to accept a connection, or
+// that sends less than LOW_SPEED_LIMIT bytes/s for LOW_SPEED_TIME seconds
+#define CONNECT_TIMEOUT_MS 2000
+#define LOW_SPEED_LIMIT 4096
+#define LOW_SPEED_TIME 3
+
+// -c host:port sends every request there instead, keeping the mirror's
+// name in the Host header (for benchmarking against a local server)
+static struct curl_slist * connect_to;
+
+// -K closes every connection after its transfer instead of keeping it for
+// the next; -2 asks for HTTP/2
+static bool forbid_reuse;
+static bool use_http2;
+// -H caps the connections open to any one mirror, 0 for no limit
+static long max_host_connections;
+// DNS, connections and TLS sessions, if the paster shares them between
+// handles of its own
+static CURLSH * share;
+// the handles run under multi handles, whose transfers may share an
+// HTTP/2 connection
+static bool multiplexing;
+// the fragment-by-fragment progress on stdout, which a host embedding
+// libpaster seldom wants among its own output
+static bool verbose = true;
+
+/***********************************************************************************/
+/* fragment bitmaps                                                                */
+
+/* One bit per fragment, set and cleared with atomic read-modify-writes so
+ * that threads can claim fragments without taking a lock. */
+
+#define BITMAP_WORDS ((MAX_FRAGMENTS + 63) / 64)
+
+struct bitmap {
+  uint64_t words[BITMAP_WORDS];
+};
+
+/* sets bit n and returns whether it was set already */
+static bool test_and_set_bit (struct bitmap * map, int n)
+{
+  uint64_t bit = (uint64_t) 1 << (n % 64);
+
+  return __atomic_fetch_or(&map->words[n / 64], bit, __ATOMIC_ACQ_REL) & bit;
+}
+
+static inline bool test_bit (struct bitmap * map, int n)
+{
+  return __atomic_load_n(&map->words[n / 64], __ATOMIC_ACQUIRE) & (uint64_t) 1 << (n % 64);
+}
+
+static void clear_bit (struct bitmap * map, int n)
+{
+  __atomic_fetch_and(&map->words[n / 64], ~((uint64_t) 1 << (n % 64)), __ATOMIC_ACQ_REL);
+}
+
+/***********************************************************************************/
+/* connection reuse                                                                */
+
+/* Options every transfer's handle gets. A finished transfer leaves its
+ * connection in curl's cache, and the next request to the same mirror
+ * goes out over it without a DNS lookup or a TCP handshake; keep-alive
+ * probes stop idle connections from being dropped in between. */
+static void set_connection_options (CURL * curl)
+{
+  curl_easy_setopt(curl, CURLOPT_CONNECT_TO, connect_to);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(curl, CURLOPT_FORBID_REUSE, forbid_reuse ? 1L : 0L);
+  // a stalled transfer fails rather than holding up the run
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long) CONNECT_TIMEOUT_MS);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, (long) LOW_SPEED_LIMIT);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long) LOW_SPEED_TIME);
+  if (share)
+    curl_easy_setopt(curl, CURLOPT_SHARE, share);
+  if (use_http2) {
+    // h2 over TLS, or an upgrade from HTTP/1.1 for plain http
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2_0);
+    // Under a multi handle, wait for a connection that may multiplex
+    // rather than open another. A handle on its own runs one transfer at
+    // a time, so there is nothing to multiplex with, and waiting for a
+    // connection to multiplex over could wait forever
+    if (multiplexing)
+      curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+  }
+}
+
+/* for the pasters that run their transfers under a multi handle; call it
+ * before adding any */
+static inline void set_multi_options (CURLM * curlm, long max_connects)
+{
+  curl_multi_setopt(curlm, CURLMOPT_MAXCONNECTS, max_connects);
+  curl_multi_setopt(curlm, CURLMOPT_MAX_HOST_CONNECTIONS, max_host_connections);
+  curl_multi_setopt(curlm, CURLMOPT_PIPELINING, use_http2 ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+}
+
+/***********************************************************************************/
+/* routine used by curl to read headers                                            */
+
+struct headerdata {
+  int n;
+  long content_length;
+  bool duplicate;
+  bool discard_duplicates;
+  struct bitmap * received_fragments;
+  long received;        // body bytes, counted by write_cb
+};
+
+static size_t header_cb (char * buf, size_t size, size_t nmemb, void * userdata)
+{
+  struct headerdata * hd = userdata;
+  int bytes_in_header = size * nmemb;
+
+  if (bytes_in_header > strlen(ECE459_HEADER) && strncmp(buf, ECE459_HEADER, strlen(ECE459_HEADER)) == 0) {
+    // one ought to check that buf is 0-terminated
+    //  not guaranteed by spec (!)
+    hd->n = atoi(buf+strlen(ECE459_HEADER));
+    if (hd->n < 0 || hd->n >= N) {
+      // The mirror's fault, not the run's: returning short fails the
+      // transfer with CURLE_WRITE_ERROR, which is no duplicate, so the
+      // mirror goes into quarantine and the request is made again
+      fprintf(stderr, "fragment %d out of range\n", hd->n);
+      hd->n = -1;
+      return 0;
+    }
+    if (test_and_set_bit(hd->received_fragments, hd->n)) {
+      hd->duplicate = true;
+    } else if (verbose) {
+      printf("received fragment %d\n", hd->n);
+    }
+  }
+  else if (bytes_in_header > strlen(CONTENT_LENGTH_HEADER) && strncasecmp(buf, CONTENT_LENGTH_HEADER, strlen(CONTENT_LENGTH_HEADER)) == 0) {
+    hd->content_length = atol(buf+strlen(CONTENT_LENGTH_HEADER));
+  }
+  else if (hd->duplicate && hd->discard_duplicates && bytes_in_header <= 2) {
+    // the blank line ends the headers; returning short here makes curl
+    // abort the transfer with CURLE_WRITE_ERROR before the body is read
+    if (verbose)
+      printf("discarding duplicate fragment %d\n", hd->n);
+    return 0;
+  }
+  return bytes_in_header;
+}
+
+/* a transfer that claimed its fragment in header_cb but won't paint it
+ * gives the claim back, so that a later one can */
+static void unclaim_fragment (struct headerdata * hd)
+{
+  if (hd->n >= 0 && !hd->duplicate)
+    clear_bit(hd->received_fragments, hd->n);
+}
+
+/* a transfer's body, as write_cb collects it */
+struct bufdata {
+  png_bytep buf;
+  int len, pos;
+  size_t max_size;      // bytes allocated at buf
+  struct bufpool * pool;
+  struct headerdata * hd;
+  bool starved;         // the pool had no room for this transfer
+};
+
+/***********************************************************************************/
+/* pool of download buffers                                                        */
+
+/* A transfer takes its buffer from the pool when the first bytes of the body
+ * arrive, sized from Content-Length when the server sent one (and grown
+ * geometrically when it didn't), and hands it back once the fragment is
+ * decoded, so the next transfer on any connection can reuse it. All the
+ * buffers together, idle or not, never take more than cap bytes. */
+
+#define BUFPOOL_MIN_SIZE 65536
+#define BUFPOOL_GRANULE 16384
+#define BUFPOOL_MAX_IDLE 64
+#define BUFPOOL_DEFAULT_CAP_MB 64
+
+struct bufpool {
+  pthread_mutex_t lock;
+  pthread_cond_t released;
+  bool blocking;        // transfers that hold nothing wait for memory
+  png_bytep idle_bufs[BUFPOOL_MAX_IDLE];
+  size_t idle_sizes[BUFPOOL_MAX_IDLE];
+  int num_idle;
+  size_t allocated;     // bytes malloc'd, idle or handed out
+  size_t peak;
+  size_t cap;
+  int reused, starved;
+  unsigned releases;    // bumped every time a buffer comes back
+};
+
+static void init_bufpool (struct bufpool * pool, size_t cap, bool blocking)
+{
+  memset(pool, 0, sizeof(*pool));
+  pool->cap = cap;
+  pool->blocking = blocking;
+  if (pthread_mutex_init(&pool->lock, NULL) || pthread_cond_init(&pool->released, NULL))
+    abort_("[%s] pthread_mutex_init failed", __FUNCTION__);
+}
+
+/* give idle buffers back to malloc until `more' bytes fit under the cap;
+ * the caller holds pool->lock */
+static void trim_bufpool (struct bufpool * pool, size_t more)
+{
+  while (pool->allocated + more > pool->cap && pool->num_idle > 0) {
+    pool->num_idle--;
+    free(pool->idle_bufs[pool->num_idle]);
+    pool->allocated -= pool->idle_sizes[pool->num_idle];
+  }
+}
+
+/* Make bd->buf hold at least `want' bytes, keeping whatever it already
+ * holds. Returns false if that would take the pool over its cap, in which
+ * case the transfer should give up its buffer and be retried later; it
+ * had better not want more than the whole cap. */
+static bool reserve_buffer (struct bufpool * pool, struct bufdata * bd, size_t want)
+{
+  int i, best = -1;
+  png_bytep buf;
+
+  // no amount of waiting would make room
+  if (want > pool->cap)
+    return false;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    if (!bd->buf) {
+      // the smallest idle buffer that is big enough, if any
+      for (i = 0; i < pool->num_idle; ++i)
+	if (pool->idle_sizes[i] >= want && (best < 0 || pool->idle_sizes[i] < pool->idle_sizes[best]))
+	  best = i;
+      if (best >= 0) {
+	bd->buf = pool->idle_bufs[best];
+	bd->max_size = pool->idle_sizes[best];
+	pool->num_idle--;
+	pool->idle_bufs[best] = pool->idle_bufs[pool->num_idle];
+	pool->idle_sizes[best] = pool->idle_sizes[pool->num_idle];
+	pool->reused++;
+	pthread_mutex_unlock(&pool->lock);
+	return true;
+      }
+    }
+
+    trim_bufpool(pool, want - bd->max_size);
+    // Only a transfer that holds nothing may wait: everyone holding memory
+    // either finishes or fails, and both give their buffer back
+    if (!pool->blocking || bd->buf || pool->allocated + want <= pool->cap)
+      break;
+    pthread_cond_wait(&pool->released, &pool->lock);
+  }
+  if (pool->allocated + want - bd->max_size > pool->cap) {
+    pool->starved++;
+    pthread_mutex_unlock(&pool->lock);
+    return false;
+  }
+
+  buf = realloc(bd->buf, want);
+  if (!buf)
+    abort_("[%s] could not grow download buffer to %zu bytes", __FUNCTION__, want);
+  pool->allocated += want - bd->max_size;
+  if (pool->allocated > pool->peak)
+    pool->peak = pool->allocated;
+  bd->buf = buf;
+  bd->max_size = want;
+  pthread_mutex_unlock(&pool->lock);
+  return true;
+}
+
+static void release_buffer (struct bufpool * pool, struct bufdata * bd)
+{
+  if (!bd->buf)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->num_idle < BUFPOOL_MAX_IDLE) {
+    pool->idle_bufs[pool->num_idle] = bd->buf;
+    pool->idle_sizes[pool->num_idle] = bd->max_size;
+    pool->num_idle++;
+  } else {
+    free(bd->buf);
+    pool->allocated -= bd->max_size;
+  }
+  pool->releases++;
+  pthread_cond_broadcast(&pool->released);
+  pthread_mutex_unlock(&pool->lock);
+
+  bd->buf = NULL;
+  bd->max_size = 0;
+}
+
+static inline unsigned get_releases (struct bufpool * pool)
+{
+  unsigned releases;
+
+  pthread_mutex_lock(&pool->lock);
+  releases = pool->releases;
+  pthread_mutex_unlock(&pool->lock);
+
+  return releases;
+}
+
+static void cleanup_bufpool (struct bufpool * pool)
+{
+  printf("download buffers peaked at %zu KB of a %zu KB cap (%d reused, %d transfers over the cap)\n",
+	 pool->peak / 1024, pool->cap / 1024, pool->reused, pool->starved);
+  trim_bufpool(pool, pool->cap + 1);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->released);
+}
+
+/***********************************************************************************/
+/* routine used by curl to read from the network                                   */
+
+/* curl calls this to transfer data from the network into RAM */
+static size_t write_cb(char * ptr, size_t size, size_t nmemb, void *userdata) {
+  struct bufdata * bd = userdata;
+  size_t want = bd->pos + size * nmemb;
+
+  bd->hd->received += size * nmemb;
+  if (want > bd->max_size) {
+    // room for the whole body if we know how big it is, otherwise double
+    if (bd->hd->content_length > 0 && (size_t) bd->hd->content_length >= want) {
+      want = bd->hd->content_length;
+    } else {
+      if (want < 2 * bd->max_size)
+	want = 2 * bd->max_size;
+      if (want < BUFPOOL_MIN_SIZE)
+	want = BUFPOOL_MIN_SIZE;
+    }
+    // round up so that fragments of about the same size share buffers
+    want = (want + BUFPOOL_GRANULE - 1) / BUFPOOL_GRANULE * BUFPOOL_GRANULE;
+    // More than the whole cap is the mirror talking nonsense (a bogus
+    // Content-Length, say), not a pool that is busy for now: returning
+    // short without starving fails the transfer, and the mirror goes into
+    // quarantine
+    if (want > bd->pool->cap) {
+      fprintf(stderr, "fragment %d: %zu bytes do not fit under the %zu byte cap\n", bd->hd->n, want, bd->pool->cap);
+      return 0;
+    }
+    if (!reserve_buffer(bd->pool, bd, want)) {
+      bd->starved = true;
+      return 0;
+    }
+  }
+
+  memcpy(bd->buf+bd->pos, ptr, size * nmemb);
+  bd->pos += size*nmemb;
+  bd->len += size*nmemb;
+  return size * nmemb;
+}
+
+/***********************************************************************************/
+/* accounting for duplicate fragments                                              */
+
+struct dupstats {
+  int decoded;
+  double decode_time;
+  int discarded;
+  long bytes_saved;
+};
+
+static pthread_mutex_t dupstats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double get_time (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* count a fragment that went through read_png_file */
+static void record_decode (struct dupstats * ds, double seconds)
+{
+  pthread_mutex_lock(&dupstats_lock);
+  ds->decoded++;
+  ds->decode_time += seconds;
+  pthread_mutex_unlock(&dupstats_lock);
+}
+
+/* count a transfer that header_cb cut short; its Content-Length (if the
+ * server sent one) is what we didn't download */
+static void record_discard (struct dupstats * ds, struct headerdata * hd)
+{
+  pthread_mutex_lock(&dupstats_lock);
+  ds->discarded++;
+  if (hd->content_length > 0)
+    ds->bytes_saved += hd->content_length;
+  pthread_mutex_unlock(&dupstats_lock);
+}
+
+static void print_dupstats (struct dupstats * ds)
+{
+  double avg_decode_time = ds->decoded ? ds->decode_time / ds->decoded : 0;
+
+  printf("decoded %d fragments in %.3f s (%.3f ms each)\n",
+	 ds->decoded, ds->decode_time, avg_decode_time * 1000);
+  printf("discarded %d duplicate fragments, saving %ld bytes and ~%.3f s of decode\n",
+	 ds->discarded, ds->bytes_saved, ds->discarded * avg_decode_time);
+}
+
+/***********************************************************************************/
+/* timing histograms                                                               */
+
+/* Where the time goes, phase by phase: curl's timers for every finished
+ * transfer, per mirror, and decode, paint and encode times, per thread.
+ * Samples fall into power-of-two buckets of microseconds, so recording one
+ * costs a clock read and a few relaxed atomic adds (threads share the
+ * per-mirror histograms); -j writes the lot out as JSON once the output is
+ * written. */
+
+#define HIST_BUCKETS 32             // bucket b counts samples under 2^b us
+
+enum phase { PHASE_DNS, PHASE_CONNECT, PHASE_TTFB, PHASE_TRANSFER,
+	     PHASE_DECODE, PHASE_PAINT, PHASE_ENCODE, NUM_PHASES };
+
+static const char * phase_names[NUM_PHASES] = {
+  "dns", "connect", "ttfb", "transfer", "decode", "paint", "encode"
+};
+
+struct histogram {
+  unsigned long buckets[HIST_BUCKETS];
+  unsigned long samples;
+  unsigned long total_us;
+  unsigned long max_us;
+};
+
+struct timings {
+  struct histogram phases[NUM_PHASES];
+};
+
+static long get_time_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* somewhere between half and all of ms */
+static long jitter (long ms)
+{
+  unsigned long r = (unsigned long) get_time_us() * 2654435761u;
+
+  return ms / 2 + (long) ((r >> 16) % (ms / 2 + 1));
+}
+
+static void record_time (struct timings * t, enum phase phase, long us)
+{
+  struct histogram * h = &t->phases[phase];
+  unsigned long sample = us > 0 ? us : 0;
+  int b = sample ? 64 - __builtin_clzl(sample) : 0;
+  unsigned long max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+
+  __atomic_fetch_add(&h->buckets[b < HIST_BUCKETS ? b : HIST_BUCKETS - 1], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->samples, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->total_us, sample, __ATOMIC_RELAXED);
+  while (sample > max &&
+	 !__atomic_compare_exchange_n(&h->max_us, &max, sample, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/* split a finished transfer up with curl's timers, which all count from
+ * the start of the transfer; DNS and connect only count when it had to
+ * open a new connection */
+static void record_transfer (struct timings * t, CURL * curl)
+{
+  curl_off_t dns, connect, ttfb, total;
+  long connects;
+
+  curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+  curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+  curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+  curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+  curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+
+  if (connects > 0) {
+    record_time(t, PHASE_DNS, dns);
+    record_time(t, PHASE_CONNECT, connect - dns);
+  }
+  record_time(t, PHASE_TTFB, ttfb - connect);
+  record_time(t, PHASE_TRANSFER, total - ttfb);
+}
+
+static void print_histogram_json (FILE * f, struct histogram * h)
+{
+  int last = HIST_BUCKETS - 1;
+  int b;
+
+  while (last > 0 && !h->buckets[last])
+    --last;
+
+  fprintf(f, "{\"samples\": %lu, \"total_us\": %lu, \"max_us\": %lu, \"buckets\": [",
+	  h->samples, h->total_us, h->max_us);
+  for (b = 0; b <= last; ++b)
+    fprintf(f, b ? ", %lu" : "%lu", h->buckets[b]);
+  fprintf(f, "]}");
+}
+
+/* leaves out the phases that got no samples */
+static void print_timings_json (FILE * f, struct timings * t)
+{
+  bool first = true;
+  int p;
+
+  fprintf(f, "{");
+  for (p = 0; p < NUM_PHASES; ++p) {
+    if (!t->phases[p].samples)
+      continue;
+    fprintf(f, "%s\"%s\": ", first ? "" : ", ", phase_names[p]);
+    print_histogram_json(f, &t->phases[p]);
+    first = false;
+  }
+  fprintf(f, "}");
+}
+
+static void print_timings_list_json (FILE * f, const char * name, struct timings * t, int n)
+{
+  int i;
+
+  fprintf(f, "  \"%s\": [", name);
+  for (i = 0; i < n; ++i) {
+    fprintf(f, i ? ",\n    " : "\n    ");
+    print_timings_json(f, &t[i]);
+  }
+  fprintf(f, "\n  ],\n");
+}
+
+/* write every histogram to file_name as
+ * {"mirrors": [...], "threads": [...], "main": {...}}, and then whatever
+ * more(f, arg) adds, if there's more */
+static void dump_timings (const char * file_name, struct timings * mirrors, int num_mirrors,
+			  struct timings * threads, int num_threads, struct timings * main_thread,
+			  void (*more) (FILE * f, void * arg), void * arg)
+{
+  FILE * f = fopen(file_name, "w");
+
+  if (!f)
+    abort_("[dump_timings] File %s could not be opened for writing", file_name);
+
+  fprintf(f, "{\n");
+  print_timings_list_json(f, "mirrors", mirrors, num_mirrors);
+  print_timings_list_json(f, "threads", threads, num_threads);
+  fprintf(f, "  \"main\": ");
+  print_timings_json(f, main_thread);
+  if (more) {
+    fprintf(f, ",\n");
+    more(f, arg);
+  }
+  fprintf(f, "\n}\n");
+  fclose(f);
+}
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ * Image geometry, shared by all the pasters.
+ *
+ * An image is WIDTH x HEIGHT RGBA pixels, cut into N stripes of BUF_WIDTH
+ * columns that the servers hand out as fragments. The geometry is set at
+ * startup (-g WIDTHxHEIGHT/N, 4000x3000/20 by default), and fragments are
+ * checked against it as their PNG headers come in.
+ *
+ * This software may be freely redistributed under the terms of the X11
+ * license.
+ */
+
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#define DEFAULT_WIDTH 4000
+#define DEFAULT_HEIGHT 3000
+#define DEFAULT_FRAGMENTS 20
+#define MAX_FRAGMENTS 64        // the cache header has one 64-bit word of fragment bits
+
+struct geometry {
+  int width, height, n;
+  int buf_width;                // columns per stripe
+};
+
+static struct geometry geometry;
+
+#define N (geometry.n)
+#define WIDTH (geometry.width)
+#define HEIGHT (geometry.height)
+#define BUF_WIDTH (geometry.buf_width)
+#define BUF_HEIGHT HEIGHT
+
+/* sets the geometry; false if the stripes wouldn't come out whole */
+static bool set_geometry (int width, int height, int n)
+{
+  if (width <= 0 || height <= 0 || n <= 0 || n > MAX_FRAGMENTS || width % n)
+    return false;
+
+  geometry.width = width;
+  geometry.height = height;
+  geometry.n = n;
+  geometry.buf_width = width / n;
+  return true;
+}
+
+/* reads -g WIDTHxHEIGHT/N without setting it; false if set_geometry
+ * would refuse it */
+static bool scan_geometry (const char * spec, int * width, int * height, int * n)
+{
+  int end = 0;
+
+  if (sscanf(spec, "%dx%d/%d%n", width, height, n, &end) != 3 || spec[end])
+    return false;
+  return *width > 0 && *height > 0 && *n > 0 && *n <= MAX_FRAGMENTS && *width % *n == 0;
+}
+
+/* parses -g WIDTHxHEIGHT/N into the geometry */
+static bool parse_geometry (const char * spec)
+{
+  int width, height, n;
+
+  return scan_geometry(spec, &width, &height, &n) && set_geometry(width, height, n);
+}
+
+#endif
@@ -0,0 +1,835 @@
+/*
+ * The image and what becomes of it, shared by all the pasters: how the
+ * output buffer is laid out, decoding a fragment into it, and writing it
+ * out as a PNG (with libpng, or with paster_parallel's and paster_hybrid's
+ * encoder threads under -p), a stripe file (-o), a PAM (-r) or a
+ * checkpoint (-C).
+ *
+ * This software may be freely redistributed under the terms of the X11
+ * license.
+ */
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <png.h>
+#include <zlib.h>
+
+#include "geometry.h"
+#include "fetch.h"
+
+/***********************************************************************************/
+/* layout of the output buffer                                                     */
+
+/* Row-major, as the PNG has it, a stripe is BUF_WIDTH*4 bytes out of every
+ * WIDTH*4-byte row: painting one touches HEIGHT cache lines a whole row
+ * apart, and neighbouring stripes share the lines and pages at their
+ * edges. paster_parallel -S makes the buffer stripe-major instead (see
+ * map_stripes there). Every stripe is then a BUF_WIDTH x HEIGHT image of
+ * its own, padded to whole pages, so a paint is one sequential run and
+ * the pages are first touched by the thread that paints them. Only the
+ * encoders want whole rows, and gather them from the stripes one at a
+ * time. */
+
+static size_t stripe_pitch;     // bytes from one stripe to the next; 0 if row-major
+
+/* where row y of stripe n of dest is */
+static png_bytep stripe_row (png_byte * dest, int n, int y)
+{
+  if (stripe_pitch)
+    return &dest[n*stripe_pitch + (size_t) y*BUF_WIDTH*4];
+  return &dest[((size_t) y*WIDTH + n*BUF_WIDTH)*4];
+}
+
+/* row y of the image in dest; stripe-major, it is gathered into scratch,
+ * which has to hold WIDTH*4 bytes */
+static png_bytep image_row (png_byte * dest, int y, png_bytep scratch)
+{
+  int n;
+
+  if (!stripe_pitch)
+    return &dest[(size_t) y*WIDTH*4];
+  for (n = 0; n < N; ++n)
+    memcpy(&scratch[n*BUF_WIDTH*4], stripe_row(dest, n, y), BUF_WIDTH*4);
+  return scratch;
+}
+
+/***********************************************************************************/
+/* routines to parse PNG data and copy it to an internal buffer                    */
+
+static void read_cb (png_structp png_ptr, png_bytep outBytes, png_size_t byteCountToRead);
+
+/* Given PNG-formatted data at bd, decode it straight into the rows that
+ * row_pointers point at (see point_rows_at_destination). The fragment has to
+ * be 8-bit RGBA and fit in a BUF_WIDTH x BUF_HEIGHT stripe. Returns false
+ * for a body that isn't one, with whatever rows came before the damage
+ * painted; the caller has to fetch the fragment again. */
+static bool read_png_file(png_structp png_ptr, png_infop * info_ptr, struct bufdata * bd,
+		   png_bytep * row_pointers)
+{
+  int height;
+  png_byte bit_depth;
+
+  *info_ptr = png_create_info_struct(png_ptr);
+  if (!*info_ptr)
+    abort_("[read_png_file] png_create_info_struct failed");
+
+  if (bd->len < 8 || png_sig_cmp(bd->buf, 0, 8)) {
+    fprintf(stderr, "[read_png_file] Input is not recognized as a PNG file\n");
+    return false;
+  }
+
+  // libpng reports a corrupt body here, after printing what was wrong
+  if (setjmp(png_jmpbuf(png_ptr)))
+    return false;
+
+  bd->pos = 0;
+  png_set_read_fn(png_ptr, bd, read_cb);
+  png_read_info(png_ptr, *info_ptr);
+  height = png_get_image_height(png_ptr, *info_ptr);
+  bit_depth = png_get_bit_depth(png_ptr, *info_ptr);
+  if (bit_depth != 8)
+    png_error(png_ptr, "bit depth 16 PNG files unsupported");
+
+  // libpng writes rowbytes into each row, which must not spill into the
+  // neighbouring stripe
+  if (height > BUF_HEIGHT || png_get_rowbytes(png_ptr, *info_ptr) != BUF_WIDTH*4)
+    png_error(png_ptr, "fragment does not fit its stripe");
+
+  png_read_image(png_ptr, row_pointers);
+  return true;
+}
+
+/* libpng calls this (at read_png_data's request)
+ * to copy data from the in-RAM PNG into our bitmap */
+static void read_cb (png_structp png_ptr, png_bytep outBytes, png_size_t byteCountToRead) {
+  struct bufdata * bd = png_get_io_ptr(png_ptr);
+
+  if (bd == NULL)
+    abort_("[read_png_file/read_cb] invalid memory passed to png reader");
+  if (bd->pos + byteCountToRead >= bd->len)
+    png_error(png_ptr, "attempting to read beyond end of buffer");
+
+  memcpy(outBytes, bd->buf+bd->pos, byteCountToRead);
+  bd->pos += byteCountToRead;
+}
+
+/* point row_pointers at stripe n of dest, so that png_read_image writes
+ * the fragment where it belongs without a copy */
+static void point_rows_at_destination(png_bytep * row_pointers, int n, png_byte* dest)
+{
+  int y;
+
+  for (y=0; y<BUF_HEIGHT; y++)
+    row_pointers[y] = stripe_row(dest, n, y);
+}
+
+/***********************************************************************************/
+/* memory for the PNG readers                                                      */
+
+/* Every fragment gets a fresh read struct, since libpng can't reset one
+ * for a new image, and with it half a dozen blocks of libpng and zlib
+ * state (the inflate window alone is 32K), all freed again once it is
+ * decoded. The structs can't be reused, but their memory can: each
+ * decoder, and each -s stream, keeps an arena that create_read_struct
+ * points libpng at. It
+ * hands out memory by bumping a pointer, frees are no-ops, and it starts
+ * over with the next struct, so the decode never calls malloc. Whatever
+ * doesn't fit, with a geometry whose rows are unusually wide, goes to
+ * malloc as before. */
+
+#define ARENA_BASE_SIZE (64 << 10)  // libpng's and zlib's state, without the rows
+
+struct arena {
+  png_bytep base;
+  size_t used;
+  size_t size;
+};
+
+static void init_arena (struct arena * a)
+{
+  // libpng keeps the row being decoded and the one before it
+  a->size = ARENA_BASE_SIZE + 2 * (BUF_WIDTH*4 + 16);
+  a->base = malloc(a->size);
+  if (!a->base)
+    abort_("[init_arena] malloc failed");
+  a->used = 0;
+}
+
+static void cleanup_arena (struct arena * a)
+{
+  free(a->base);
+}
+
+static png_voidp arena_malloc (png_structp png_ptr, png_alloc_size_t size)
+{
+  struct arena * a = png_get_mem_ptr(png_ptr);
+  size_t at = (a->used + 15) & ~(size_t) 15;
+
+  if (size > a->size - at || at > a->size)
+    return malloc(size);
+  a->used = at + size;
+  return a->base + at;
+}
+
+static void arena_free (png_structp png_ptr, png_voidp ptr)
+{
+  struct arena * a = png_get_mem_ptr(png_ptr);
+
+  if ((png_bytep) ptr < a->base || (png_bytep) ptr >= a->base + a->size)
+    free(ptr);
+}
+
+/* a read struct allocating from a, whose last one must be destroyed */
+static png_structp create_read_struct (struct arena * a)
+{
+  a->used = 0;
+  return png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+				  a, arena_malloc, arena_free);
+}
+
+/***********************************************************************************/
+/* routine to write data to disk                                                   */
+
+/* row filters, by their names for -f; "all" lets the encoder pick one per
+ * row, which is what libpng does by default */
+enum filter { FILTER_NONE, FILTER_SUB, FILTER_UP, FILTER_AVG, FILTER_PAETH, FILTER_ALL, NUM_FILTERS };
+
+static const char * filter_names[NUM_FILTERS] = { "none", "sub", "up", "avg", "paeth", "all" };
+
+static const int png_filter_masks[NUM_FILTERS] = {
+  PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH, PNG_ALL_FILTERS
+};
+
+static int parse_filter (const char * name)
+{
+  int i;
+
+  for (i = 0; i < NUM_FILTERS; ++i)
+    if (!strcmp(name, filter_names[i]))
+      return i;
+  return -1;
+}
+
+/* write the image in output_buffer back to PNG file as specified by
+ * file_name. */
+static void write_png_file(const char * file_name, png_byte * output_buffer, int level, int filter)
+{
+  png_structp png_ptr;
+  png_infop info_ptr;
+  png_bytep scratch;
+  int y;
+
+  /* create file */
+  FILE *fp = fopen(file_name, "wb");
+  if (!fp)
+    abort_("[write_png_file] File %s could not be opened for writing", file_name);
+
+
+  /* initialize stuff */
+  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+
+  if (!png_ptr)
+    abort_("[write_png_file] png_create_write_struct failed");
+
+  info_ptr = png_create_info_struct(png_ptr);
+  if (!info_ptr)
+    abort_("[write_png_file] png_create_info_struct failed");
+
+  if (setjmp(png_jmpbuf(png_ptr)))
+    abort_("[write_png_file] Error during init_io");
+
+  png_init_io(png_ptr, fp);
+  png_set_compression_level(png_ptr, level);
+  png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, png_filter_masks[filter]);
+
+  /* write header */
+  if (setjmp(png_jmpbuf(png_ptr)))
+    abort_("[write_png_file] Error during writing header");
+
+  png_set_IHDR(png_ptr, info_ptr, WIDTH, HEIGHT,
+	       8, 6, PNG_INTERLACE_NONE,
+	       PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+  png_write_info(png_ptr, info_ptr);
+
+  /* write bytes */
+  scratch = malloc(WIDTH*4);
+  if (!scratch)
+    abort_("[write_png_file] malloc failed");
+  if (setjmp(png_jmpbuf(png_ptr)))
+    abort_("[write_png_file] Error during writing bytes");
+
+  for (y = 0; y < HEIGHT; ++y)
+    png_write_row(png_ptr, image_row(output_buffer, y, scratch));
+  free(scratch);
+
+  if (setjmp(png_jmpbuf(png_ptr)))
+    abort_("[write_png_file] Error during end of write");
+
+  png_write_end(png_ptr, NULL);
+
+  fclose(fp);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+}
+
+/***********************************************************************************/
+/* parallel PNG encoder                                                            */
+
+/* pigz-style: the image is cut into bands of rows, and encoder threads
+ * filter and deflate whole bands into raw deflate streams. Each band is
+ * primed with the filtered rows just above it (refiltered, since filtering
+ * only looks one row up), so matches still reach back across the seam.
+ * Every band but the last ends in a sync flush, which leaves it on a byte
+ * boundary; the streams then concatenate into one zlib stream, whose
+ * Adler-32 is stitched together from the bands' with adler32_combine. */
+
+#define ROW_BYTES (WIDTH*4)
+#define FILTERED_ROW_BYTES (ROW_BYTES+1)        // a filter type byte, then the row
+#define ENCODE_BAND_ROWS 64
+#define ENCODE_DICT_ROWS ((32768 + FILTERED_ROW_BYTES - 1) / FILTERED_ROW_BYTES)
+
+struct band {
+  png_bytep out;
+  size_t out_len;
+  uLong adler;          // of this band's filtered rows
+  uLong filtered_len;
+};
+
+struct encoder {
+  png_byte * image;
+  int level;
+  int filter;
+  struct band * bands;
+  int num_bands;
+  int next_band;
+  png_bytep zero_row;   // the row above the first
+};
+
+static inline int paeth (int a, int b, int c)
+{
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+  if (pa <= pb && pa <= pc)
+    return a;
+  return pb <= pc ? b : c;
+}
+
+/* filter one row into out (FILTERED_ROW_BYTES long); prev is the row above
+ * it, all zeroes for the first */
+static inline void filter_row (png_bytep out, png_bytep row, png_bytep prev, int filter)
+{
+  int i;
+
+  out[0] = filter;
+  out++;
+  switch (filter) {
+  case FILTER_NONE:
+    memcpy(out, row, ROW_BYTES);
+    break;
+  case FILTER_SUB:
+    memcpy(out, row, 4);
+    for (i = 4; i < ROW_BYTES; ++i)
+      out[i] = row[i] - row[i-4];
+    break;
+  case FILTER_UP:
+    for (i = 0; i < ROW_BYTES; ++i)
+      out[i] = row[i] - prev[i];
+    break;
+  case FILTER_AVG:
+    for (i = 0; i < 4; ++i)
+      out[i] = row[i] - prev[i] / 2;
+    for (i = 4; i < ROW_BYTES; ++i)
+      out[i] = row[i] - (row[i-4] + prev[i]) / 2;
+    break;
+  case FILTER_PAETH:
+    for (i = 0; i < 4; ++i)
+      out[i] = row[i] - prev[i];
+    for (i = 4; i < ROW_BYTES; ++i)
+      out[i] = row[i] - paeth(row[i-4], prev[i], prev[i-4]);
+    break;
+  }
+}
+
+/* libpng's heuristic for FILTER_ALL: try each filter and keep the one whose
+ * bytes, taken as signed, add up to the least */
+static inline void filter_row_adaptive (png_bytep out, png_bytep row, png_bytep prev, png_bytep scratch)
+{
+  unsigned long sum, best_sum = 0;
+  int filter, i;
+
+  for (filter = FILTER_NONE; filter <= FILTER_PAETH; ++filter) {
+    filter_row(scratch, row, prev, filter);
+    sum = 0;
+    for (i = 1; i < FILTERED_ROW_BYTES; ++i)
+      sum += abs((signed char) scratch[i]);
+    if (filter == FILTER_NONE || sum < best_sum) {
+      best_sum = sum;
+      memcpy(out, scratch, FILTERED_ROW_BYTES);
+    }
+  }
+}
+
+/* gathered holds two rows for image_row */
+static inline void encode_band (struct encoder * enc, int b, png_bytep filtered, png_bytep scratch,
+		  png_bytep gathered)
+{
+  struct band * band = &enc->bands[b];
+  int first = b * ENCODE_BAND_ROWS;
+  int last = first + ENCODE_BAND_ROWS < HEIGHT ? first + ENCODE_BAND_ROWS : HEIGHT;
+  int start = first > ENCODE_DICT_ROWS ? first - ENCODE_DICT_ROWS : 0;
+  size_t dict_len = (first - start) * FILTERED_ROW_BYTES;
+  png_bytep row_out, row, prev;
+  z_stream strm;
+  int y, res;
+
+  // a row and the one above it, never gathered into the same place
+  prev = start ? image_row(enc->image, start - 1, gathered) : enc->zero_row;
+  for (y = start; y < last; ++y) {
+    row = image_row(enc->image, y, &gathered[(y - start + 1) % 2 * ROW_BYTES]);
+    row_out = &filtered[(y - start) * FILTERED_ROW_BYTES];
+    if (enc->filter == FILTER_ALL)
+      filter_row_adaptive(row_out, row, prev, scratch);
+    else
+      filter_row(row_out, row, prev, enc->filter);
+    prev = row;
+  }
+  band->filtered_len = (last - first) * FILTERED_ROW_BYTES;
+  band->adler = adler32(adler32(0L, Z_NULL, 0), filtered + dict_len, band->filtered_len);
+
+  memset(&strm, 0, sizeof(strm));
+  if (deflateInit2(&strm, enc->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    abort_("[encode_band] deflateInit2 failed");
+  if (dict_len && deflateSetDictionary(&strm, filtered + (dict_len > 32768 ? dict_len - 32768 : 0),
+				       dict_len > 32768 ? 32768 : dict_len) != Z_OK)
+    abort_("[encode_band] deflateSetDictionary failed");
+
+  // a sync flush adds at most an empty stored block to the bound
+  band->out_len = deflateBound(&strm, band->filtered_len) + 16;
+  band->out = malloc(band->out_len);
+  if (!band->out)
+    abort_("[encode_band] malloc failed");
+
+  strm.next_in = filtered + dict_len;
+  strm.avail_in = band->filtered_len;
+  strm.next_out = band->out;
+  strm.avail_out = band->out_len;
+  res = deflate(&strm, last == HEIGHT ? Z_FINISH : Z_SYNC_FLUSH);
+  if (strm.avail_in || res != (last == HEIGHT ? Z_STREAM_END : Z_OK))
+    abort_("[encode_band] deflate failed");
+  band->out_len -= strm.avail_out;
+  deflateEnd(&strm);
+}
+
+static inline void * encoder_function (void * context)
+{
+  struct encoder * enc = context;
+  png_bytep filtered = malloc((ENCODE_DICT_ROWS + ENCODE_BAND_ROWS) * FILTERED_ROW_BYTES);
+  png_bytep scratch = malloc(FILTERED_ROW_BYTES);
+  png_bytep gathered = malloc(2 * ROW_BYTES);
+  int b;
+
+  if (!filtered || !scratch || !gathered)
+    abort_("[encoder_function] malloc failed");
+
+  while ((b = __atomic_fetch_add(&enc->next_band, 1, __ATOMIC_RELAXED)) < enc->num_bands)
+    encode_band(enc, b, filtered, scratch, gathered);
+
+  free(filtered);
+  free(scratch);
+  free(gathered);
+  return NULL;
+}
+
+/* a chunk's CRC covers its type and data, which may come in pieces */
+static inline void write_chunk_start (FILE * fp, const char * type, uLong len, uLong * crc)
+{
+  png_byte header[8];
+
+  png_save_uint_32(header, len);
+  memcpy(header + 4, type, 4);
+  if (fwrite(header, 1, 8, fp) != 8)
+    abort_("[write_png_file_parallel] Error during writing bytes");
+  *crc = crc32(crc32(0L, Z_NULL, 0), header + 4, 4);
+}
+
+static inline void write_chunk_data (FILE * fp, const void * data, size_t len, uLong * crc)
+{
+  if (fwrite(data, 1, len, fp) != len)
+    abort_("[write_png_file_parallel] Error during writing bytes");
+  *crc = crc32(*crc, data, len);
+}
+
+static inline void write_chunk_end (FILE * fp, uLong crc)
+{
+  png_byte trailer[4];
+
+  png_save_uint_32(trailer, crc);
+  if (fwrite(trailer, 1, 4, fp) != 4)
+    abort_("[write_png_file_parallel] Error during writing bytes");
+}
+
+/* write output_buffer to file_name like write_png_file does, with
+ * num_threads threads deflating at once; row-major or stripe-major, the
+ * encoders gather their rows with image_row */
+static inline void write_png_file_parallel(const char * file_name, png_byte * output_buffer,
+					    int level, int filter, int num_threads)
+{
+  static const png_byte signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+  struct encoder enc;
+  pthread_t * threads;
+  png_byte ihdr[13];
+  png_byte zlib_header[2], adler[4];
+  uLong crc, idat_len, total_adler;
+  int i;
+
+  FILE *fp = fopen(file_name, "wb");
+  if (!fp)
+    abort_("[write_png_file_parallel] File %s could not be opened for writing", file_name);
+
+  enc.image = output_buffer;
+  enc.level = level;
+  enc.filter = filter;
+  enc.num_bands = (HEIGHT + ENCODE_BAND_ROWS - 1) / ENCODE_BAND_ROWS;
+  enc.next_band = 0;
+  enc.bands = calloc(enc.num_bands, sizeof(struct band));
+  enc.zero_row = calloc(ROW_BYTES, 1);
+  threads = calloc(num_threads, sizeof(pthread_t));
+  if (!enc.bands || !enc.zero_row || !threads)
+    abort_("[write_png_file_parallel] calloc failed");
+
+  for (i = 0; i < num_threads; ++i)
+    if (pthread_create(&threads[i], NULL, encoder_function, &enc))
+      abort_("[write_png_file_parallel] failed to create encoder thread %d", i);
+  for (i = 0; i < num_threads; ++i)
+    pthread_join(threads[i], NULL);
+
+  // 8-bit RGBA, no interlacing, as in write_png_file
+  png_save_uint_32(ihdr, WIDTH);
+  png_save_uint_32(ihdr + 4, HEIGHT);
+  ihdr[8] = 8; ihdr[9] = 6; ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+  // zlib header: deflate with a 32K window, FLEVEL from the level, and a
+  // check value that makes the pair a multiple of 31
+  zlib_header[0] = 0x78;
+  zlib_header[1] = (level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6;
+  zlib_header[1] += (31 - (zlib_header[0] * 256 + zlib_header[1]) % 31) % 31;
+
+  total_adler = enc.bands[0].adler;
+  idat_len = sizeof(zlib_header) + sizeof(adler);
+  for (i = 0; i < enc.num_bands; ++i) {
+    if (i)
+      total_adler = adler32_combine(total_adler, enc.bands[i].adler, enc.bands[i].filtered_len);
+    idat_len += enc.bands[i].out_len;
+  }
+  png_save_uint_32(adler, total_adler);
+
+  if (fwrite(signature, 1, 8, fp) != 8)
+    abort_("[write_png_file_parallel] Error during writing header");
+  write_chunk_start(fp, "IHDR", sizeof(ihdr), &crc);
+  write_chunk_data(fp, ihdr, sizeof(ihdr), &crc);
+  write_chunk_end(fp, crc);
+
+  write_chunk_start(fp, "IDAT", idat_len, &crc);
+  write_chunk_data(fp, zlib_header, sizeof(zlib_header), &crc);
+  for (i = 0; i < enc.num_bands; ++i) {
+    write_chunk_data(fp, enc.bands[i].out, enc.bands[i].out_len, &crc);
+    free(enc.bands[i].out);
+  }
+  write_chunk_data(fp, adler, sizeof(adler), &crc);
+  write_chunk_end(fp, crc);
+
+  write_chunk_start(fp, "IEND", 0, &crc);
+  write_chunk_end(fp, crc);
+
+  if (fclose(fp))
+    abort_("[write_png_file_parallel] Error during end of write");
+  free(enc.bands);
+  free(enc.zero_row);
+  free(threads);
+}
+
+/***********************************************************************************/
+/* writing stripes out as they are painted                                         */
+
+/* With -o, the output is not one PNG but a stripe file: every fragment's
+ * stripe is encoded as a PNG of its own the moment it is painted and
+ * appended to the file, in whatever order they finish. Once all are in,
+ * an index goes on the end, so nothing is left to encode after the last
+ * fragment arrives. The index is, in big-endian words,
+ *
+ *   N times:        offset (64 bits), length (64 bits)   in fragment order
+ *   then:           width, height, N (32 bits each), "PSTRIPE1"
+ *
+ * bin/unstripe turns a stripe file back into an ordinary PNG. */
+
+#define STRIPEFILE_MAGIC "PSTRIPE1"
+
+struct stripefile {
+  int fd;
+  char * file_name;
+  int level, filter;
+  uint64_t offsets[MAX_FRAGMENTS];
+  uint64_t lengths[MAX_FRAGMENTS];
+  uint64_t end;
+};
+
+struct membuf {
+  png_bytep buf;
+  size_t len, size;
+};
+
+static void membuf_write_cb (png_structp png_ptr, png_bytep data, png_size_t length)
+{
+  struct membuf * mb = png_get_io_ptr(png_ptr);
+
+  if (mb->len + length > mb->size) {
+    while (mb->len + length > mb->size)
+      mb->size = mb->size ? mb->size * 2 : 1 << 16;
+    mb->buf = realloc(mb->buf, mb->size);
+    if (!mb->buf)
+      abort_("[membuf_write_cb] realloc failed");
+  }
+  memcpy(mb->buf + mb->len, data, length);
+  mb->len += length;
+}
+
+static void membuf_flush_cb (png_structp png_ptr)
+{
+}
+
+static void write_all (int fd, png_bytep buf, size_t len, uint64_t offset, char * file_name)
+{
+  ssize_t written;
+
+  while (len) {
+    written = pwrite(fd, buf, len, offset);
+    if (written < 0)
+      abort_("[write_all] Error writing to %s: %s", file_name, strerror(errno));
+    buf += written;
+    len -= written;
+    offset += written;
+  }
+}
+
+static void open_stripefile (struct stripefile * sf, char * file_name, int level, int filter)
+{
+  memset(sf, 0, sizeof(*sf));
+  sf->fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (sf->fd < 0)
+    abort_("[open_stripefile] File %s could not be opened for writing", file_name);
+  sf->file_name = file_name;
+  sf->level = level;
+  sf->filter = filter;
+}
+
+/* encode stripe n of dest as a PNG and append it */
+static void write_stripe (struct stripefile * sf, int n, png_byte * dest)
+{
+  png_bytep row_pointers[HEIGHT];
+  struct membuf mb = { NULL, 0, 0 };
+  png_structp png_ptr;
+  png_infop info_ptr;
+  uint64_t offset;
+  int y;
+
+  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (!png_ptr)
+    abort_("[write_stripe] png_create_write_struct failed");
+
+  info_ptr = png_create_info_struct(png_ptr);
+  if (!info_ptr)
+    abort_("[write_stripe] png_create_info_struct failed");
+
+  if (setjmp(png_jmpbuf(png_ptr)))
+    abort_("[write_stripe] Error during encoding");
+
+  png_set_write_fn(png_ptr, &mb, membuf_write_cb, membuf_flush_cb);
+  png_set_compression_level(png_ptr, sf->level);
+  png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, png_filter_masks[sf->filter]);
+  png_set_IHDR(png_ptr, info_ptr, BUF_WIDTH, HEIGHT,
+	       8, 6, PNG_INTERLACE_NONE,
+	       PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+  png_write_info(png_ptr, info_ptr);
+
+  for (y = 0; y < HEIGHT; ++y)
+    row_pointers[y] = stripe_row(dest, n, y);
+  png_write_image(png_ptr, row_pointers);
+  png_write_end(png_ptr, NULL);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+
+  // claim the next stretch of the file, then fill it in; with -w the
+  // decoders append at once
+  offset = __atomic_fetch_add(&sf->end, mb.len, __ATOMIC_RELAXED);
+  sf->offsets[n] = offset;
+  sf->lengths[n] = mb.len;
+
+  write_all(sf->fd, mb.buf, mb.len, offset, sf->file_name);
+  free(mb.buf);
+}
+
+static void save_uint_64 (png_bytep buf, uint64_t i)
+{
+  png_save_uint_32(buf, i >> 32);
+  png_save_uint_32(buf + 4, i & 0xffffffff);
+}
+
+/* put the index on the end; every stripe must have been written */
+static void close_stripefile (struct stripefile * sf)
+{
+  png_byte index[N*16 + 20];
+  int n;
+
+  for (n = 0; n < N; ++n) {
+    if (!sf->lengths[n])
+      abort_("[close_stripefile] stripe %d was never written", n);
+    save_uint_64(&index[n*16], sf->offsets[n]);
+    save_uint_64(&index[n*16 + 8], sf->lengths[n]);
+  }
+  png_save_uint_32(&index[N*16], WIDTH);
+  png_save_uint_32(&index[N*16 + 4], HEIGHT);
+  png_save_uint_32(&index[N*16 + 8], N);
+  memcpy(&index[N*16 + 12], STRIPEFILE_MAGIC, 8);
+
+  write_all(sf->fd, index, sizeof(index), sf->end, sf->file_name);
+  if (close(sf->fd))
+    abort_("[close_stripefile] Error closing %s: %s", sf->file_name, strerror(errno));
+}
+
+/***********************************************************************************/
+/* raw output                                                                      */
+
+/* With -r, the output is not a PNG but a PAM (netpbm's P7 as RGB_ALPHA):
+ * a few lines of text and then the pixels exactly as they are laid out
+ * in memory, for consumers that would only inflate a PNG again. The file
+ * is mapped and fragments are painted straight into it, so once the last
+ * one is in, there is nothing to encode and nothing to write. With -C the
+ * checkpoint is where the image is painted, and is copied over at the
+ * end. */
+
+struct rawfile {
+  int fd;
+  png_bytep map;
+  size_t size;
+  png_bytep image;              // WIDTH x HEIGHT, after the header
+};
+
+static void open_rawfile (struct rawfile * rf, char * file_name)
+{
+  char header[128];
+  int len;
+
+  len = snprintf(header, sizeof(header),
+		 "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+		 WIDTH, HEIGHT);
+  rf->size = len + (size_t) WIDTH * HEIGHT * 4;
+  rf->fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (rf->fd < 0)
+    abort_("[open_rawfile] File %s could not be opened for writing", file_name);
+  if (ftruncate(rf->fd, rf->size))
+    abort_("[open_rawfile] Error sizing %s: %s", file_name, strerror(errno));
+
+  rf->map = mmap(NULL, rf->size, PROT_READ | PROT_WRITE, MAP_SHARED, rf->fd, 0);
+  if (rf->map == MAP_FAILED)
+    abort_("[open_rawfile] Error mapping %s: %s", file_name, strerror(errno));
+  memcpy(rf->map, header, len);
+  rf->image = rf->map + len;
+}
+
+/* image is what was painted, which is rf->image itself unless -C */
+static void close_rawfile (struct rawfile * rf, png_bytep image)
+{
+  if (image != rf->image)
+    memcpy(rf->image, image, (size_t) WIDTH * HEIGHT * 4);
+  munmap(rf->map, rf->size);
+  close(rf->fd);
+}
+
+/***********************************************************************************/
+/* checkpoint of the image being assembled                                         */
+
+/* With -C dir, the image isn't assembled in memory but in dir/<img>.cache:
+ * a memory-mapped file holding a header page and then the image itself,
+ * raw RGBA, which fragments are decoded straight into. A fragment's bit in
+ * the header is only set once its stripe has been painted, so a run that
+ * is killed or crashes leaves a checkpoint, and the next run starts from
+ * the stripes in it and downloads just the rest. Nothing is copied out:
+ * the pages go back to the file whenever the kernel writes them, and at
+ * the latest when the process exits, however it exits. The file stays
+ * sparse until it fills up. Runs sharing a cache directory must not
+ * overlap. */
+
+#define CACHE_MAGIC "PCACHE02"
+#define CACHE_HEADER_BYTES 4096
+
+struct cache_header {
+  char magic[8];
+  uint32_t width, height, n;
+  uint64_t present;             // bit n is set once stripe n is complete
+};
+
+struct cache {
+  int fd;
+  png_bytep map;
+  size_t size;
+  png_bytep image;              // WIDTH x HEIGHT, after the header
+};
+
+/* map the checkpoint for img; returns the fragments already in it */
+static uint64_t open_cache (struct cache * fc, const char * dir, int img)
+{
+  char file_name[4096];
+  struct cache_header * h;
+
+  snprintf(file_name, sizeof(file_name), "%s/%d.cache", dir, img);
+  fc->size = CACHE_HEADER_BYTES + (size_t) WIDTH * HEIGHT * 4;
+  fc->fd = open(file_name, O_RDWR | O_CREAT, 0644);
+  if (fc->fd < 0)
+    abort_("[open_cache] File %s could not be opened: %s", file_name, strerror(errno));
+  if (ftruncate(fc->fd, fc->size))
+    abort_("[open_cache] Error sizing %s: %s", file_name, strerror(errno));
+
+  fc->map = mmap(NULL, fc->size, PROT_READ | PROT_WRITE, MAP_SHARED, fc->fd, 0);
+  if (fc->map == MAP_FAILED)
+    abort_("[open_cache] Error mapping %s: %s", file_name, strerror(errno));
+  fc->image = fc->map + CACHE_HEADER_BYTES;
+
+  // a new file, or one for another image geometry, starts out empty
+  h = (struct cache_header *) fc->map;
+  if (memcmp(h->magic, CACHE_MAGIC, 8) || h->width != WIDTH || h->height != HEIGHT || h->n != N) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, CACHE_MAGIC, 8);
+    h->width = WIDTH;
+    h->height = HEIGHT;
+    h->n = N;
+  }
+  return h->present;
+}
+
+/* stripe n is painted; a later run can keep it */
+static void checkpoint_stripe (struct cache * fc, int n)
+{
+  struct cache_header * h = (struct cache_header *) fc->map;
+
+  // other threads finish other stripes at the same time
+  __atomic_fetch_or(&h->present, (uint64_t) 1 << n, __ATOMIC_RELEASE);
+}
+
+static void close_cache (struct cache * fc)
+{
+  munmap(fc->map, fc->size);
+  close(fc->fd);
+}
+
+#endif
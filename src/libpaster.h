@@ -0,0 +1,122 @@
+/*
+ * libpaster: paster_nbio as a library.
+ *
+ * paster_create starts an engine, a thread running paster_nbio's event
+ * loop (with its decoders, if any), and paster_submit hands it images to
+ * assemble, from any thread, while it runs. The engine keeps its
+ * connections, buffers and mirror statistics from one image to the next,
+ * so a long-lived process pays for its slow start once rather than once
+ * per image. When an image is written, or given up on, on_complete is
+ * called with it on the engine's thread; it mustn't block for long, but
+ * it may submit more.
+ *
+ *   struct paster_options opts;
+ *   struct paster * p;
+ *
+ *   paster_default_options(&opts);
+ *   opts.discard_duplicates = true;
+ *   p = paster_create(&opts);
+ *   paster_submit(p, 1, "output-1.png", done, NULL);
+ *   paster_submit(p, 2, NULL, done, NULL);           // pixels, no file
+ *   paster_destroy(p);                              // waits for both
+ *
+ * The options are paster_nbio's, whose flags are noted beside them. There
+ * can only be one engine at a time, since the geometry and the mirrors
+ * are the whole process's. The engine only aborts on errors of its own,
+ * like running out of memory. Running out of budget isn't one: the images
+ * it leaves unfinished complete as PASTER_OVER_BUDGET, and the engine
+ * goes on with the rest. Nor are the servers: once every mirror keeps
+ * failing, or the assembler hangs up, every image open or queued
+ * completes as PASTER_FAILED and the engine stops, turning away anything
+ * submitted after; paster_destroy still has to be called.
+ *
+ * Only paster_nbio and paster_serve run on the engine. paster,
+ * paster_parallel and paster_hybrid share its fetch, decode and output
+ * helpers (fetch.h, image.h, mirrors.h, stream.h) but keep their own
+ * loops; they are not front-ends to it.
+ *
+ * This software may be freely redistributed under the terms of the X11
+ * license.
+ */
+
+#ifndef LIBPASTER_H
+#define LIBPASTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define PASTER_API __attribute__((visibility("default")))
+
+enum paster_output {
+  PASTER_PNG,                   // the image as a PNG, or its pixels
+  PASTER_STRIPES,               // -o: a stripe file, written as fragments are painted
+  PASTER_RAW,                   // -r: a PAM, painted in place
+};
+
+/* the strings must outlast the engine */
+struct paster_options {
+  int threads;                  // -t
+  int hedges;                   // -x, or -1 for as many as threads
+  int autotune_max;             // -A, 0 to stay at threads
+  int tail_at;                  // -k
+  int max_active;               // -a
+  bool discard_duplicates;      // -d
+  bool stream_decode;           // -s
+  int decoders;                 // -w
+  size_t buffer_cap_mb;         // -m
+  int level;                    // -z
+  const char * filter;          // -f, NULL for all
+  enum paster_output output;
+  const char * cache_dir;       // -C
+  const char * assembler;       // -D
+  bool uring;                   // -U
+  const char * connect_to;      // -c
+  bool forbid_reuse;            // -K
+  bool http2;                   // -2
+  int max_host_connections;     // -H
+  const char * geometry;        // -g, NULL for the default
+  const char * timings_file;    // -j, written by paster_destroy
+  long max_requests;            // -q, over the engine's life; 0 for no limit
+  size_t max_mb;                // -Q, likewise
+  long image_max_requests;      // -e, for each image; 0 for no limit
+  size_t image_max_mb;          // -E, likewise
+  bool ticker;                  // -v
+  bool verbose;                 // each fragment and so on on stdout, as paster_nbio does
+};
+
+enum paster_status {
+  PASTER_DONE,                  // written, or in pixels
+  PASTER_OVER_BUDGET,           // its own budget or the engine's ran out first; nothing written
+  PASTER_FAILED,                // the mirrors or the assembler gave out first; nothing written
+};
+
+struct paster_result {
+  int img;
+  enum paster_status status;
+  const char * file_name;       // as submitted
+  unsigned char * pixels;       // when done with no file name, WIDTH x HEIGHT RGBA for the callee to free
+  int width, height;
+};
+
+typedef void (*paster_callback) (const struct paster_result * result, void * arg);
+
+struct paster;
+
+PASTER_API void paster_default_options (struct paster_options * opts);
+
+/* what is wrong with opts, or NULL if they'll do */
+PASTER_API const char * paster_check_options (const struct paster_options * opts);
+
+/* NULL if opts don't check out, or there's an engine already */
+PASTER_API struct paster * paster_create (const struct paster_options * opts);
+
+/* assemble img into file_name, or with PASTER_PNG and no cache_dir into
+ * memory if it's NULL (or with an assembler, nowhere); on_complete may be
+ * NULL. -1 if it can't be done that way, or the engine has stopped */
+PASTER_API int paster_submit (struct paster * p, int img, const char * file_name,
+			      paster_callback on_complete, void * arg);
+
+/* finish every image submitted, print the statistics and stop */
+PASTER_API void paster_destroy (struct paster * p);
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * What paster_nbio -D workers and bin/assembler say to each other.
+ *
+ * The workers fetch fragments as usual but don't paint them: each new
+ * one goes to the assembler just as the server sent it, and the
+ * assembler paints it into the one copy of the image that every worker
+ * is filling in. In return the assembler tells every worker whenever it
+ * has painted a fragment, so the workers' received-fragment bitmaps
+ * follow the global one and nobody keeps fetching fragments that some
+ * other node has already got.
+ *
+ * A message is a header, in big-endian words
+ *
+ *   type (8 bits), img (32 bits), arg (64 bits), length (32 bits)
+ *
+ * then length bytes of body:
+ *
+ *   LINK_FRAGMENT  worker to assembler: fragment arg of img, as a PNG
+ *   LINK_HAVE      assembler to workers: bit n of arg is set for every
+ *                  fragment n of img the assembler has painted; sent to
+ *                  everyone when it paints one, and to a worker that just
+ *                  connected for every image it has started on
+ *   LINK_REJECT    assembler to the worker that sent fragment arg of
+ *                  img: it didn't decode, and has to be fetched again
+ *
+ * This software may be freely redistributed under the terms of the X11
+ * license.
+ */
+
+#ifndef LINK_H
+#define LINK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <png.h>
+
+#define LINK_FRAGMENT 'F'
+#define LINK_HAVE 'H'
+#define LINK_REJECT 'N'
+#define LINK_HEADER_BYTES 17
+#define LINK_MAX_LENGTH (64 << 20)      // no fragment is anywhere near
+#define DEFAULT_LINK_PORT "4591"
+
+struct link_message {
+  int type;
+  int img;
+  uint64_t arg;
+  uint32_t length;
+  png_bytep body;               // in the linkbuf, until the next message is taken
+};
+
+/* bytes received but not yet taken as messages */
+struct linkbuf {
+  png_bytep buf;
+  size_t len, size;
+  size_t taken;                 // the last message taken, dropped on the next fill
+};
+
+static void pack_link_header (png_bytep buf, int type, int img, uint64_t arg, uint32_t length)
+{
+  buf[0] = type;
+  png_save_uint_32(buf + 1, img);
+  png_save_uint_32(buf + 5, arg >> 32);
+  png_save_uint_32(buf + 9, arg & 0xffffffff);
+  png_save_uint_32(buf + 13, length);
+}
+
+/* false if the peer is gone */
+static bool send_all (int fd, png_const_bytep buf, size_t len)
+{
+  ssize_t sent;
+
+  while (len) {
+    sent = send(fd, buf, len, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent <= 0)
+      return false;
+    buf += sent;
+    len -= sent;
+  }
+  return true;
+}
+
+static inline bool send_link_message (int fd, int type, int img, uint64_t arg,
+				      png_const_bytep body, uint32_t length)
+{
+  png_byte header[LINK_HEADER_BYTES];
+
+  pack_link_header(header, type, img, arg, length);
+  return send_all(fd, header, sizeof(header)) && (!length || send_all(fd, body, length));
+}
+
+/* read whatever fd has without blocking; false once the peer has hung up
+ * (what came before can still be taken) */
+static bool fill_linkbuf (int fd, struct linkbuf * lb)
+{
+  ssize_t got;
+  size_t size;
+  png_bytep buf;
+
+  // the last message's body isn't needed any more
+  if (lb->taken) {
+    memmove(lb->buf, lb->buf + lb->taken, lb->len - lb->taken);
+    lb->len -= lb->taken;
+    lb->taken = 0;
+  }
+
+  for (;;) {
+    if (lb->len == lb->size) {
+      // on failure lb keeps the old buffer, for its owner to free
+      size = lb->size ? lb->size * 2 : 1 << 16;
+      buf = realloc(lb->buf, size);
+      if (!buf)
+	return false;
+      lb->buf = buf;
+      lb->size = size;
+    }
+    got = recv(fd, lb->buf + lb->len, lb->size - lb->len, MSG_DONTWAIT);
+    if (got > 0)
+      lb->len += got;
+    else if (got < 0 && errno == EINTR)
+      continue;
+    else
+      return got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+  }
+}
+
+/* the next whole message in lb, if there is one; a length over
+ * LINK_MAX_LENGTH comes back as type 0 */
+static bool take_link_message (struct linkbuf * lb, struct link_message * msg)
+{
+  png_bytep p = lb->buf + lb->taken;
+  size_t avail = lb->len - lb->taken;
+
+  if (avail < LINK_HEADER_BYTES)
+    return false;
+  msg->type = p[0];
+  msg->img = png_get_uint_32(p + 1);
+  msg->arg = (uint64_t) png_get_uint_32(p + 5) << 32 | png_get_uint_32(p + 9);
+  msg->length = png_get_uint_32(p + 13);
+  if (msg->length > LINK_MAX_LENGTH) {
+    msg->type = 0;
+    return true;
+  }
+  if (avail < LINK_HEADER_BYTES + (size_t) msg->length)
+    return false;
+  msg->body = p + LINK_HEADER_BYTES;
+  lb->taken += LINK_HEADER_BYTES + msg->length;
+  return true;
+}
+
+/* a socket connected to host[:port], or with listening set, listening on
+ * [host:]port; -1 if there's no such thing */
+static int open_link_socket (const char * spec, bool listening)
+{
+  struct addrinfo hints, * res, * ai;
+  char host[256];
+  const char * port = DEFAULT_LINK_PORT;
+  char * colon;
+  int fd = -1, one = 1;
+
+  snprintf(host, sizeof(host), "%s", spec);
+  if ((colon = strrchr(host, ':'))) {
+    *colon = '\0';
+    port = colon + 1;
+  } else if (listening) {
+    port = spec;
+    host[0] = '\0';
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = listening ? AI_PASSIVE : 0;
+  if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res))
+    return -1;
+
+  for (ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (listening) {
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, 64))
+	break;
+    } else if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+      // the updates are tiny, and shouldn't wait for each other
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+#endif
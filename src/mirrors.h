@@ -0,0 +1,199 @@
+/*
+ * Choosing which of the three mirrors each request goes to, shared by the
+ * pasters that have more than the one server to ask (paster_parallel,
+ * paster_hybrid and paster_nbio).
+ *
+ * This software may be freely redistributed under the terms of the X11
+ * license.
+ */
+
+#ifndef MIRRORS_H
+#define MIRRORS_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <curl/curl.h>
+
+#include "fetch.h"
+
+/***********************************************************************************/
+/* choosing a mirror                                                               */
+
+/* Each mirror keeps moving averages of its time to first byte and download
+ * rate, taken from curl's timers whenever a transfer to it finishes. New
+ * requests go to the mirror that should deliver an average fragment
+ * soonest, except one in every MIRROR_EXPLORE_EVERY, which goes to a random
+ * mirror so that we notice when a slow one speeds up again. A mirror that
+ * fails sits out for a while, about twice as long after each failure in
+ * a row; the jitter keeps transfers that failed together from coming back
+ * together.
+ * Everything is updated with atomics; two transfers finishing at once may
+ * lose a sample, which an average can afford. */
+
+#define NUM_MIRRORS 3
+#define BASE_URL_1 "http://berkeley.uwaterloo.ca:4590/image?img=%d"
+#define BASE_URL_2 "http://patricklam.ca:4590/image?img=%d"
+#define BASE_URL_3 "http://ece459-1.uwaterloo.ca:4590/image?img=%d"
+#define MIRROR_EXPLORE_EVERY 8
+#define MIRROR_EWMA_WEIGHT 4        // a new sample counts for 1/4
+#define MIRROR_QUARANTINE_MS 500
+#define MIRROR_MAX_FAILURES 6
+
+static const char * mirror_urls[NUM_MIRRORS] = { BASE_URL_1, BASE_URL_2, BASE_URL_3 };
+
+struct mirror {
+  long ttfb_us;                 // 0 until the first sample
+  long bytes_per_s;
+  long quarantined_until_ms;
+  int failures;                 // in a row
+  long requests;
+};
+
+static struct mirror mirrors[NUM_MIRRORS];
+static struct timings mirror_timings[NUM_MIRRORS];
+static long fragment_bytes;     // average over all mirrors
+static unsigned long mirror_picks;
+
+static long load_long (long * p)
+{
+  return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static void update_average (long * average, long sample)
+{
+  long old = load_long(average);
+
+  __atomic_store_n(average, old ? old + (sample - old) / MIRROR_EWMA_WEIGHT : sample, __ATOMIC_RELAXED);
+}
+
+/* how long an average fragment should take from this mirror; unknown
+ * mirrors look instant so that everyone gets tried once */
+static long predicted_us (struct mirror * m)
+{
+  long ttfb = load_long(&m->ttfb_us);
+  long rate = load_long(&m->bytes_per_s);
+  long bytes = load_long(&fragment_bytes);
+
+  if (!ttfb)
+    return 0;
+  return ttfb + (rate > 0 ? bytes * 1000000 / rate : 0);
+}
+
+//
+// Get url to get image from; returns the mirror it points at, which the
+// caller passes to mirror_succeeded or mirror_failed afterwards. Hedged
+// requests (spread) go round every mirror that is up, fast or not.
+//
+static int get_url (char ** url, int img, bool spread)
+{
+  unsigned long pick = __atomic_fetch_add(&mirror_picks, 1, __ATOMIC_RELAXED);
+  long now = get_time() * 1000;
+  long until, soonest_until = 0, us, best_us = 0;
+  int i, j, best = -1, soonest = 0;
+
+  // start the scan at a different mirror each time, so ties rotate
+  for (j = 0; j < NUM_MIRRORS; ++j) {
+    i = (pick + j) % NUM_MIRRORS;
+    until = load_long(&mirrors[i].quarantined_until_ms);
+    if (until > now) {
+      if (!soonest_until || until < soonest_until) {
+	soonest = i;
+	soonest_until = until;
+      }
+      continue;
+    }
+    us = predicted_us(&mirrors[i]);
+    if (best < 0 || us < best_us) {
+      best = i;
+      best_us = us;
+    }
+  }
+
+  if (best < 0) {
+    // all in quarantine; try the one that gets out first
+    best = soonest;
+  } else if (spread) {
+    for (j = 0; j < NUM_MIRRORS; ++j) {
+      i = (pick + j) % NUM_MIRRORS;
+      if (load_long(&mirrors[i].quarantined_until_ms) <= now) {
+	best = i;
+	break;
+      }
+    }
+  } else if (pick % MIRROR_EXPLORE_EVERY == MIRROR_EXPLORE_EVERY - 1) {
+    // Knuth's multiplicative hash of the pick number passes for random
+    i = (pick * 2654435761u >> 16) % NUM_MIRRORS;
+    if (load_long(&mirrors[i].quarantined_until_ms) <= now)
+      best = i;
+  }
+
+  __atomic_fetch_add(&mirrors[best].requests, 1, __ATOMIC_RELAXED);
+  sprintf(*url, mirror_urls[best], img);
+  return best;
+}
+
+/* fold a finished transfer's times, in us from its start, into its
+ * mirror's averages; a transfer cut short after the headers only tells us
+ * about time to first byte */
+static void record_mirror_sample (int mirror, long ttfb, long total, long bytes, bool got_body)
+{
+  struct mirror * m = &mirrors[mirror];
+
+  update_average(&m->ttfb_us, ttfb > 0 ? ttfb : 1);
+  if (got_body && bytes > 0) {
+    update_average(&fragment_bytes, bytes);
+    if (total > ttfb)
+      update_average(&m->bytes_per_s, bytes * 1000000 / (total - ttfb));
+  }
+  __atomic_store_n(&m->failures, 0, __ATOMIC_RELAXED);
+}
+
+static void mirror_succeeded (int mirror, CURL * curl, bool got_body)
+{
+  curl_off_t ttfb, total, bytes;
+
+  curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+  curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+  curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+  record_transfer(&mirror_timings[mirror], curl);
+  record_mirror_sample(mirror, ttfb, total, bytes, got_body);
+}
+
+/* whether every mirror has now failed MIRROR_MAX_FAILURES times in a row,
+ * which is past waiting out; what to do about it is the caller's */
+static bool mirror_failed (int mirror, const char * why)
+{
+  struct mirror * m = &mirrors[mirror];
+  int failures = __atomic_add_fetch(&m->failures, 1, __ATOMIC_RELAXED);
+  int i;
+
+  fprintf(stderr, "mirror %d failed (%s), %d in a row\n", mirror, why, failures);
+  __atomic_store_n(&m->quarantined_until_ms,
+		   (long) (get_time() * 1000) + jitter(MIRROR_QUARANTINE_MS << (failures < 8 ? failures - 1 : 7)),
+		   __ATOMIC_RELAXED);
+
+  for (i = 0; i < NUM_MIRRORS; ++i)
+    if (__atomic_load_n(&mirrors[i].failures, __ATOMIC_RELAXED) < MIRROR_MAX_FAILURES)
+      return false;
+  return true;
+}
+
+/* for paster_parallel and paster_hybrid, which have nobody to hand the
+ * mirrors giving out to */
+static inline void mirror_failed_or_abort (int mirror, const char * why)
+{
+  if (mirror_failed(mirror, why))
+    abort_("[%s] every mirror has failed %d times in a row", __FUNCTION__, MIRROR_MAX_FAILURES);
+}
+
+static void print_mirror_stats (void)
+{
+  int i;
+
+  for (i = 0; i < NUM_MIRRORS; ++i)
+    printf("mirror %d: %ld requests over %lu new connections, %.1f ms to first byte, %.0f KB/s\n", i,
+	   mirrors[i].requests, mirror_timings[i].phases[PHASE_CONNECT].samples,
+	   mirrors[i].ttfb_us / 1000.0, mirrors[i].bytes_per_s / 1024.0);
+}
+
+#endif
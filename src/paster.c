@@ -21,209 +21,52 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #define PNG_DEBUG 3
 #include <png.h>
 #include <curl/curl.h>
 
-struct bufdata {
-  png_bytep buf;
-  int len, pos;
-  size_t max_size;
-};
+#include "geometry.h"
 
-#define N 20
-#define WIDTH 4000
-#define HEIGHT 3000
+#include "fetch.h"
+#include "image.h"
+#include "stream.h"
 
-#define BASE_URL "http://berkeley.uwaterloo.ca:4590/image?img=%d"
-#define BUF_WIDTH WIDTH/N
-#define BUF_HEIGHT HEIGHT
-#define BUF_SIZE 10485760
-#define ECE459_HEADER "X-Ece459-Fragment: "
+#define DEFAULT_COMPRESSION_LEVEL 6    // zlib's own default
 
-/* error handling macro */
-void abort_(const char * s, ...)
-{
-  va_list args;
-  va_start(args, s);
-  vfprintf(stderr, s, args);
-  fprintf(stderr, "\n");
-  va_end(args);
-  abort();
-}
+#define BASE_URL "http://berkeley.uwaterloo.ca:4590/image?img=%d"
 
 /***********************************************************************************/
-/* routines to parse PNG data and copy it to an internal buffer */
-
-void read_cb (png_structp png_ptr, png_bytep outBytes, png_size_t byteCountToRead);
-
-/* Given PNG-formatted data at bd, read the data into a buffer that we allocate 
- * and return (row_pointers, here).
- *
- * Note: caller must free the returned value. */
-png_bytep* read_png_file(png_structp png_ptr, png_infop * info_ptr, struct bufdata * bd)
-{
-  int y;
-
-  int height;
-  png_byte bit_depth;
-
-  png_bytep * row_pointers;
-
-  if (png_sig_cmp(bd->buf, 0, 8))
-    abort_("[read_png_file] Input is not recognized as a PNG file");
-    
-  *info_ptr = png_create_info_struct(png_ptr);
-  if (!*info_ptr)
-    abort_("[read_png_file] png_create_info_struct failed");
-  
-  if (setjmp(png_jmpbuf(png_ptr)))
-    abort_("[read_png_file] Error during init_io");
-
-  bd->pos = 0;
-  png_set_read_fn(png_ptr, bd, read_cb);
-  png_read_info(png_ptr, *info_ptr);
-  height = png_get_image_height(png_ptr, *info_ptr);
-  bit_depth = png_get_bit_depth(png_ptr, *info_ptr);
-  if (bit_depth != 8)
-    abort_("[read_png_file] bit depth 16 PNG files unsupported");
-  
-  if (setjmp(png_jmpbuf(png_ptr)))
-    abort_("[read_png_file] Error during read_image");
+/* retrying failed transfers                                                       */
 
-  row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * BUF_HEIGHT);
-  for (y=0; y<height; y++)
-    row_pointers[y] = (png_byte*) malloc(png_get_rowbytes(png_ptr, *info_ptr));
-  
-  png_read_image(png_ptr, row_pointers);
-
-  return row_pointers;
-}
-
-/* libpng calls this (at read_png_data's request)
- * to copy data from the in-RAM PNG into our bitmap */
-void read_cb (png_structp png_ptr, png_bytep outBytes, png_size_t byteCountToRead) {
-  struct bufdata * bd = png_get_io_ptr(png_ptr);
+/* There is only the one server to ask, so a transfer that fails, or brings
+ * a PNG that won't decode, is tried again after a pause: about twice as
+ * long after each failure in a row, give or take some jitter. The
+ * fragments painted so far stay painted. After RETRY_MAX_FAILURES in a
+ * row it gives up, and what was painted is written out all the same,
+ * with the missing stripes left blank; with -C they are also in the
+ * checkpoint for the next run. */
 
-  if (bd == NULL)
-    abort_("[read_png_file/read_cb] invalid memory passed to png reader");
-  if (bd->pos + byteCountToRead >= bd->len)
-    abort_("[read_png_file/read_cb] attempting to read beyond end of buffer");
+#define RETRY_BACKOFF_MS 500
+#define RETRY_MAX_FAILURES 6
 
-  memcpy(outBytes, bd->buf+bd->pos, byteCountToRead);
-  bd->pos += byteCountToRead;
-}
-
-/* copy from row_pointers data array to dest data array, at offset (x0, y0) */
-void paint_destination(png_structp png_ptr, png_bytep * row_pointers, 
-		       int x0, int y0, png_byte* dest)
+/* false once it's time to give up */
+bool back_off (int * failures, const char * why)
 {
-  int x, y, i;
-  
-  for (y=0; y<BUF_HEIGHT && (y0+y) < HEIGHT; y++) {
-    png_byte* row = row_pointers[y];
-    for (x=0; x<BUF_WIDTH; x++) {
-      png_byte* ptr = &(row[x*4]);
-      int index = ((y0+y)*WIDTH+(x0+x))*4;
-      for (i = 0; i < 4; i++)
-	dest[index+i] = ptr[i];
-    }
-  }
-}
-
-/***********************************************************************************/
-/* routine used by curl to read from the network                                   */
-
-/* curl calls this to transfer data from the network into RAM */
-size_t write_cb(char * ptr, size_t size, size_t nmemb, void *userdata) {
-  struct bufdata * bd = userdata;
-
-  if (size * nmemb >= bd->max_size) {
-    return 0;
-  }
-
-  memcpy(bd->buf+bd->pos, ptr, size * nmemb);
-  bd->pos += size*nmemb;
-  bd->len += size*nmemb;
-  return size * nmemb;
-}
-
-/***********************************************************************************/
-/* routine to write data to disk                                                   */
-
-/* write output_row_pointers back to PNG file as specified by file_name. */
-void write_png_file(char* file_name, png_bytep * output_row_pointers)
-{
-  png_structp png_ptr;
-  png_infop info_ptr;
-
-  /* create file */
-  FILE *fp = fopen(file_name, "wb");
-  if (!fp)
-    abort_("[write_png_file] File %s could not be opened for writing", file_name);
-  
-  
-  /* initialize stuff */
-  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  
-  if (!png_ptr)
-    abort_("[write_png_file] png_create_write_struct failed");
-  
-  info_ptr = png_create_info_struct(png_ptr);
-  if (!info_ptr)
-    abort_("[write_png_file] png_create_info_struct failed");
-  
-  if (setjmp(png_jmpbuf(png_ptr)))
-    abort_("[write_png_file] Error during init_io");
-  
-  png_init_io(png_ptr, fp);
-  
-  /* write header */
-  if (setjmp(png_jmpbuf(png_ptr)))
-    abort_("[write_png_file] Error during writing header");
-  
-  png_set_IHDR(png_ptr, info_ptr, WIDTH, HEIGHT,
-	       8, 6, PNG_INTERLACE_NONE,
-	       PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-  
-  png_write_info(png_ptr, info_ptr);
-  
-  /* write bytes */
-  if (setjmp(png_jmpbuf(png_ptr)))
-    abort_("[write_png_file] Error during writing bytes");
-  
-  png_write_image(png_ptr, output_row_pointers);  
-  
-  if (setjmp(png_jmpbuf(png_ptr)))
-    abort_("[write_png_file] Error during end of write");
-  
-  png_write_end(png_ptr, NULL);
-    
-  fclose(fp);
-  png_destroy_write_struct(&png_ptr, &info_ptr);
-}
-
-struct headerdata {
-  int n;
-  bool * received_fragments;
-};
-
-size_t header_cb (char * buf, size_t size, size_t nmemb, void * userdata)
-{
-  struct headerdata * hd = userdata;
-  int bytes_in_header = size * nmemb;
-
-  if (bytes_in_header > strlen(ECE459_HEADER) && strncmp(buf, ECE459_HEADER, strlen(ECE459_HEADER)) == 0) {
-    // one ought to check that buf is 0-terminated
-    //  not guaranteed by spec (!)
-    hd->n = atoi(buf+strlen(ECE459_HEADER));
-    hd->received_fragments[hd->n] = true;
-    printf("received fragment %d\n", hd->n);
-  }
-  return bytes_in_header;
+  ++*failures;
+  fprintf(stderr, "transfer failed (%s), %d in a row\n", why, *failures);
+  if (*failures >= RETRY_MAX_FAILURES)
+    return false;
+  usleep(jitter(RETRY_BACKOFF_MS << (*failures - 1)) * 1000);
+  return true;
 }
 
 /***********************************************************************************/
@@ -234,9 +77,34 @@ int main(int argc, char **argv)
   int num_threads = 4;
   int img = 1;
   bool received_all_fragments = false;
-  bool * received_fragments = calloc(N, sizeof(bool));
-
-  while ((c = getopt (argc, argv, "t:i:")) != -1) {
+  int failures = 0;
+  bool gave_up = false;
+  int missing;
+  bool corrupt;
+  bool discard_duplicates = false;
+  bool stream_decode = false;
+  struct bitmap received_fragments = { { 0 } };
+  struct dupstats ds = { 0 };
+  size_t buffer_cap_mb = BUFPOOL_DEFAULT_CAP_MB;
+  struct bufpool pool;
+  struct arena arena;
+  struct timings mirror_timings = { { { { 0 } } } };
+  struct timings timings = { { { { 0 } } } };
+  struct timings main_timings = { { { { 0 } } } };
+  char * timings_file = NULL;
+  int level = DEFAULT_COMPRESSION_LEVEL;
+  int filter = FILTER_ALL;
+  char * stripe_file = NULL;
+  struct stripefile stripes;
+  char * raw_file = NULL;
+  struct rawfile raw = { 0 };
+  char * cache_dir = NULL;
+  struct cache cache = { 0 };
+  uint64_t cached = 0;
+  long start_us, decode_us, end_us;
+
+  set_geometry(DEFAULT_WIDTH, DEFAULT_HEIGHT, DEFAULT_FRAGMENTS);
+  while ((c = getopt (argc, argv, "t:i:dsm:c:K2j:z:f:o:C:g:r:")) != -1) {
     switch (c) {
     case 't':
       num_threads = strtoul(optarg, NULL, 10);
@@ -252,84 +120,294 @@ int main(int argc, char **argv)
 	return -1;
       }
       break;
+    case 'd':
+      discard_duplicates = true;
+      break;
+    case 's':
+      stream_decode = true;
+      break;
+    case 'm':
+      buffer_cap_mb = strtoul(optarg, NULL, 10);
+      if (buffer_cap_mb == 0) {
+	printf("%s: option requires an argument > 0 -- 'm'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'c':
+      {
+	char spec[256];
+
+	snprintf(spec, sizeof(spec), "::%s", optarg);
+	connect_to = curl_slist_append(connect_to, spec);
+      }
+      break;
+    case 'K':
+      forbid_reuse = true;
+      break;
+    case '2':
+      use_http2 = true;
+      break;
+    case 'j':
+      timings_file = optarg;
+      break;
+    case 'o':
+      stripe_file = optarg;
+      break;
+    case 'r':
+      raw_file = optarg;
+      break;
+    case 'C':
+      cache_dir = optarg;
+      break;
+    case 'g':
+      if (!parse_geometry(optarg)) {
+	printf("%s: option requires an argument WIDTHxHEIGHT/N, N <= %d dividing WIDTH -- 'g'\n", argv[0], MAX_FRAGMENTS);
+	return -1;
+      }
+      break;
+    case 'z':
+      level = strtoul(optarg, NULL, 10);
+      if (level > 9) {
+	printf("%s: option requires an argument 0-9 -- 'z'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'f':
+      filter = parse_filter(optarg);
+      if (filter < 0) {
+	printf("%s: option requires none, sub, up, avg, paeth or all -- 'f'\n", argv[0]);
+	return -1;
+      }
+      break;
     default:
       return -1;
     }
   }
+  if (stripe_file && raw_file) {
+    printf("%s: -o and -r write different kinds of output; pick one\n", argv[0]);
+    return -1;
+  }
+
+  if (stripe_file)
+    open_stripefile(&stripes, stripe_file, level, filter);
+  if (raw_file)
+    open_rawfile(&raw, raw_file);
 
   CURL *curl;
   CURLcode res;
   png_structp png_ptr;
   png_infop info_ptr;
   
-  png_byte * output_buffer = calloc(WIDTH*HEIGHT*4, sizeof(png_byte));
+  png_byte * output_buffer;
+
+  // whatever the checkpoint has needn't be downloaded
+  if (cache_dir) {
+    cached = open_cache(&cache, cache_dir, img);
+    output_buffer = cache.image;
+  } else if (raw_file) {
+    output_buffer = raw.image;
+  } else {
+    output_buffer = calloc(WIDTH*HEIGHT*4, sizeof(png_byte));
+  }
+  received_all_fragments = true;
+  for (int i = 0; i < N; i++) {
+    if (cached >> i & 1) {
+      test_and_set_bit(&received_fragments, i);
+      if (stripe_file)
+        write_stripe(&stripes, i, output_buffer);
+    } else {
+      received_all_fragments = false;
+    }
+  }
+  if (cache_dir)
+    printf("%d fragments from the cache\n", __builtin_popcountll(cached));
 
   curl = curl_easy_init();
   if (!curl)
     abort_("[main] could not initialize curl");
 
   char * url = malloc(sizeof(char)*strlen(BASE_URL)+4*5);
-  png_bytep input_buffer = malloc(sizeof(png_byte)*BUF_SIZE);
+  png_bytep * row_pointers = NULL;
+
+  struct headerdata hd; hd.received_fragments = &received_fragments;
+  hd.discard_duplicates = discard_duplicates;
 
   struct bufdata bd; 
-  bd.buf = input_buffer; 
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_cb);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &bd);
+  struct streamdata sd;
+  if (stream_decode) {
+    // decode as the body arrives; nothing needs to be buffered
+    sd.hd = &hd; sd.dest = output_buffer;
+    init_stream(&sd);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, stream_write_cb);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sd);
+  } else {
+    init_bufpool(&pool, buffer_cap_mb << 20, false);
+    init_arena(&arena);
+    row_pointers = malloc(sizeof(png_bytep)*BUF_HEIGHT);
+    bd.buf = NULL; bd.max_size = 0;
+    bd.pool = &pool; bd.hd = &hd;
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_cb);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &bd);
+  }
 
-  struct headerdata hd; hd.received_fragments = received_fragments;
   curl_easy_setopt(curl, CURLOPT_HEADERDATA, &hd);
   curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_cb);
+  set_connection_options(curl);
+  // an overloaded server answering 5xx counts as a failure, not a fragment
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
 
   // request appropriate URL
   sprintf(url, BASE_URL, img);
   printf("requesting URL %s\n", url);
   curl_easy_setopt(curl, CURLOPT_URL, url);
 
-  do {
-    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png_ptr)
-      abort_("[main] png_create_read_struct failed");
+  while (!received_all_fragments && !gave_up) {
+    if (stream_decode) {
+      start_stream(&sd);
+    } else {
+      png_ptr = create_read_struct(&arena);
+      if (!png_ptr)
+        abort_("[main] png_create_read_struct failed");
+    }
 
     // reset input buffer
-    bd.len = bd.pos = 0; bd.max_size = BUF_SIZE;
+    bd.len = bd.pos = 0; bd.starved = false;
+    hd.n = -1; hd.duplicate = false; hd.content_length = -1;
 
     // do curl request; check for errors
     res = curl_easy_perform(curl);
-    if(res != CURLE_OK)
-      abort_("[main] curl_easy_perform() failed: %s\n",
-              curl_easy_strerror(res));
-
-    // read PNG (as downloaded from network) and copy it to output buffer
-    png_bytep* row_pointers = read_png_file(png_ptr, &info_ptr, &bd);
-    paint_destination(png_ptr, row_pointers, hd.n*BUF_WIDTH, 0, output_buffer);
+    if (res == CURLE_WRITE_ERROR && hd.duplicate) {
+      // header_cb already knew we had this one; ask again straight away.
+      // The server is fine, so the failures are no longer in a row
+      failures = 0;
+      record_discard(&ds, &hd);
+      record_transfer(&mirror_timings, curl);
+      if (stream_decode) {
+        end_stream(&sd);
+      } else {
+        png_destroy_read_struct(&png_ptr, NULL, NULL);
+        release_buffer(&pool, &bd);
+      }
+      continue;
+    }
+    if (res != CURLE_OK) {
+      gave_up = !back_off(&failures, stream_decode && sd.corrupt ? "corrupt PNG" : curl_easy_strerror(res));
+      unclaim_fragment(&hd);
+      if (stream_decode) {
+        end_stream(&sd);
+      } else {
+        png_destroy_read_struct(&png_ptr, NULL, NULL);
+        release_buffer(&pool, &bd);
+      }
+      continue;
+    }
+    record_transfer(&mirror_timings, curl);
+
+    corrupt = false;
+    if (stream_decode) {
+      // stream_write_cb has painted the fragment already, unless it's one
+      // we had
+      if (!hd.duplicate && !sd.finished) {
+        // the body ended before the PNG did
+        corrupt = true;
+      } else if (!hd.duplicate) {
+        record_decode(&ds, sd.decode_time);
+        record_time(&timings, PHASE_DECODE, sd.decode_time * 1e6 - sd.paint_us);
+        record_time(&timings, PHASE_PAINT, sd.paint_us);
+      }
+      end_stream(&sd);
+    } else if (hd.duplicate) {
+      // The first copy of a fragment is final. Decoding another over it
+      // gains nothing, and would spoil the stripe if the copy were corrupt
+      png_destroy_read_struct(&png_ptr, NULL, NULL);
+    } else {
+      // read PNG (as downloaded from network) and copy it to output buffer
+      // libpng decodes straight into the output buffer, so all there is
+      // to painting is pointing the rows at it
+      start_us = get_time_us();
+      point_rows_at_destination(row_pointers, hd.n, output_buffer);
+      decode_us = get_time_us();
+      corrupt = !read_png_file(png_ptr, &info_ptr, &bd, row_pointers);
+      end_us = get_time_us();
+      record_time(&timings, PHASE_PAINT, decode_us - start_us);
+      record_time(&timings, PHASE_DECODE, end_us - decode_us);
+      record_decode(&ds, (end_us - decode_us) / 1e6);
+
+      // free allocated memory
+      png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    }
+    if (!stream_decode)
+      release_buffer(&pool, &bd);
+
+    if (corrupt) {
+      // the next copy paints over whatever rows this one got to
+      gave_up = !back_off(&failures, "corrupt PNG");
+      unclaim_fragment(&hd);
+      continue;
+    }
+    failures = 0;
 
-    // free allocated memory
-    for (int y=0; y<BUF_HEIGHT; y++)
-      free(row_pointers[y]);
-    free(row_pointers);
-    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    if (stripe_file && !hd.duplicate) {
+      start_us = get_time_us();
+      write_stripe(&stripes, hd.n, output_buffer);
+      record_time(&timings, PHASE_ENCODE, get_time_us() - start_us);
+    }
+    if (cache_dir && !hd.duplicate)
+      checkpoint_stripe(&cache, hd.n);
 
     // check for unreceived fragments
     received_all_fragments = true;
     for (int i = 0; i < N; i++)
-      if (!received_fragments[i])
+      if (!test_bit(&received_fragments, i))
         received_all_fragments = false;
-  } while (!received_all_fragments);
+  }
   free(url);
-  free(input_buffer);
+  free(row_pointers);
+
+  if (gave_up) {
+    missing = 0;
+    for (int i = 0; i < N; i++) {
+      if (test_bit(&received_fragments, i))
+        continue;
+      missing++;
+      // blank, rather than whatever rows a corrupt copy got to; with -o
+      // it is written too, so that the file is whole
+      for (int y = 0; y < HEIGHT; y++)
+        memset(stripe_row(output_buffer, i, y), 0, BUF_WIDTH*4);
+      if (stripe_file)
+        write_stripe(&stripes, i, output_buffer);
+    }
+    fprintf(stderr, "giving up after %d failures in a row, %d fragments missing\n", failures, missing);
+  }
 
   curl_easy_cleanup(curl);
+  curl_slist_free_all(connect_to);
+  print_dupstats(&ds);
+  if (stream_decode) {
+    cleanup_stream(&sd);
+  } else {
+    cleanup_bufpool(&pool);
+    cleanup_arena(&arena);
+  }
 
-  // now, write the array back to disk using write_png_file
-  png_bytep * output_row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * HEIGHT);
-
-  for (int i = 0; i < HEIGHT; i++)
-    output_row_pointers[i] = &output_buffer[i*WIDTH*4];
-
-  write_png_file("output.png", output_row_pointers);
-  free(output_row_pointers);
-  free(output_buffer);
-  free(received_fragments);
+  if (stripe_file) {
+    // every stripe is on disk already
+    close_stripefile(&stripes);
+  } else if (raw_file) {
+    // and so is every pixel
+    close_rawfile(&raw, output_buffer);
+  } else {
+    // now, write the array back to disk using write_png_file
+    start_us = get_time_us();
+    write_png_file("output.png", output_buffer, level, filter);
+    record_time(&main_timings, PHASE_ENCODE, get_time_us() - start_us);
+  }
+  if (timings_file)
+    dump_timings(timings_file, &mirror_timings, 1, &timings, 1, &main_timings, NULL, NULL);
+  if (cache_dir)
+    close_cache(&cache);
+  else if (!raw_file)
+    free(output_buffer);
   
-  return 0;
+  return gave_up ? -1 : 0;
 }
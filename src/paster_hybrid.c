@@ -0,0 +1,1233 @@
+/*
+ * Paste together PNG files downloaded from the network.
+ *
+ * Downloads a bunch of PNG files from BASE_URL and concatenates them.
+ *
+ * Derived from curl and libpng base code.
+ * curl examples are from simple.c included with curl distribution:
+ * Copyright (C) 1998 - 2013, Daniel Stenberg, <daniel@haxx.se>, et al.
+ * libpng examples are from http://zarb.org/~gc/html/libpng.html
+ * Copyright 2002-2011 Guillaume Cottenceau and contributors.
+ *
+ * Modifications to integrate the code are
+ * Copyright 2013 Patrick Lam.
+ *
+ * This software may be freely redistributed under the terms
+ * of the X11 license.
+ *
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
+#define PNG_DEBUG 3
+#include <png.h>
+#include <zlib.h>
+#include <curl/curl.h>
+#include <curl/multi.h>
+
+#include "geometry.h"
+
+#include <pthread.h>
+
+#include "fetch.h"
+#include "image.h"
+#include "mirrors.h"
+
+#define DEFAULT_COMPRESSION_LEVEL 6    // zlib's own default
+
+// hedge once no more than this many fragments are missing (-k)
+#define DEFAULT_TAIL_AT 2
+#define MAX_EVENTS 64
+
+/***********************************************************************************/
+/* work-stealing pool of decoder threads                                           */
+
+//
+// A downloaded fragment waiting to be decoded. Jobs double as the download
+// buffers: an event loop fills one, hands it to the pool and takes a free
+// one for its next transfer.
+//
+typedef struct _decode_job
+{
+  struct bufdata bd;
+  int n;
+  int mirror;           // which sent it, to blame if it doesn't decode
+  struct _decode_job * next;
+} decode_job, * pdecode_job;
+
+//
+// Every decoder owns a queue. Submissions are spread round robin; a decoder
+// takes from the front of its own queue and steals from the back of the
+// others once it runs dry.
+//
+typedef struct _work_queue
+{
+  pthread_mutex_t lock;
+  pdecode_job * jobs;
+  int head;
+  int count;
+  int capacity;
+} work_queue;
+
+typedef struct _decoder_pool
+{
+  work_queue * queues;
+  int num_decoders;
+  unsigned int next_queue;
+
+  // decoders sleep on cond until a job is pending or the run is over
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int pending;
+  bool stopping;
+
+  // fragment state, also protected by lock. A fragment is marked painted
+  // as soon as a decoder starts on it; num_painted counts finished ones.
+  bool * painted_fragments;
+  struct bitmap * received_fragments;   // to give up claims on corrupt fragments
+  int num_painted;
+  int tail_at;
+  bool tail;
+  bool done;
+  png_byte * output_buffer;
+  struct dupstats * ds;
+  struct stripefile * stripes;  // NULL unless -o
+  struct cache * cache;         // NULL unless -C
+
+  // memory for the download buffers, which decoders give back once the
+  // fragment is painted
+  struct bufpool buffers;
+
+  // download buffers not in use; event loops park transfers when it's empty
+  pthread_mutex_t free_lock;
+  pdecode_job jobs;
+  int num_jobs;
+  pdecode_job free_jobs;
+  bool loops_waiting;
+
+  // eventfds for waking the event loops
+  int * wakefds;
+  int num_loops;
+} decoder_pool, * pdecoder_pool;
+
+typedef struct _decoder_context
+{
+  int decoder_id;
+  pdecoder_pool pool;
+  struct timings * timings;
+} decoder_context;
+
+void push_job (work_queue * queue, pdecode_job job)
+{
+  pthread_mutex_lock(&queue->lock);
+  queue->jobs[(queue->head + queue->count) % queue->capacity] = job;
+  queue->count++;
+  pthread_mutex_unlock(&queue->lock);
+}
+
+pdecode_job pop_job (work_queue * queue)
+{
+  pdecode_job job = NULL;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->count > 0)
+  {
+    job = queue->jobs[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return job;
+}
+
+pdecode_job steal_job (work_queue * queue)
+{
+  pdecode_job job = NULL;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->count > 0)
+  {
+    queue->count--;
+    job = queue->jobs[(queue->head + queue->count) % queue->capacity];
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return job;
+}
+
+void wake_event_loops (pdecoder_pool pool)
+{
+  uint64_t one = 1;
+  int i;
+
+  for (i = 0; i < pool->num_loops; ++i)
+  {
+    if (write(pool->wakefds[i], &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+      abort_("[%s] could not wake event loop %d", __FUNCTION__, i);
+  }
+}
+
+//
+// Returns a free download buffer, or NULL if every buffer is downloading or
+// waiting to be decoded. In that case the event loops are woken as soon as
+// a decoder gives one back.
+//
+pdecode_job get_free_job (pdecoder_pool pool)
+{
+  pdecode_job job;
+
+  pthread_mutex_lock(&pool->free_lock);
+  job = pool->free_jobs;
+  if (job)
+    pool->free_jobs = job->next;
+  else
+    pool->loops_waiting = true;
+  pthread_mutex_unlock(&pool->free_lock);
+
+  return job;
+}
+
+//
+// Makes sure the event loops are woken the next time a decoder gives a job
+// (and with it, its buffer's memory) back.
+//
+void wait_for_free_job (pdecoder_pool pool)
+{
+  pthread_mutex_lock(&pool->free_lock);
+  pool->loops_waiting = true;
+  pthread_mutex_unlock(&pool->free_lock);
+}
+
+void release_job (pdecoder_pool pool, pdecode_job job)
+{
+  bool loops_waiting;
+
+  pthread_mutex_lock(&pool->free_lock);
+  job->next = pool->free_jobs;
+  pool->free_jobs = job;
+  loops_waiting = pool->loops_waiting;
+  pool->loops_waiting = false;
+  pthread_mutex_unlock(&pool->free_lock);
+
+  if (loops_waiting)
+    wake_event_loops(pool);
+}
+
+void submit_job (pdecoder_pool pool, pdecode_job job)
+{
+  work_queue * queue;
+
+  pthread_mutex_lock(&pool->lock);
+  queue = &pool->queues[pool->next_queue++ % pool->num_decoders];
+  pthread_mutex_unlock(&pool->lock);
+
+  push_job(queue, job);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->pending++;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+//
+// Fragments come back at random, so the last few missing ones take about
+// as long as all the others together. Once no more than tail_at are
+// missing, the event loops start their hedge transfers too.
+//
+bool in_tail (pdecoder_pool pool)
+{
+  bool tail;
+
+  pthread_mutex_lock(&pool->lock);
+  tail = pool->tail;
+  pthread_mutex_unlock(&pool->lock);
+
+  return tail;
+}
+
+bool is_done (pdecoder_pool pool)
+{
+  bool done;
+
+  pthread_mutex_lock(&pool->lock);
+  done = pool->done;
+  pthread_mutex_unlock(&pool->lock);
+
+  return done;
+}
+
+//
+// Decode a fragment and paint it into the output buffer, unless another
+// decoder has already claimed the same fragment. libpng allocates from
+// the decoder's arena.
+//
+void decode_fragment (pdecoder_pool pool, pdecode_job job, png_bytep * row_pointers,
+		      struct arena * arena, struct timings * timings)
+{
+  png_structp png_ptr;
+  png_infop info_ptr;
+  long start_us, decode_us, end_us;
+  bool painted;
+  bool done = false;
+  bool tail = false;
+  int missing;
+
+  pthread_mutex_lock(&pool->lock);
+  painted = pool->painted_fragments[job->n];
+  pool->painted_fragments[job->n] = true;
+  pthread_mutex_unlock(&pool->lock);
+
+  if (painted)
+    return;
+
+  png_ptr = create_read_struct(arena);
+  if (!png_ptr)
+    abort_("[%s] png_create_read_struct failed", __FUNCTION__);
+
+  // read PNG (as downloaded from network) and copy it to output buffer.
+  // libpng decodes straight into the output buffer, so all there is to
+  // painting is pointing the rows at it and marking the fragment done
+  start_us = get_time_us();
+  point_rows_at_destination(row_pointers, job->n, pool->output_buffer);
+  decode_us = get_time_us();
+  if (!read_png_file(png_ptr, &info_ptr, &job->bd, row_pointers))
+  {
+    // as much the mirror's fault as a failed transfer; the next copy
+    // paints over whatever rows this one got to
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    mirror_failed_or_abort(job->mirror, "corrupt PNG");
+    pthread_mutex_lock(&pool->lock);
+    pool->painted_fragments[job->n] = false;
+    pthread_mutex_unlock(&pool->lock);
+    clear_bit(pool->received_fragments, job->n);
+    return;
+  }
+  end_us = get_time_us();
+  record_decode(pool->ds, (end_us - decode_us) / 1e6);
+
+  // free allocated memory
+  png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->num_painted++;
+  done = pool->num_painted == N;
+  pool->done = pool->done || done;
+  missing = N - pool->num_painted;
+  tail = !pool->tail && missing <= pool->tail_at;
+  pool->tail = pool->tail || tail;
+  pthread_mutex_unlock(&pool->lock);
+  record_time(timings, PHASE_DECODE, end_us - decode_us);
+  record_time(timings, PHASE_PAINT, decode_us - start_us + get_time_us() - end_us);
+  if (pool->stripes)
+  {
+    start_us = get_time_us();
+    write_stripe(pool->stripes, job->n, pool->output_buffer);
+    record_time(timings, PHASE_ENCODE, get_time_us() - start_us);
+  }
+  if (pool->cache)
+    checkpoint_stripe(pool->cache, job->n);
+
+  if (tail)
+    printf("%d fragments missing, hedging\n", missing);
+  if (done)
+  {
+    DEBUG_PRINT(("[%s] all fragments painted\n", __FUNCTION__));
+  }
+  if (tail || done)
+    wake_event_loops(pool);
+}
+
+//
+// Function that each decoder thread will run
+//
+void *decoder_function (void * context)
+{
+  decoder_context * dc_context = context;
+  pdecoder_pool pool = dc_context->pool;
+  pdecode_job job;
+  struct arena arena;
+  int i;
+
+  DEBUG_PRINT(("[%s] Decoder #%d started...\n", __FUNCTION__, dc_context->decoder_id));
+
+  png_bytep * row_pointers = malloc(sizeof(png_bytep)*BUF_HEIGHT);
+  if (!row_pointers)
+    abort_("[%s] row_pointers malloc failed", __FUNCTION__);
+  init_arena(&arena);
+
+  for (;;)
+  {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending == 0 && !pool->stopping)
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    if (pool->pending == 0)
+    {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    pool->pending--;
+    pthread_mutex_unlock(&pool->lock);
+
+    // We now own one of the queued jobs; it is either in our queue or
+    // someone else's
+    job = pop_job(&pool->queues[dc_context->decoder_id]);
+    for (i = 1; !job; ++i)
+      job = steal_job(&pool->queues[(dc_context->decoder_id + i) % pool->num_decoders]);
+
+    decode_fragment(pool, job, row_pointers, &arena, dc_context->timings);
+    release_buffer(&pool->buffers, &job->bd);
+    release_job(pool, job);
+  }
+
+  free(row_pointers);
+  cleanup_arena(&arena);
+  pthread_exit(0);
+}
+
+/***********************************************************************************/
+
+typedef struct _curl_context
+{
+  int curl_id;
+  CURL * curl;          // kept for the context's every transfer
+  bool running;         // curl is in curlm
+  pdecode_job job;
+  struct headerdata hd;
+  bool parked;          // waiting for the pool to take a buffer back
+  unsigned parked_at;
+  bool hedge;           // only starts once the tail does
+  int mirror;
+  char * url;
+  int img;
+} curl_context, * pcurl_context;
+
+/* every handle points back at its context */
+pcurl_context get_curl_context (CURL * curl)
+{
+  pcurl_context context = NULL;
+
+  curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **) &context);
+  return context;
+}
+
+void init_curl (CURLM * curlm, pcurl_context context)
+{
+  // the handle from the last transfer keeps its buffers, and curl its
+  // connection; only the options start over
+  curl_easy_reset(context->curl);
+  curl_easy_setopt(context->curl, CURLOPT_PRIVATE, context);
+
+  // request appropriate URL
+  context->mirror = get_url(&context->url, context->img, context->hedge);
+  DEBUG_PRINT(("[%s] Curl #%d requesting URL %s\n", __FUNCTION__, context->curl_id, context->url));
+  curl_easy_setopt(context->curl, CURLOPT_URL, context->url);
+
+  context->job->bd.len = 0;
+  context->job->bd.pos = 0;
+  context->job->bd.starved = false;
+  context->job->bd.hd = &context->hd;
+  context->hd.n = -1;
+  context->hd.duplicate = false;
+  context->hd.content_length = -1;
+  curl_easy_setopt(context->curl, CURLOPT_WRITEFUNCTION, write_cb);
+  curl_easy_setopt(context->curl, CURLOPT_WRITEDATA, &context->job->bd);
+
+  curl_easy_setopt(context->curl, CURLOPT_HEADERDATA, &context->hd);
+  curl_easy_setopt(context->curl, CURLOPT_HEADERFUNCTION, header_cb);
+  set_connection_options(context->curl);
+  // an overloaded mirror answering 5xx counts as a failure, not a fragment
+  curl_easy_setopt(context->curl, CURLOPT_FAILONERROR, 1L);
+
+  curl_multi_add_handle(curlm, context->curl);
+  context->running = true;
+}
+
+/***********************************************************************************/
+/* routines used by curl to drive transfers from an epoll event loop               */
+
+typedef struct _event_loop
+{
+  CURLM * curlm;
+  int epfd;
+  int wakefd;
+  bool timer_armed;
+  struct timespec deadline;
+} event_loop, * pevent_loop;
+
+//
+// curl calls this to tell us which events it wants on a socket. Sockets
+// already registered with epoll are tagged (via curl_multi_assign) so that
+// we know whether to add or modify them.
+//
+int socket_cb (CURL * curl, curl_socket_t s, int what, void * userdata, void * socketp)
+{
+  pevent_loop loop = userdata;
+  struct epoll_event ev;
+
+  if (what == CURL_POLL_REMOVE)
+  {
+    // The socket may already be closed, which removes it from epoll for us
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, s, NULL);
+    curl_multi_assign(loop->curlm, s, NULL);
+    return 0;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.data.fd = s;
+  if (what & CURL_POLL_IN)
+    ev.events |= EPOLLIN;
+  if (what & CURL_POLL_OUT)
+    ev.events |= EPOLLOUT;
+
+  if (socketp)
+  {
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, s, &ev) == -1)
+      abort_("[%s] epoll_ctl MOD failed on fd %d", __FUNCTION__, s);
+  }
+  else
+  {
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, s, &ev) == -1)
+      abort_("[%s] epoll_ctl ADD failed on fd %d", __FUNCTION__, s);
+    curl_multi_assign(loop->curlm, s, loop);
+  }
+
+  return 0;
+}
+
+//
+// curl calls this to tell us how long we may block before it needs
+// curl_multi_socket_action(CURL_SOCKET_TIMEOUT). -1 means no timer.
+// The timer is one-shot: curl only calls us again when it wants a new one.
+//
+int timer_cb (CURLM * curlm, long timeout_ms, void * userdata)
+{
+  pevent_loop loop = userdata;
+
+  if (timeout_ms < 0)
+  {
+    loop->timer_armed = false;
+    return 0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &loop->deadline);
+  loop->deadline.tv_sec += timeout_ms / 1000;
+  loop->deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (loop->deadline.tv_nsec >= 1000000000L)
+  {
+    loop->deadline.tv_sec += 1;
+    loop->deadline.tv_nsec -= 1000000000L;
+  }
+  loop->timer_armed = true;
+  return 0;
+}
+
+//
+// Milliseconds until curl's timer expires, rounded up so that we never
+// wake early. -1 (block forever) if no timer is armed.
+//
+int get_wait_ms (pevent_loop loop)
+{
+  struct timespec now;
+  long wait_ms;
+
+  if (!loop->timer_armed)
+    return -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  wait_ms = (loop->deadline.tv_sec - now.tv_sec) * 1000
+    + (loop->deadline.tv_nsec - now.tv_nsec + 999999L) / 1000000L;
+
+  return wait_ms < 0 ? 0 : (int) wait_ms;
+}
+
+//
+// wakefd is an eventfd that the decoders write to when they free a buffer
+// or paint the last fragment
+//
+void init_event_loop (pevent_loop loop, CURLM * curlm, int wakefd)
+{
+  struct epoll_event ev;
+
+  loop->curlm = curlm;
+  loop->wakefd = wakefd;
+  loop->timer_armed = false;
+
+  loop->epfd = epoll_create1(0);
+  if (loop->epfd == -1)
+  {
+    abort_("[%s] epoll_create1 failed", __FUNCTION__);
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = wakefd;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, wakefd, &ev) == -1)
+  {
+    abort_("[%s] epoll_ctl ADD failed on wakefd", __FUNCTION__);
+  }
+
+  curl_multi_setopt(curlm, CURLMOPT_SOCKETFUNCTION, socket_cb);
+  curl_multi_setopt(curlm, CURLMOPT_SOCKETDATA, loop);
+  curl_multi_setopt(curlm, CURLMOPT_TIMERFUNCTION, timer_cb);
+  curl_multi_setopt(curlm, CURLMOPT_TIMERDATA, loop);
+}
+
+//
+// Block until a socket is ready, curl's timer expires or a decoder wakes
+// us, then let curl make progress on whatever is ready.
+//
+void run_event_loop (pevent_loop loop)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int running_curls;
+  uint64_t wakeups;
+  int nfds;
+  int i;
+  CURLMcode mc;
+
+  nfds = epoll_wait(loop->epfd, events, MAX_EVENTS, get_wait_ms(loop));
+  if (nfds == -1)
+  {
+    if (errno == EINTR)
+      return;
+    abort_("[%s] epoll_wait failed", __FUNCTION__);
+  }
+
+  if (nfds == 0)
+  {
+    loop->timer_armed = false;
+    mc = curl_multi_socket_action(loop->curlm, CURL_SOCKET_TIMEOUT, 0, &running_curls);
+    if (mc != CURLM_OK)
+    {
+      abort_("[%s:%d] curl_multi_socket_action failed\n", __FUNCTION__, __LINE__);
+    }
+    return;
+  }
+
+  for (i = 0; i < nfds; ++i)
+  {
+    int flags = 0;
+
+    if (events[i].data.fd == loop->wakefd)
+    {
+      // the caller rechecks buffers and completion after every call
+      if (read(loop->wakefd, &wakeups, sizeof(wakeups)) == -1 && errno != EAGAIN)
+	abort_("[%s] could not read wakefd", __FUNCTION__);
+      continue;
+    }
+
+    if (events[i].events & EPOLLIN)
+      flags |= CURL_CSELECT_IN;
+    if (events[i].events & EPOLLOUT)
+      flags |= CURL_CSELECT_OUT;
+    if (events[i].events & (EPOLLERR | EPOLLHUP))
+      flags |= CURL_CSELECT_ERR;
+
+    mc = curl_multi_socket_action(loop->curlm, events[i].data.fd, flags, &running_curls);
+    if (mc != CURLM_OK)
+    {
+      abort_("[%s:%d] curl_multi_socket_action failed\n", __FUNCTION__, __LINE__);
+    }
+  }
+}
+
+void cleanup_event_loop (pevent_loop loop)
+{
+  close(loop->epfd);
+}
+
+/***********************************************************************************/
+
+typedef struct _loop_function_context
+{
+  int loop_id;
+  int num_transfers;
+  int num_hedges;
+  int first_curl_id;
+  int img;
+  struct bitmap * received_fragments;
+  bool discard_duplicates;
+  int wakefd;
+  pdecoder_pool pool;
+} loop_function_context;
+
+//
+// Function that each event loop thread will run. It keeps num_transfers
+// downloads in flight (plus num_hedges in the tail) and hands every
+// completed fragment to the decoders.
+//
+void *loop_function (void * context)
+{
+  loop_function_context * lf_context = context;
+  pdecoder_pool pool = lf_context->pool;
+  pcurl_context contexts;
+  pcurl_context curr_context;
+  CURLM * curlm;
+  event_loop loop;
+  CURLMsg * msg;
+  int msgs_in_queue;
+  bool discarded, starved, failed;
+  int num_contexts = lf_context->num_transfers + lf_context->num_hedges;
+  int num_active;
+  int i;
+
+  DEBUG_PRINT(("[%s] Event loop #%d started with %d transfers...\n", __FUNCTION__,
+	       lf_context->loop_id, lf_context->num_transfers));
+
+  curlm = curl_multi_init();
+  if (!curlm)
+  {
+    abort_("[%s] curlm init failed\n", __FUNCTION__);
+  }
+
+  // Must be set up before any handles are added so that curl hands us
+  // their sockets and timers
+  init_event_loop(&loop, curlm, lf_context->wakefd);
+  set_multi_options(curlm, num_contexts);
+
+  contexts = (pcurl_context) calloc(num_contexts, sizeof(curl_context));
+  if (!contexts)
+  {
+    abort_("[%s] contexts calloc failed", __FUNCTION__);
+  }
+
+  for (i = 0; i < num_contexts; ++i)
+  {
+    contexts[i].curl_id = lf_context->first_curl_id + i;
+    contexts[i].curl = curl_easy_init();
+    if (!contexts[i].curl)
+    {
+      abort_("[%s] could not init curl", __FUNCTION__);
+    }
+    contexts[i].hedge = i >= lf_context->num_transfers;
+    contexts[i].img = lf_context->img;
+    contexts[i].hd.received_fragments = lf_context->received_fragments;
+    contexts[i].hd.discard_duplicates = lf_context->discard_duplicates;
+
+    contexts[i].url = (char *) malloc(sizeof(char)*strlen(BASE_URL_1)+4*5);
+    if (!contexts[i].url)
+    {
+      abort_("[%s] could not malloc url", __FUNCTION__);
+    }
+  }
+
+  while (!is_done(pool))
+  {
+    // (Re)start every idle transfer we can find a buffer for; the rest
+    // wait until a decoder gives a buffer back
+    num_active = in_tail(pool) ? num_contexts : lf_context->num_transfers;
+    for (i = 0; i < num_active; ++i)
+    {
+      if (contexts[i].running)
+	continue;
+      if (contexts[i].parked)
+      {
+	// Ask to be woken before looking, so that memory coming back in
+	// between can't be missed
+	wait_for_free_job(pool);
+	if (get_releases(&pool->buffers) == contexts[i].parked_at)
+	  continue;
+	contexts[i].parked = false;
+      }
+      if (!contexts[i].job)
+	contexts[i].job = get_free_job(pool);
+      if (!contexts[i].job)
+	break;
+      init_curl(curlm, &contexts[i]);
+    }
+
+    // Sleep until a socket is ready, a timer expires or a decoder wakes
+    // us, then run any curls that can make progress
+    run_event_loop(&loop);
+
+    while ((msg = curl_multi_info_read(curlm, &msgs_in_queue)))
+    {
+      if (msg->msg != CURLMSG_DONE)
+      {
+	fprintf(stderr, "E: CURLMsg (%d)\n", msg->msg);
+	abort_("[%s] curl msg not done\n", __FUNCTION__);
+      }
+
+      curr_context = get_curl_context(msg->easy_handle);
+      DEBUG_PRINT(("[%s] R: %d - %s <%s>\n", __FUNCTION__,
+		   msg->data.result, curl_easy_strerror(msg->data.result), curr_context->url));
+
+      // header_cb stops duplicates short and write_cb stops transfers the
+      // pool has no room for; anything else is the mirror's fault
+      discarded = msg->data.result == CURLE_WRITE_ERROR && curr_context->hd.duplicate;
+      starved = msg->data.result == CURLE_WRITE_ERROR && curr_context->job->bd.starved;
+      failed = msg->data.result != CURLE_OK && !discarded && !starved;
+      if (discarded)
+      {
+	record_discard(pool->ds, &curr_context->hd);
+	mirror_succeeded(curr_context->mirror, curr_context->curl, false);
+      }
+      else if (starved)
+      {
+	// Someone else has to paint this fragment, maybe us on a later try.
+	// Retrying before a decoder gives memory back would only fail again.
+	unclaim_fragment(&curr_context->hd);
+	curr_context->parked = true;
+	curr_context->parked_at = get_releases(&pool->buffers);
+	release_buffer(&pool->buffers, &curr_context->job->bd);
+      }
+      else if (failed)
+      {
+	// quarantine the mirror; the next request goes elsewhere
+	mirror_failed_or_abort(curr_context->mirror, curl_easy_strerror(msg->data.result));
+	unclaim_fragment(&curr_context->hd);
+      }
+      else
+      {
+	mirror_succeeded(curr_context->mirror, curr_context->curl, true);
+      }
+
+      curl_multi_remove_handle(curlm, curr_context->curl);
+      curr_context->running = false;
+
+      // Hand the buffer over to the decoders; a transfer that brought no
+      // fragment keeps its job for the next request
+      if (!discarded && !starved && !failed)
+      {
+	curr_context->job->n = curr_context->hd.n;
+	curr_context->job->mirror = curr_context->mirror;
+	submit_job(pool, curr_context->job);
+	curr_context->job = NULL;
+      }
+    }
+  }
+
+  // whatever is still in flight gets cancelled here
+  for (i = 0; i < num_contexts; ++i)
+  {
+    // Clear all pointers created for each context
+    if (contexts[i].running)
+      curl_multi_remove_handle(curlm, contexts[i].curl);
+    curl_easy_cleanup(contexts[i].curl);
+    if (contexts[i].job)
+    {
+      release_buffer(&pool->buffers, &contexts[i].job->bd);
+      release_job(pool, contexts[i].job);
+    }
+    free(contexts[i].url);
+  }
+  free(contexts);
+
+  curl_multi_cleanup(curlm);
+  cleanup_event_loop(&loop);
+
+  pthread_exit(0);
+}
+
+/***********************************************************************************/
+
+int main(int argc, char **argv)
+{
+  int c;
+  int num_transfers = 4;
+  int num_hedges = -1;
+  int tail_at = DEFAULT_TAIL_AT;
+  int num_decoders = 4;
+  int num_loops = 1;
+  int img = 1;
+  bool discard_duplicates = false;
+  struct bitmap received_fragments = { { 0 } };
+  struct dupstats ds = { 0 };
+  struct timings * decoder_timings;
+  struct timings main_timings = { { { { 0 } } } };
+  char * timings_file = NULL;
+  int level = DEFAULT_COMPRESSION_LEVEL;
+  int filter = FILTER_ALL;
+  int num_encoders = 1;
+  char * stripe_file = NULL;
+  struct stripefile stripes;
+  char * raw_file = NULL;
+  struct rawfile raw = { 0 };
+  char * cache_dir = NULL;
+  struct cache cache = { 0 };
+  uint64_t cached = 0;
+  long start_us;
+  size_t buffer_cap_mb = BUFPOOL_DEFAULT_CAP_MB;
+  decoder_pool pool;
+  pthread_t * decoder_threads;
+  decoder_context * decoder_contexts;
+  pthread_t * loop_threads;
+  loop_function_context * loop_contexts;
+  int first_curl_id;
+  int i;
+
+  set_geometry(DEFAULT_WIDTH, DEFAULT_HEIGHT, DEFAULT_FRAGMENTS);
+  while ((c = getopt (argc, argv, "t:w:e:i:dm:k:x:c:K2H:j:z:f:p:o:C:g:r:")) != -1) {
+    switch (c) {
+    case 't':
+      num_transfers = strtoul(optarg, NULL, 10);
+      if (num_transfers == 0) {
+	printf("%s: option requires an argument > 0 -- 't'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'w':
+      num_decoders = strtoul(optarg, NULL, 10);
+      if (num_decoders == 0) {
+	printf("%s: option requires an argument > 0 -- 'w'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'e':
+      num_loops = strtoul(optarg, NULL, 10);
+      if (num_loops == 0) {
+	printf("%s: option requires an argument > 0 -- 'e'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'i':
+      img = strtoul(optarg, NULL, 10);
+      if (img == 0) {
+	printf("%s: option requires an argument > 0 -- 'i'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'd':
+      discard_duplicates = true;
+      break;
+    case 'm':
+      buffer_cap_mb = strtoul(optarg, NULL, 10);
+      if (buffer_cap_mb == 0) {
+	printf("%s: option requires an argument > 0 -- 'm'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'k':
+      tail_at = strtoul(optarg, NULL, 10);
+      if (tail_at == 0) {
+	printf("%s: option requires an argument > 0 -- 'k'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'x':
+      num_hedges = strtoul(optarg, NULL, 10);
+      break;
+    case 'c':
+      {
+	char spec[256];
+
+	snprintf(spec, sizeof(spec), "::%s", optarg);
+	connect_to = curl_slist_append(connect_to, spec);
+      }
+      break;
+    case 'K':
+      forbid_reuse = true;
+      break;
+    case '2':
+      use_http2 = true;
+      break;
+    case 'H':
+      max_host_connections = strtoul(optarg, NULL, 10);
+      if (max_host_connections == 0) {
+	printf("%s: option requires an argument > 0 -- 'H'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'j':
+      timings_file = optarg;
+      break;
+    case 'o':
+      stripe_file = optarg;
+      break;
+    case 'r':
+      raw_file = optarg;
+      break;
+    case 'C':
+      cache_dir = optarg;
+      break;
+    case 'g':
+      if (!parse_geometry(optarg)) {
+	printf("%s: option requires an argument WIDTHxHEIGHT/N, N <= %d dividing WIDTH -- 'g'\n", argv[0], MAX_FRAGMENTS);
+	return -1;
+      }
+      break;
+    case 'z':
+      level = strtoul(optarg, NULL, 10);
+      if (level > 9) {
+	printf("%s: option requires an argument 0-9 -- 'z'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'f':
+      filter = parse_filter(optarg);
+      if (filter < 0) {
+	printf("%s: option requires none, sub, up, avg, paeth or all -- 'f'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'p':
+      num_encoders = strtoul(optarg, NULL, 10);
+      if (num_encoders == 0) {
+	printf("%s: option requires an argument > 0 -- 'p'\n", argv[0]);
+	return -1;
+      }
+      break;
+    default:
+      return -1;
+    }
+  }
+  if (stripe_file && raw_file)
+  {
+    printf("%s: -o and -r write different kinds of output; pick one\n", argv[0]);
+    return -1;
+  }
+
+  // Every event loop needs at least one transfer to drive
+  if (num_loops > num_transfers)
+    num_loops = num_transfers;
+
+  // by default the tail runs at twice the concurrency
+  if (num_hedges < 0)
+    num_hedges = num_transfers;
+
+  DEBUG_PRINT(("[%s] Transfers: %d, decoders: %d, event loops: %d\n", __FUNCTION__,
+	       num_transfers, num_decoders, num_loops));
+  DEBUG_PRINT(("[%s] Img #: %d\n", __FUNCTION__, img));
+
+  memset(&pool, 0, sizeof(pool));
+  pool.num_decoders = num_decoders;
+  pool.num_loops = num_loops;
+  pool.tail_at = tail_at;
+  pool.ds = &ds;
+  pool.stripes = NULL;
+  if (stripe_file)
+  {
+    open_stripefile(&stripes, stripe_file, level, filter);
+    pool.stripes = &stripes;
+  }
+  if (raw_file)
+    open_rawfile(&raw, raw_file);
+
+  pool.painted_fragments = calloc(N, sizeof(bool));
+  pool.received_fragments = &received_fragments;
+  if (!pool.painted_fragments)
+  {
+    abort_("[%s] painted_fragments calloc failed", __FUNCTION__);
+  }
+
+  // whatever the checkpoint has needn't be downloaded
+  pool.cache = NULL;
+  if (cache_dir)
+  {
+    cached = open_cache(&cache, cache_dir, img);
+    pool.cache = &cache;
+    pool.output_buffer = cache.image;
+    printf("%d fragments from the cache\n", __builtin_popcountll(cached));
+  }
+  else if (raw_file)
+  {
+    pool.output_buffer = raw.image;
+  }
+  else
+  {
+    pool.output_buffer = calloc(WIDTH*HEIGHT*4, sizeof(png_byte));
+    if (!pool.output_buffer)
+      abort_("[%s] output_buffer calloc failed", __FUNCTION__);
+  }
+  for (i = 0; i < N; ++i)
+  {
+    if (!(cached >> i & 1))
+      continue;
+    test_and_set_bit(&received_fragments, i);
+    pool.painted_fragments[i] = true;
+    pool.num_painted++;
+    if (stripe_file)
+      write_stripe(&stripes, i, pool.output_buffer);
+  }
+  pool.done = pool.num_painted == N;
+  pool.tail = N - pool.num_painted <= tail_at;
+
+  if (pthread_mutex_init(&pool.lock, NULL) ||
+      pthread_mutex_init(&pool.free_lock, NULL) ||
+      pthread_cond_init(&pool.cond, NULL))
+  {
+    abort_("[%s] pthread_mutex_init failed", __FUNCTION__);
+  }
+
+  // Event loops must never block, so a transfer the pool has no room for
+  // fails and is parked instead
+  init_bufpool(&pool.buffers, buffer_cap_mb << 20, false);
+
+  // One buffer per transfer (hedges included) plus one per decoder keeps every decoder busy
+  // without the event loops ever waiting on them in the steady state
+  pool.num_jobs = num_transfers + num_hedges + num_decoders;
+  pool.jobs = (pdecode_job) calloc(pool.num_jobs, sizeof(decode_job));
+  if (!pool.jobs)
+  {
+    abort_("[%s] jobs calloc failed", __FUNCTION__);
+  }
+
+  for (i = 0; i < pool.num_jobs; ++i)
+  {
+    pool.jobs[i].bd.pool = &pool.buffers;
+    pool.jobs[i].next = pool.free_jobs;
+    pool.free_jobs = &pool.jobs[i];
+  }
+
+  pool.queues = (work_queue *) calloc(num_decoders, sizeof(work_queue));
+  if (!pool.queues)
+  {
+    abort_("[%s] queues calloc failed", __FUNCTION__);
+  }
+
+  for (i = 0; i < num_decoders; ++i)
+  {
+    // A queue can never hold more jobs than there are buffers
+    pool.queues[i].capacity = pool.num_jobs;
+    pool.queues[i].jobs = (pdecode_job *) calloc(pool.num_jobs, sizeof(pdecode_job));
+    if (!pool.queues[i].jobs || pthread_mutex_init(&pool.queues[i].lock, NULL))
+    {
+      abort_("[%s] could not init queue %d", __FUNCTION__, i);
+    }
+  }
+
+  pool.wakefds = (int *) calloc(num_loops, sizeof(int));
+  if (!pool.wakefds)
+  {
+    abort_("[%s] wakefds calloc failed", __FUNCTION__);
+  }
+
+  for (i = 0; i < num_loops; ++i)
+  {
+    pool.wakefds[i] = eventfd(0, EFD_NONBLOCK);
+    if (pool.wakefds[i] == -1)
+    {
+      abort_("[%s] eventfd failed", __FUNCTION__);
+    }
+  }
+
+  decoder_threads = (pthread_t *) calloc(num_decoders, sizeof(pthread_t));
+  decoder_contexts = (decoder_context *) calloc(num_decoders, sizeof(decoder_context));
+  decoder_timings = (struct timings *) calloc(num_decoders, sizeof(struct timings));
+  loop_threads = (pthread_t *) calloc(num_loops, sizeof(pthread_t));
+  loop_contexts = (loop_function_context *) calloc(num_loops, sizeof(loop_function_context));
+  if (!decoder_threads || !decoder_contexts || !decoder_timings || !loop_threads || !loop_contexts)
+  {
+    abort_("[%s] thread calloc failed", __FUNCTION__);
+  }
+
+  curl_global_init(CURL_GLOBAL_ALL);
+  // every transfer runs under a multi handle
+  multiplexing = true;
+
+  printf("[%s] Dispatching threads...\n", __FUNCTION__);
+  for (i = 0; i < num_decoders; ++i)
+  {
+    decoder_contexts[i].decoder_id = i;
+    decoder_contexts[i].pool = &pool;
+    decoder_contexts[i].timings = &decoder_timings[i];
+
+    if (pthread_create(&decoder_threads[i], NULL, decoder_function, (void *) &decoder_contexts[i]))
+    {
+      abort_("[%s] failed to create decoder thread %d\n", __FUNCTION__, i);
+    }
+  }
+
+  first_curl_id = 0;
+  for (i = 0; i < num_loops; ++i)
+  {
+    // Split the transfers as evenly as possible between the loops
+    loop_contexts[i].loop_id = i;
+    loop_contexts[i].num_transfers = num_transfers / num_loops + (i < num_transfers % num_loops);
+    loop_contexts[i].num_hedges = num_hedges / num_loops + (i < num_hedges % num_loops);
+    loop_contexts[i].first_curl_id = first_curl_id;
+    loop_contexts[i].img = img;
+    loop_contexts[i].received_fragments = &received_fragments;
+    loop_contexts[i].discard_duplicates = discard_duplicates;
+    loop_contexts[i].wakefd = pool.wakefds[i];
+    loop_contexts[i].pool = &pool;
+    first_curl_id += loop_contexts[i].num_transfers + loop_contexts[i].num_hedges;
+
+    if (pthread_create(&loop_threads[i], NULL, loop_function, (void *) &loop_contexts[i]))
+    {
+      abort_("[%s] failed to create event loop thread %d\n", __FUNCTION__, i);
+    }
+  }
+
+  DEBUG_PRINT(("[%s] Waiting for event loops to finish...\n", __FUNCTION__));
+  for (i = 0; i < num_loops; ++i)
+  {
+    pthread_join(loop_threads[i], NULL);
+  }
+
+  // Let the decoders drain whatever is still queued, then exit
+  pthread_mutex_lock(&pool.lock);
+  pool.stopping = true;
+  pthread_cond_broadcast(&pool.cond);
+  pthread_mutex_unlock(&pool.lock);
+
+  DEBUG_PRINT(("[%s] Waiting for decoders to finish...\n", __FUNCTION__));
+  for (i = 0; i < num_decoders; ++i)
+  {
+    pthread_join(decoder_threads[i], NULL);
+  }
+
+  curl_global_cleanup();
+  curl_slist_free_all(connect_to);
+  print_dupstats(&ds);
+  print_mirror_stats();
+  cleanup_bufpool(&pool.buffers);
+
+  if (stripe_file)
+  {
+    // every stripe is on disk already
+    close_stripefile(&stripes);
+  }
+  else if (raw_file)
+  {
+    // and so is every pixel
+    close_rawfile(&raw, pool.output_buffer);
+  }
+  else
+  {
+    // now, write the array back to disk using write_png_file
+    start_us = get_time_us();
+    if (num_encoders > 1)
+      write_png_file_parallel("output.png", pool.output_buffer, level, filter, num_encoders);
+    else
+      write_png_file("output.png", pool.output_buffer, level, filter);
+    record_time(&main_timings, PHASE_ENCODE, get_time_us() - start_us);
+  }
+  if (timings_file)
+    dump_timings(timings_file, mirror_timings, NUM_MIRRORS, decoder_timings, num_decoders, &main_timings, NULL, NULL);
+
+  for (i = 0; i < num_loops; ++i)
+    close(pool.wakefds[i]);
+  for (i = 0; i < num_decoders; ++i)
+    free(pool.queues[i].jobs);
+  free(pool.wakefds);
+  free(pool.queues);
+  free(pool.jobs);
+  if (cache_dir)
+    close_cache(&cache);
+  else if (!raw_file)
+    free(pool.output_buffer);
+  free(pool.painted_fragments);
+  free(decoder_threads);
+  free(decoder_contexts);
+  free(decoder_timings);
+  free(loop_threads);
+  free(loop_contexts);
+
+  return 0;
+}
@@ -21,487 +21,3004 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <time.h>
+#include <pthread.h>
 
 #define PNG_DEBUG 3
 #include <png.h>
 #include <curl/curl.h>
 #include <curl/multi.h>
 
-struct bufdata {
-  png_bytep buf;
-  int len, pos;
-  size_t max_size;
-};
+#include "geometry.h"
+#include "link.h"
+#include "libpaster.h"
 
-#define N 20
-#define WIDTH 4000
-#define HEIGHT 3000
+#include "fetch.h"
+#include "image.h"
+#include "mirrors.h"
+#include "stream.h"
+#include "autotune.h"
 
-#define BASE_URL_1 "http://berkeley.uwaterloo.ca:4590/image?img=%d"
-#define BASE_URL_2 "http://patricklam.ca:4590/image?img=%d"
-#define BASE_URL_3 "http://ece459-1.uwaterloo.ca:4590/image?img=%d"
+#define DEFAULT_COMPRESSION_LEVEL 6    // zlib's own default
 
-#define BUF_WIDTH WIDTH/N
-#define BUF_HEIGHT HEIGHT
-#define BUF_SIZE 10485760
-#define ECE459_HEADER "X-Ece459-Fragment: "
+// hedge once no more than this many fragments are missing (-k)
+#define DEFAULT_TAIL_AT 2
+#define MAX_EVENTS 64
 
-#ifdef DEBUG
-#define DEBUG_PRINT(x) (printf x)
-#else
-#define DEBUG_PRINT(x) /* DEBUG is not defined/enabled */
-#endif
+/***********************************************************************************/
+/* accounting for requests, and the budget                                         */
+
+/* Every transfer is counted when it starts, and again when it finishes
+ * under the fragment it turned out to carry and the mirror that sent it:
+ * how many requests each fragment took, how many of those were for one we
+ * already had and how many bytes they cost, and how the fragments each
+ * mirror hands out are spread. The totals are printed at the end, with -v
+ * on stderr every second as well, and -j adds the lot to its JSON.
+ *
+ * -q and -Q cap the requests and megabytes the engine may spend over its
+ * life, and -e and -E those it may spend on any one image. Once a budget
+ * runs out no more transfers start for what it covers, and as soon as the
+ * last of them is in, an image still missing fragments is given up on:
+ * its job completes as over budget, with nothing written, and the engine
+ * goes on with the others (with -D the other workers may yet finish it,
+ * so it waits for the assembler instead). Before then, the hedges sit
+ * the tail out whenever what is left would only just cover the missing
+ * fragments at the rate requests have been turning into new ones, since
+ * most of what a hedge fetches is a duplicate. Transfers in flight when
+ * the budget runs out still finish, so it can go over by as many
+ * fragments as there are transfers. The bytes are those that reached the
+ * write callbacks: with -d a duplicate is cut off after its headers, and
+ * whatever of its body was already on the way isn't counted. */
+
+struct accounts {
+  long requests;
+  long no_fragment;             // ended before saying which fragment
+  long bytes;                   // of body received, duplicates and all
+  long duplicate_bytes;
+  long fragment_requests[MAX_FRAGMENTS];
+  long fragment_duplicates[MAX_FRAGMENTS];
+  long mirror_fragments[NUM_MIRRORS][MAX_FRAGMENTS];
+  long max_requests;            // 0 for no limit
+  long max_bytes;
+  long image_max_requests;      // likewise, for each image
+  long image_max_bytes;
+  long over_budget;             // images given up on
+  bool spent;
+  double start;
+  double next_tick;             // 0 without -v
+};
 
-/* error handling macro */
-void abort_(const char * s, ...)
+void init_accounts (struct accounts * a, long max_requests, long max_bytes,
+		    long image_max_requests, long image_max_bytes, bool ticker)
 {
-  va_list args;
-  va_start(args, s);
-  vfprintf(stderr, s, args);
-  fprintf(stderr, "\n");
-  va_end(args);
-  abort();
+  memset(a, 0, sizeof(*a));
+  a->max_requests = max_requests;
+  a->max_bytes = max_bytes;
+  a->image_max_requests = image_max_requests;
+  a->image_max_bytes = image_max_bytes;
+  a->start = get_time();
+  a->next_tick = ticker ? a->start + 1 : 0;
 }
 
-/***********************************************************************************/
-/* routines to parse PNG data and copy it to an internal buffer */
-
-void read_cb (png_structp png_ptr, png_bytep outBytes, png_size_t byteCountToRead);
-
-/* Given PNG-formatted data at bd, read the data into a buffer that we allocate
- * and return (row_pointers, here).
- *
- * Note: caller must free the returned value. */
-png_bytep* read_png_file(png_structp png_ptr, png_infop * info_ptr, struct bufdata * bd)
+void record_request (struct accounts * a)
 {
-  int y;
-
-  int height;
-  png_byte bit_depth;
+  a->requests++;
+}
 
-  png_bytep * row_pointers;
+/* count a finished transfer (or one cut short), whatever came of it */
+void record_response (struct accounts * a, int mirror, struct headerdata * hd)
+{
+  a->bytes += hd->received;
+  if (hd->n < 0)
+  {
+    a->no_fragment++;
+    return;
+  }
+  a->fragment_requests[hd->n]++;
+  a->mirror_fragments[mirror][hd->n]++;
+  if (hd->duplicate)
+  {
+    a->fragment_duplicates[hd->n]++;
+    a->duplicate_bytes += hd->received;
+  }
+}
 
-  if (png_sig_cmp(bd->buf, 0, 8))
-    abort_("[read_png_file] Input is not recognized as a PNG file");
+long duplicates (struct accounts * a)
+{
+  long total = 0;
+  int n;
 
-  *info_ptr = png_create_info_struct(png_ptr);
-  if (!*info_ptr)
-    abort_("[read_png_file] png_create_info_struct failed");
+  for (n = 0; n < N; ++n)
+    total += a->fragment_duplicates[n];
+  return total;
+}
 
-  if (setjmp(png_jmpbuf(png_ptr)))
-    abort_("[read_png_file] Error during init_io");
+long new_fragments (struct accounts * a)
+{
+  long total = 0;
+  int n;
 
-  bd->pos = 0;
-  png_set_read_fn(png_ptr, bd, read_cb);
-  png_read_info(png_ptr, *info_ptr);
-  height = png_get_image_height(png_ptr, *info_ptr);
-  bit_depth = png_get_bit_depth(png_ptr, *info_ptr);
-  if (bit_depth != 8)
-    abort_("[read_png_file] bit depth 16 PNG files unsupported");
+  for (n = 0; n < N; ++n)
+    total += a->fragment_requests[n] - a->fragment_duplicates[n];
+  return total;
+}
 
-  if (setjmp(png_jmpbuf(png_ptr)))
-    abort_("[read_png_file] Error during read_image");
+/* whether another transfer may start; with verbose, says so once when it
+ * can't */
+bool within_budget (struct accounts * a)
+{
+  if (a->spent)
+    return false;
+  if ((a->max_requests && a->requests >= a->max_requests) ||
+      (a->max_bytes && a->bytes >= a->max_bytes))
+  {
+    a->spent = true;
+    if (verbose)
+      printf("budget spent after %ld requests and %ld bytes\n", a->requests, a->bytes);
+    return false;
+  }
+  return true;
+}
 
-  row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * BUF_HEIGHT);
-  for (y=0; y<height; y++)
-    row_pointers[y] = (png_byte*) malloc(png_get_rowbytes(png_ptr, *info_ptr));
+/* whether the rest of the budget only just covers missing more fragments
+ * at the going rate */
+bool budget_tight (struct accounts * a, int missing)
+{
+  long fresh = new_fragments(a);
 
-  png_read_image(png_ptr, row_pointers);
+  if (!fresh)
+    return false;
+  if (a->max_requests && (a->max_requests - a->requests) * fresh < missing * a->requests)
+    return true;
+  return a->max_bytes && (a->max_bytes - a->bytes) * fresh < missing * a->bytes;
+}
 
-  return row_pointers;
+/* -v: a line on stderr every second */
+void tick (struct accounts * a)
+{
+  double now;
+  long dups = duplicates(a);
+
+  if (!a->next_tick || (now = get_time()) < a->next_tick)
+    return;
+  a->next_tick = now + 1;
+  fprintf(stderr, "%.1f s: %ld requests, %ld new fragments, %ld duplicates (%.0f%%), %.1f MB, %.1f MB of them duplicate\n",
+	  now - a->start, a->requests, new_fragments(a), dups,
+	  a->requests ? 100.0 * dups / a->requests : 0.0,
+	  a->bytes / 1e6, a->duplicate_bytes / 1e6);
 }
 
-/* libpng calls this (at read_png_data's request)
- * to copy data from the in-RAM PNG into our bitmap */
-void read_cb (png_structp png_ptr, png_bytep outBytes, png_size_t byteCountToRead) {
-  struct bufdata * bd = png_get_io_ptr(png_ptr);
+void print_accounts (struct accounts * a)
+{
+  long fresh = new_fragments(a);
+
+  printf("%ld requests for %ld new fragments (%.2f each): %ld duplicates, %ld ended before a fragment, %ld of %ld bytes duplicate\n",
+	 a->requests, fresh, fresh ? (double) a->requests / fresh : 0.0, duplicates(a),
+	 a->no_fragment, a->duplicate_bytes, a->bytes);
+  if (a->max_requests)
+    printf("budget: %ld of %ld requests\n", a->requests, a->max_requests);
+  if (a->max_bytes)
+    printf("budget: %ld of %ld bytes\n", a->bytes, a->max_bytes);
+  if (a->over_budget)
+    printf("budget: %ld images given up on\n", a->over_budget);
+}
 
-  if (bd == NULL)
-    abort_("[read_png_file/read_cb] invalid memory passed to png reader");
-  if (bd->pos + byteCountToRead >= bd->len)
-    abort_("[read_png_file/read_cb] attempting to read beyond end of buffer");
+void print_longs_json (FILE * f, long * values, int n)
+{
+  int i;
 
-  memcpy(outBytes, bd->buf+bd->pos, byteCountToRead);
-  bd->pos += byteCountToRead;
+  fprintf(f, "[");
+  for (i = 0; i < n; ++i)
+    fprintf(f, "%s%ld", i ? ", " : "", values[i]);
+  fprintf(f, "]");
 }
 
-/* copy from row_pointers data array to dest data array, at offset (x0, y0) */
-void paint_destination(png_structp png_ptr, png_bytep * row_pointers,
-		       int x0, int y0, png_byte* dest)
+/* "requests": {..., "fragments": [per fragment], "duplicates": [...],
+ * "mirrors": [[per fragment] per mirror]}, for dump_timings to add */
+void print_accounts_json (FILE * f, void * arg)
 {
-  int x, y, i;
+  struct accounts * a = arg;
+  int i;
 
-  for (y=0; y<BUF_HEIGHT && (y0+y) < HEIGHT; y++) {
-    png_byte* row = row_pointers[y];
-    for (x=0; x<BUF_WIDTH; x++) {
-      png_byte* ptr = &(row[x*4]);
-      int index = ((y0+y)*WIDTH+(x0+x))*4;
-      for (i = 0; i < 4; i++)
-	dest[index+i] = ptr[i];
-    }
+  fprintf(f, "  \"requests\": {\"requests\": %ld, \"no_fragment\": %ld, \"bytes\": %ld, \"duplicate_bytes\": %ld,\n",
+	  a->requests, a->no_fragment, a->bytes, a->duplicate_bytes);
+  fprintf(f, "    \"fragments\": ");
+  print_longs_json(f, a->fragment_requests, N);
+  fprintf(f, ",\n    \"duplicates\": ");
+  print_longs_json(f, a->fragment_duplicates, N);
+  fprintf(f, ",\n    \"mirrors\": [");
+  for (i = 0; i < NUM_MIRRORS; ++i)
+  {
+    fprintf(f, "%s", i ? ", " : "");
+    print_longs_json(f, a->mirror_fragments[i], N);
   }
+  fprintf(f, "]}");
 }
 
 /***********************************************************************************/
-/* routine used by curl to read from the network                                   */
+/* batch mode: assembling many images over the same connections                    */
+
+/* With -b, one run assembles a whole list of images. Every transfer goes
+ * through the one multi handle, so requests for one image reuse the
+ * keep-alive connections of those for another, and -t bounds the transfers
+ * in flight across the batch. Each open image needs a full-size output
+ * buffer, so images are opened in order, at most -a at a time, and each is
+ * written out and freed as soon as it is complete. A transfer goes to the
+ * open image with the fewest transfers per missing fragment, which keeps
+ * the tail of one image busy with the start of the next.
+ *
+ * The images come as jobs from paster_submit (see libpaster.h), queued
+ * until one of the -a image slots is free; the command line just submits
+ * its whole list up front. */
 
-/* curl calls this to transfer data from the network into RAM */
-size_t write_cb(char * ptr, size_t size, size_t nmemb, void *userdata) {
-  struct bufdata * bd = userdata;
+#define DEFAULT_ACTIVE_IMAGES 2
 
-  if (size * nmemb >= bd->max_size) {
-    return 0;
-  }
+struct paster_job {
+  int img;
+  char * file_name;             // NULL for the pixels
+  paster_callback on_complete;
+  void * arg;
+  uint64_t assembled;           // with -D, fragments the assembler had before it was opened
+  struct paster_job * next;
+};
+
+/* submitted images not yet opened */
+struct job_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;         // the engine has published its wakefd
+  struct paster_job * head, * tail;
+  bool stopping;                // no more are coming
+  bool failed;                  // the engine has given up, and takes no more
+};
+
+struct image {
+  struct paster_job * job;      // what the slot is assembling, if it's open
+  int img;
+  int missing;          // fragments not painted yet
+  int in_flight;        // transfers requesting this image
+  bool open;
+  struct bitmap received_fragments;    // claimed by header_cb
+  bool * painted_fragments;
+  bool * decoding_fragments;    // handed to a decoder (-w) or the assembler (-D), not painted yet
+  bool remote;                  // with -D the assembler has the pixels, and writes the image
+  uint64_t assembled;           // fragments the assembler has told us it has
+  long requests, bytes;         // spent on it, against -e and -E
+  png_byte * output_buffer;
+  char * file_name;     // the PNG, or with -o the stripe file and -r the PAM
+  struct stripefile stripes;
+  struct rawfile raw;
+  struct cache cache;
+  png_bytep pixels;             // with no file name, what close_image leaves for the job
+};
 
-  memcpy(bd->buf+bd->pos, ptr, size * nmemb);
-  bd->pos += size*nmemb;
-  bd->len += size*nmemb;
-  return size * nmemb;
+void signal_eventfd (int fd)
+{
+  uint64_t one = 1;
+
+  if (write(fd, &one, sizeof(one)) != sizeof(one))
+    abort_("[%s] could not write eventfd %d", __FUNCTION__, fd);
 }
 
-/***********************************************************************************/
-/* routine to write data to disk                                                   */
+/* queue job and wake the engine; false if it has given up. The wakefd is
+ * signalled under the lock, since an engine that gives up closes it as
+ * soon as it has emptied the queue */
+bool push_job (struct job_queue * q, struct paster_job * job, int wakefd)
+{
+  job->next = NULL;
+  pthread_mutex_lock(&q->lock);
+  if (q->failed)
+  {
+    pthread_mutex_unlock(&q->lock);
+    return false;
+  }
+  if (q->head)
+    q->tail->next = job;
+  else
+    q->head = job;
+  q->tail = job;
+  signal_eventfd(wakefd);
+  pthread_mutex_unlock(&q->lock);
+  return true;
+}
 
-/* write output_row_pointers back to PNG file as specified by file_name. */
-void write_png_file(char* file_name, png_bytep * output_row_pointers)
+struct paster_job * take_job (struct job_queue * q)
 {
-  png_structp png_ptr;
-  png_infop info_ptr;
+  struct paster_job * job;
 
-  /* create file */
-  FILE *fp = fopen(file_name, "wb");
-  if (!fp)
-    abort_("[write_png_file] File %s could not be opened for writing", file_name);
+  pthread_mutex_lock(&q->lock);
+  if ((job = q->head))
+    q->head = job->next;
+  pthread_mutex_unlock(&q->lock);
+  return job;
+}
 
+/* complete every queued job as PASTER_FAILED, and turn away any more;
+ * returns how many there were */
+int fail_jobs (struct job_queue * q)
+{
+  struct paster_job * job, * next;
+  struct paster_result result = { 0 };
+  int n = 0;
 
-  /* initialize stuff */
-  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  pthread_mutex_lock(&q->lock);
+  q->failed = true;
+  job = q->head;
+  q->head = NULL;
+  pthread_mutex_unlock(&q->lock);
 
-  if (!png_ptr)
-    abort_("[write_png_file] png_create_write_struct failed");
+  for (; job; job = next, ++n)
+  {
+    next = job->next;
+    result.img = job->img;
+    result.status = PASTER_FAILED;
+    result.file_name = job->file_name;
+    result.width = WIDTH;
+    result.height = HEIGHT;
+    if (job->on_complete)
+      job->on_complete(&result, job->arg);
+    free(job->file_name);
+    free(job);
+  }
+  return n;
+}
+
+/* whether anything is waiting for a slot; *stopping says whether anything
+ * more can come */
+bool jobs_pending (struct job_queue * q, bool * stopping)
+{
+  bool pending;
+
+  pthread_mutex_lock(&q->lock);
+  pending = q->head != NULL;
+  *stopping = q->stopping;
+  pthread_mutex_unlock(&q->lock);
+  return pending;
+}
 
-  info_ptr = png_create_info_struct(png_ptr);
-  if (!info_ptr)
-    abort_("[write_png_file] png_create_info_struct failed");
+/* parse a list like 1-5,8 into *imgs; returns how many, or 0 if it's
+ * malformed */
+int parse_image_list (char * spec, int ** imgs)
+{
+  int num_imgs = 0, max_imgs = 16;
+  unsigned long first, last;
+  char * end;
+
+  *imgs = malloc(max_imgs * sizeof(int));
+  if (!*imgs)
+    abort_("[parse_image_list] malloc failed");
+
+  for (;;) {
+    first = last = strtoul(spec, &end, 10);
+    if (end == spec || first == 0)
+      return 0;
+    if (*end == '-') {
+      spec = end + 1;
+      last = strtoul(spec, &end, 10);
+      if (end == spec || last < first)
+	return 0;
+    }
+    for (; first <= last; ++first) {
+      if (num_imgs == max_imgs) {
+	max_imgs *= 2;
+	*imgs = realloc(*imgs, max_imgs * sizeof(int));
+	if (!*imgs)
+	  abort_("[parse_image_list] realloc failed");
+      }
+      (*imgs)[num_imgs++] = first;
+    }
+    if (*end == '\0')
+      return num_imgs;
+    if (*end != ',')
+      return 0;
+    spec = end + 1;
+  }
+}
 
-  if (setjmp(png_jmpbuf(png_ptr)))
-    abort_("[write_png_file] Error during init_io");
+/* allocate an image's buffers and paint whatever the cache has of it */
+void open_image (struct image * im, const char * cache_dir, bool stripes, bool raw, int level, int filter)
+{
+  uint64_t cached = im->assembled;
+  int i;
 
-  png_init_io(png_ptr, fp);
+  memset(&im->received_fragments, 0, sizeof(im->received_fragments));
+  im->painted_fragments = calloc(N, sizeof(bool));
+  im->decoding_fragments = calloc(N, sizeof(bool));
+  if (!im->painted_fragments || !im->decoding_fragments)
+    abort_("[open_image] image %d: malloc failed", im->img);
+  im->missing = N;
+  im->in_flight = 0;
+  im->requests = im->bytes = 0;
+  im->open = true;
+
+  if (stripes)
+    open_stripefile(&im->stripes, im->file_name, level, filter);
+  if (raw)
+    open_rawfile(&im->raw, im->file_name);
+
+  // whatever the checkpoint has needn't be downloaded
+  if (cache_dir)
+  {
+    cached = open_cache(&im->cache, cache_dir, im->img);
+    im->output_buffer = im->cache.image;
+    if (verbose)
+      printf("image %d: %d fragments from the cache\n", im->img, __builtin_popcountll(cached));
+  }
+  else if (raw)
+  {
+    im->output_buffer = im->raw.image;
+  }
+  else if (im->remote)
+  {
+    im->output_buffer = NULL;
+  }
+  else
+  {
+    im->output_buffer = calloc(WIDTH*HEIGHT*4, sizeof(png_byte));
+    if (!im->output_buffer)
+      abort_("[open_image] image %d: malloc failed", im->img);
+  }
+  for (i = 0; i < N; ++i)
+  {
+    if (!(cached >> i & 1))
+      continue;
+    test_and_set_bit(&im->received_fragments, i);
+    im->painted_fragments[i] = true;
+    im->missing--;
+    if (stripes)
+      write_stripe(&im->stripes, i, im->output_buffer);
+  }
+}
 
-  /* write header */
-  if (setjmp(png_jmpbuf(png_ptr)))
-    abort_("[write_png_file] Error during writing header");
+/* write a complete image out and free its buffers */
+void close_image (struct image * im, const char * cache_dir, bool stripes, bool raw, int level, int filter,
+		  struct timings * timings)
+{
+  long start_us;
 
-  png_set_IHDR(png_ptr, info_ptr, WIDTH, HEIGHT,
-	       8, 6, PNG_INTERLACE_NONE,
-	       PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+  if (stripes)
+  {
+    // every stripe is on disk already
+    close_stripefile(&im->stripes);
+  }
+  else if (raw)
+  {
+    // and so is every pixel
+    close_rawfile(&im->raw, im->output_buffer);
+  }
+  else if (im->remote)
+  {
+    // the assembler writes it
+  }
+  else if (!im->file_name)
+  {
+    // the job takes the pixels instead
+  }
+  else
+  {
+    // now, write the array back to disk using write_png_file
+    start_us = get_time_us();
+    write_png_file(im->file_name, im->output_buffer, level, filter);
+    record_time(timings, PHASE_ENCODE, get_time_us() - start_us);
+  }
 
-  png_write_info(png_ptr, info_ptr);
+  im->pixels = NULL;
+  if (cache_dir)
+    close_cache(&im->cache);
+  else if (!im->file_name)
+    im->pixels = im->output_buffer;
+  else if (!raw)
+    free(im->output_buffer);
+  free(im->painted_fragments);
+  free(im->decoding_fragments);
+  im->output_buffer = NULL;
+  im->open = false;
+}
 
-  /* write bytes */
-  if (setjmp(png_jmpbuf(png_ptr)))
-    abort_("[write_png_file] Error during writing bytes");
+/* give up on an image: free its buffers without writing it, and take
+ * away the half-written stripe file or PAM. The checkpoint stays, so a
+ * later run needn't fetch what this one got */
+void abandon_image (struct image * im, const char * cache_dir, bool stripes, bool raw)
+{
+  if (stripes)
+  {
+    close(im->stripes.fd);
+    unlink(im->file_name);
+  }
+  else if (raw)
+  {
+    munmap(im->raw.map, im->raw.size);
+    close(im->raw.fd);
+    unlink(im->file_name);
+  }
 
-  png_write_image(png_ptr, output_row_pointers);
+  im->pixels = NULL;
+  if (cache_dir)
+    close_cache(&im->cache);
+  else if (!raw)
+    free(im->output_buffer);
+  free(im->painted_fragments);
+  free(im->decoding_fragments);
+  im->output_buffer = NULL;
+  im->open = false;
+}
 
-  if (setjmp(png_jmpbuf(png_ptr)))
-    abort_("[write_png_file] Error during end of write");
+/* whether another transfer may start for im, under -e and -E */
+bool image_within_budget (struct accounts * a, struct image * im)
+{
+  return !(a->image_max_requests && im->requests >= a->image_max_requests) &&
+    !(a->image_max_bytes && im->bytes >= a->image_max_bytes);
+}
 
-  png_write_end(png_ptr, NULL);
+/* whether anything for im is still on its way: a transfer, or a fragment
+ * with a decoder */
+bool image_busy (struct image * im)
+{
+  int i;
 
-  fclose(fp);
-  png_destroy_write_struct(&png_ptr, &info_ptr);
+  if (im->in_flight)
+    return true;
+  for (i = 0; i < N; ++i)
+    if (im->decoding_fragments[i])
+      return true;
+  return false;
 }
 
-struct headerdata {
-  int n;
-  bool * received_fragments;
-};
+/* whether some fragment of im is still to be had. Once every one it's
+ * missing has been claimed, by a transfer that has its headers, a decoder
+ * or the assembler, another request can only bring back a duplicate; one
+ * of them failing gives its fragment back */
+bool unclaimed (struct image * im)
+{
+  int i;
 
-size_t header_cb (char * buf, size_t size, size_t nmemb, void * userdata)
+  for (i = 0; i < N; ++i)
+    if (!test_bit(&im->received_fragments, i))
+      return true;
+  return false;
+}
+
+/* the open image that most needs another transfer, if any still does and
+ * may have one */
+struct image * pick_image (struct image * images, int num_images, struct accounts * a)
 {
-  struct headerdata * hd = userdata;
-  int bytes_in_header = size * nmemb;
+  struct image * best = NULL;
+  int i;
 
-  if (bytes_in_header > strlen(ECE459_HEADER) && strncmp(buf, ECE459_HEADER, strlen(ECE459_HEADER)) == 0) {
-    // one ought to check that buf is 0-terminated
-    //  not guaranteed by spec (!)
-    hd->n = atoi(buf+strlen(ECE459_HEADER));
-    hd->received_fragments[hd->n] = true;
-    printf("received fragment %d\n", hd->n);
+  for (i = 0; i < num_images; ++i)
+  {
+    if (!images[i].open || images[i].missing == 0 || !unclaimed(&images[i]) ||
+	!image_within_budget(a, &images[i]))
+      continue;
+    if (!best || images[i].in_flight * best->missing < best->in_flight * images[i].missing)
+      best = &images[i];
   }
-  return bytes_in_header;
+  return best;
 }
 
 /***********************************************************************************/
-//
-// Get url to get image from
-//
-void get_url (char ** url, int img)
+/* fetching for an assembler                                                       */
+
+/* With -D host:port this is one of any number of workers, on as many
+ * machines as you like, fetching for bin/assembler (see link.h). New
+ * fragments aren't painted here but sent on as they were downloaded, and
+ * every fragment the assembler reports painted, whoever fetched it, is
+ * marked received and painted here too: header_cb then cuts short any
+ * more copies of it (with -d) and pick_image stops asking for an image
+ * once the assembler has all of it. */
+
+struct link {
+  int fd;
+  struct linkbuf lb;
+  bool closed;          // the assembler hung up
+};
+
+/* a link that can't be had starts out closed, for the engine to give up on */
+void open_link (struct link * l, const char * spec)
 {
-  static unsigned int counter;
+  l->fd = open_link_socket(spec, false);
+  memset(&l->lb, 0, sizeof(l->lb));
+  l->closed = l->fd < 0;
+  if (l->closed)
+    fprintf(stderr, "could not connect to the assembler at %s\n", spec);
+}
+
+void close_link (struct link * l)
+{
+  if (l->fd >= 0)
+    close(l->fd);
+  free(l->lb.buf);
+}
 
-  switch (counter)
+/* hand a new fragment to the assembler, which paints it or sends it back
+ * as corrupt */
+void ship_fragment (struct link * l, struct image * im, int n, png_const_bytep png, size_t len)
+{
+  if (!send_link_message(l->fd, LINK_FRAGMENT, im->img, n, png, len))
+    l->closed = true;
+  im->decoding_fragments[n] = true;
+}
+
+/* apply whatever the assembler has said since the last call */
+/* an image that hasn't been given a slot yet keeps its HAVEs in its job */
+void read_link (struct link * l, struct image * images, int num_images, struct job_queue * q)
+{
+  struct link_message msg;
+  struct image * im;
+  struct paster_job * job;
+  int i, n;
+
+  // what came before the hang-up still counts
+  if (!l->closed && !fill_linkbuf(l->fd, &l->lb))
+    l->closed = true;
+  while (take_link_message(&l->lb, &msg))
   {
-  case 0:
-    sprintf(*url, BASE_URL_1, img);
-    break;
-  case 1:
-    sprintf(*url, BASE_URL_2, img);
-    break;
-  case 2:
-  default:
-    sprintf(*url, BASE_URL_3, img);
-    break;
-  }
+    if (msg.type != LINK_HAVE && msg.type != LINK_REJECT)
+    {
+      // there's no telling what else it has got wrong
+      fprintf(stderr, "garbled message from the assembler\n");
+      l->closed = true;
+      l->lb.len = l->lb.taken = 0;
+      break;
+    }
+    for (im = NULL, i = 0; i < num_images && !im; ++i)
+      if (images[i].open && images[i].img == msg.img)
+	im = &images[i];
+    if (!im)
+    {
+      pthread_mutex_lock(&q->lock);
+      for (job = q->head; job; job = job->next)
+	if (job->img == msg.img && msg.type == LINK_HAVE)
+	  job->assembled |= msg.arg;
+      pthread_mutex_unlock(&q->lock);
+      continue;
+    }
 
-  counter = (counter + 1) % 3;
+    if (msg.type == LINK_HAVE)
+    {
+      im->assembled |= msg.arg;
+      for (n = 0; n < N; ++n)
+      {
+	if (!(msg.arg >> n & 1))
+	  continue;
+	test_and_set_bit(&im->received_fragments, n);
+	im->painted_fragments[n] = true;
+	im->decoding_fragments[n] = false;
+      }
+    }
+    else if (msg.arg < (uint64_t) N)
+    {
+      // it has to be fetched again, unless someone else's copy made it
+      im->decoding_fragments[msg.arg] = false;
+      if (!im->painted_fragments[msg.arg])
+	clear_bit(&im->received_fragments, msg.arg);
+    }
+  }
 }
 
+/***********************************************************************************/
+
 typedef struct _curl_context
 {
   int curl_id;
-  CURL * curl;
-  bool * received_fragments;
+  CURL * curl;          // kept for the context's every transfer
+  bool running;         // curl is in curlm
+  struct image * image;
   struct bufdata bd;
   struct headerdata hd;
-  png_bytep input_buffer;
+  bool stream_decode;
+  struct streamdata sd;
+  bool hedge;           // spreads its requests over every mirror
+  int mirror;
   char * url;
-  int img;
+  // with -U the ring does the transfer, over conn, instead of curl
+  struct uring * ur;
+  struct uconn * conn;
+  struct _curl_context * next_free;
+  // what paint_fragment made of the body
+  bool corrupt;
+  long paint_us, decode_us, encode_us;
+  struct _curl_context * next_decode;   // in the pipeline's backlog
 } curl_context, * pcurl_context;
 
-pcurl_context get_curl_context (pcurl_context contexts, int num_contexts, CURL * curl)
+/* every handle points back at its context */
+pcurl_context get_curl_context (CURL * curl)
 {
-  int i;
+  pcurl_context context = NULL;
 
-  for (i = 0; i < num_contexts; ++i)
-  {
-    if (contexts[i].curl == curl)
-    {
-      return &contexts[i];
-    }
-  }
+  curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **) &context);
+  return context;
+}
 
-  return 0;
+/***********************************************************************************/
+/* fetching over io_uring instead of curl                                          */
+
+/* With -U, transfers skip libcurl and go out as plain HTTP/1.1 GETs over
+ * an io_uring, which is the event loop as well: each trip round the loop
+ * is a single io_uring_enter that submits whatever the last one's
+ * completions queued (connects, sends, reads) and waits for more, where
+ * curl would need an epoll_wait and a read per ready socket. The decoders'
+ * eventfd and the link to the assembler are polled on the ring too.
+ *
+ * Every connection reads into its own staging buffer, registered with the
+ * ring so that the kernel doesn't map it in for every read. From there
+ * the header lines go to header_cb and the body to write_cb (or with -s
+ * stream_write_cb), just as curl would hand them over, so the fragment
+ * number, duplicates, the buffer pool and decoding all work the same. How
+ * a transfer went comes back as the CURLcode curl would have given.
+ *
+ * A connection is kept for the next request to the same mirror unless -K
+ * says otherwise, and one the mirror closed while it sat idle is opened
+ * again. Connects time out after CONNECT_TIMEOUT_MS, and reads after
+ * LOW_SPEED_TIME seconds of silence. Chunked bodies aren't supported, which
+ * the mirrors never send. */
+
+#define URING_BUF_SIZE 65536
+#define URING_REQUEST_SIZE 512
+
+enum uring_op { URING_CONNECT = 1, URING_SEND, URING_READ, URING_TIMEOUT, URING_WAKE, URING_LINK };
+
+enum fetch_state { FETCH_IDLE, FETCH_CONNECTING, FETCH_SENDING, FETCH_STATUS, FETCH_HEADERS,
+		   FETCH_BODY, FETCH_DONE };
+
+struct uconn {
+  int index;                    // of its registered buffer
+  uint32_t gen;                 // bumped when the socket closes, to spot stale completions
+  int fd;                       // -1 if closed
+  int mirror;                   // it's connected to
+  pcurl_context context;        // NULL while idle
+  enum fetch_state state;
+  bool fresh;                   // connected for this transfer
+  bool keep_alive;
+  bool got_bytes;               // of the response
+  char request[URING_REQUEST_SIZE];
+  size_t request_len, sent;
+  png_bytep buf;
+  size_t len;                   // bytes of buf not yet parsed
+  CURLcode result;
+  struct __kernel_timespec timeout;
+  long start_us, dns_us, connect_us, ttfb_us, end_us, bytes;
+};
+
+struct uring_target {
+  bool resolved;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+};
+
+struct uring {
+  int fd;
+  unsigned * sq_head, * sq_tail, * sq_mask, * sq_array;
+  unsigned * cq_head, * cq_tail, * cq_mask;
+  unsigned sq_entries, tail, to_submit;
+  struct io_uring_sqe * sqes;
+  struct io_uring_cqe * cqes;
+  void * sq_ring, * cq_ring;
+  size_t sq_ring_size, cq_ring_size;
+  bool fixed;                   // the staging buffers are registered
+  struct uconn * conns;
+  int num_conns;
+  png_bytep bufs;
+  pcurl_context * finished;     // transfers for next_finished
+  int num_finished;
+  int wakefd, linkfd;
+  struct uring_target targets[NUM_MIRRORS];
+  unsigned long enters, ops;
+};
+
+// -c for the ring, which connects there itself
+static const char * connect_addr;
+
+int io_uring_setup (unsigned entries, struct io_uring_params * p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int io_uring_enter (int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int io_uring_register (int fd, unsigned opcode, void * arg, unsigned nr_args)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
 }
 
-void init_curl (CURLM * curlm, pcurl_context context)
+/* hand the queued entries to the kernel, and with wait block until at
+ * least one completion is in */
+void flush_uring (struct uring * ur, bool wait)
 {
-  context->curl = curl_easy_init();
-  if (!context->curl)
+  int ret;
+
+  __atomic_store_n(ur->sq_tail, ur->tail, __ATOMIC_RELEASE);
+  ret = io_uring_enter(ur->fd, ur->to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+  ur->enters++;
+  if (ret < 0)
   {
-    abort_("[%s] could not init curl", __FUNCTION__);
+    if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+      return;
+    abort_("[%s] io_uring_enter failed: %s", __FUNCTION__, strerror(errno));
   }
+  ur->to_submit -= ret;
+  ur->ops += ret;
+}
 
-  // request appropriate URL
-  get_url(&context->url, context->img);
-  DEBUG_PRINT(("[%s] Curl #%d requesting URL %s\n", __FUNCTION__, context->curl_id, context->url));
-  curl_easy_setopt(context->curl, CURLOPT_URL, context->url);
+/* a cleared entry at the tail of the submission queue */
+struct io_uring_sqe * get_sqe (struct uring * ur)
+{
+  struct io_uring_sqe * sqe;
+  unsigned i;
+
+  if (ur->tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) == ur->sq_entries)
+    flush_uring(ur, false);
+  if (ur->tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) == ur->sq_entries)
+    abort_("[%s] submission queue full", __FUNCTION__);
+
+  i = ur->tail & *ur->sq_mask;
+  sqe = &ur->sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  ur->sq_array[i] = i;
+  ur->tail++;
+  ur->to_submit++;
+  return sqe;
+}
 
-  context->bd.len = 0;
-  context->bd.pos = 0;
-  context->bd.max_size = BUF_SIZE;
-  curl_easy_setopt(context->curl, CURLOPT_WRITEFUNCTION, write_cb);
-  curl_easy_setopt(context->curl, CURLOPT_WRITEDATA, &context->bd);
+uint64_t op_data (enum uring_op op, struct uconn * c)
+{
+  return (uint64_t) op << 56 | (c ? (uint64_t) c->index << 32 | c->gen : 0);
+}
 
-  curl_easy_setopt(context->curl, CURLOPT_HEADERDATA, &context->hd);
-  curl_easy_setopt(context->curl, CURLOPT_HEADERFUNCTION, header_cb);
+void poll_fd (struct uring * ur, int fd, enum uring_op op)
+{
+  struct io_uring_sqe * sqe = get_sqe(ur);
 
-  curl_multi_add_handle(curlm, context->curl);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = op_data(op, NULL);
 }
 
-void init_curl_for_multi_curl (CURLM * curlm, pcurl_context context, int curl_id, bool * received_fragments, int img)
+/* sqe fails with -ECANCELED after ms of waiting */
+void link_timeout (struct uring * ur, struct uconn * c, struct io_uring_sqe * sqe, long ms)
 {
-  context->curl_id = curl_id;
-  context->img = img;
+  c->timeout.tv_sec = ms / 1000;
+  c->timeout.tv_nsec = ms % 1000 * 1000000L;
+  sqe->flags |= IOSQE_IO_LINK;
+  sqe = get_sqe(ur);
+  sqe->opcode = IORING_OP_LINK_TIMEOUT;
+  sqe->addr = (uint64_t) (uintptr_t) &c->timeout;
+  sqe->len = 1;
+  sqe->user_data = op_data(URING_TIMEOUT, c);
+}
 
-  context->input_buffer = (png_bytep) malloc(sizeof(png_byte)*BUF_SIZE);
-  if (!context->input_buffer)
-  {
-    abort_("[%s] input_buffer malloc failed\n", __FUNCTION__);
-  }
+//
+// num_conns is the most transfers there will ever be at once; wakefd and
+// linkfd are as for init_event_loop
+//
+void init_uring (struct uring * ur, int num_conns, int wakefd, int linkfd)
+{
+  struct io_uring_params p;
+  struct iovec * iovs;
+  int i;
 
-  context->url = (char *) malloc(sizeof(char)*strlen(BASE_URL_1)+4*5);
-  if (!context->url)
+  memset(ur, 0, sizeof(*ur));
+  memset(&p, 0, sizeof(p));
+  // a read and its timeout per connection, and the polls
+  ur->fd = io_uring_setup(2 * num_conns + 4, &p);
+  if (ur->fd < 0)
+    abort_("[%s] io_uring_setup failed: %s", __FUNCTION__, strerror(errno));
+  if (!(p.features & IORING_FEAT_NODROP))
+    abort_("[%s] this kernel's io_uring is too old", __FUNCTION__);
+
+  ur->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ur->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP && ur->cq_ring_size > ur->sq_ring_size)
+    ur->sq_ring_size = ur->cq_ring_size;
+  ur->sq_ring = mmap(NULL, ur->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		     ur->fd, IORING_OFF_SQ_RING);
+  ur->cq_ring = p.features & IORING_FEAT_SINGLE_MMAP ? ur->sq_ring :
+    mmap(NULL, ur->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+  ur->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+  if (ur->sq_ring == MAP_FAILED || ur->cq_ring == MAP_FAILED || ur->sqes == MAP_FAILED)
+    abort_("[%s] could not map the rings", __FUNCTION__);
+
+  ur->sq_head = (unsigned *) ((char *) ur->sq_ring + p.sq_off.head);
+  ur->sq_tail = (unsigned *) ((char *) ur->sq_ring + p.sq_off.tail);
+  ur->sq_mask = (unsigned *) ((char *) ur->sq_ring + p.sq_off.ring_mask);
+  ur->sq_array = (unsigned *) ((char *) ur->sq_ring + p.sq_off.array);
+  ur->cq_head = (unsigned *) ((char *) ur->cq_ring + p.cq_off.head);
+  ur->cq_tail = (unsigned *) ((char *) ur->cq_ring + p.cq_off.tail);
+  ur->cq_mask = (unsigned *) ((char *) ur->cq_ring + p.cq_off.ring_mask);
+  ur->cqes = (struct io_uring_cqe *) ((char *) ur->cq_ring + p.cq_off.cqes);
+  ur->sq_entries = p.sq_entries;
+  ur->tail = *ur->sq_tail;
+
+  ur->num_conns = num_conns;
+  ur->conns = calloc(num_conns, sizeof(struct uconn));
+  ur->finished = calloc(num_conns, sizeof(pcurl_context));
+  iovs = calloc(num_conns, sizeof(struct iovec));
+  ur->bufs = mmap(NULL, (size_t) num_conns * URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (!ur->conns || !ur->finished || !iovs || ur->bufs == MAP_FAILED)
+    abort_("[%s] connections malloc failed", __FUNCTION__);
+  for (i = 0; i < num_conns; ++i)
   {
-    abort_("[%s] could not malloc url", __FUNCTION__);
+    ur->conns[i].index = i;
+    ur->conns[i].fd = -1;
+    ur->conns[i].buf = ur->bufs + (size_t) i * URING_BUF_SIZE;
+    iovs[i].iov_base = ur->conns[i].buf;
+    iovs[i].iov_len = URING_BUF_SIZE;
   }
+  // pinning them can fail under a low RLIMIT_MEMLOCK; plain reads still work
+  ur->fixed = io_uring_register(ur->fd, IORING_REGISTER_BUFFERS, iovs, num_conns) == 0;
+  free(iovs);
+
+  ur->wakefd = wakefd;
+  ur->linkfd = linkfd;
+  poll_fd(ur, wakefd, URING_WAKE);
+  if (linkfd != -1)
+    poll_fd(ur, linkfd, URING_LINK);
+}
 
-  context->bd.buf = context->input_buffer;
-  context->hd.received_fragments = received_fragments;
-
-  init_curl(curlm, context);
+/* close c's socket, after taking back whatever the ring is still doing
+ * with it */
+void close_socket (struct uring * ur, struct uconn * c)
+{
+  struct io_uring_sync_cancel_reg reg;
+
+  if (c->fd < 0)
+    return;
+  // entries still in the queue can't be cancelled, only ones it has taken
+  if (ur->to_submit)
+    flush_uring(ur, false);
+  memset(&reg, 0, sizeof(reg));
+  reg.fd = c->fd;
+  reg.flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  reg.timeout.tv_sec = reg.timeout.tv_nsec = -1;
+  if (io_uring_register(ur->fd, IORING_REGISTER_SYNC_CANCEL, &reg, 1) < 0 && errno != ENOENT)
+    abort_("[%s] could not cancel a transfer: %s", __FUNCTION__, strerror(errno));
+  close(c->fd);
+  c->fd = -1;
+  c->gen++;
 }
 
-/***********************************************************************************/
+/* the transfer is over, one way or another; next_finished hands it back */
+void finish_fetch (struct uring * ur, struct uconn * c, CURLcode result)
+{
+  c->result = result;
+  c->state = FETCH_DONE;
+  c->end_us = get_time_us();
+  ur->finished[ur->num_finished++] = c->context;
+}
 
-int main(int argc, char **argv)
+void read_response (struct uring * ur, struct uconn * c)
 {
-  int c;
-  int num_threads = 4;
-  int img = 1;
-  bool received_all_fragments = false;
-  bool * received_fragments = calloc(N, sizeof(bool));
-  pcurl_context contexts;
-  int i;
-  CURLM * curlm;
-  int running_curls;
-  CURLMsg * msg;
-  int msgs_in_queue;
-  pcurl_context curr_context;
-  CURLMcode mc;
+  struct io_uring_sqe * sqe = get_sqe(ur);
+
+  sqe->opcode = ur->fixed ? IORING_OP_READ_FIXED : IORING_OP_RECV;
+  sqe->fd = c->fd;
+  sqe->addr = (uint64_t) (uintptr_t) (c->buf + c->len);
+  sqe->len = URING_BUF_SIZE - c->len;
+  if (ur->fixed)
+    sqe->buf_index = c->index;
+  sqe->user_data = op_data(URING_READ, c);
+  link_timeout(ur, c, sqe, LOW_SPEED_TIME * 1000L);
+}
 
-  while ((c = getopt (argc, argv, "t:i:")) != -1) {
-    switch (c) {
-    case 't':
-      num_threads = strtoul(optarg, NULL, 10);
-      if (num_threads == 0) {
-	printf("%s: option requires an argument > 0 -- 't'\n", argv[0]);
-	return -1;
-      }
-      break;
-    case 'i':
-      img = strtoul(optarg, NULL, 10);
-      if (img == 0) {
-	printf("%s: option requires an argument > 0 -- 'i'\n", argv[0]);
-	return -1;
-      }
-      break;
-    default:
-      return -1;
-    }
-  }
+void send_request (struct uring * ur, struct uconn * c)
+{
+  struct io_uring_sqe * sqe = get_sqe(ur);
+
+  c->state = FETCH_SENDING;
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = c->fd;
+  sqe->addr = (uint64_t) (uintptr_t) (c->request + c->sent);
+  sqe->len = c->request_len - c->sent;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = op_data(URING_SEND, c);
+}
 
-  contexts = (pcurl_context) calloc(num_threads, sizeof(curl_context));
-  if (!contexts)
-  {
-    abort_("[%s] contexts malloc failed", __FUNCTION__);
-  }
+/* where c's mirror (or -c) is; false if it doesn't resolve */
+bool resolve_target (struct uring * ur, struct uconn * c, const char * host, int host_len)
+{
+  struct uring_target * t = &ur->targets[c->mirror];
+  struct addrinfo hints, * res;
+  char name[256], * port;
+  long start_us;
+
+  if (t->resolved)
+    return true;
+  if (connect_addr)
+    snprintf(name, sizeof(name), "%s", connect_addr);
+  else
+    snprintf(name, sizeof(name), "%.*s", host_len, host);
+  port = strrchr(name, ':');
+  if (port)
+    *port++ = '\0';
+
+  // blocks, but only the first time
+  start_us = get_time_us();
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(name, port ? port : "80", &hints, &res))
+    return false;
+  memcpy(&t->addr, res->ai_addr, res->ai_addrlen);
+  t->addrlen = res->ai_addrlen;
+  t->resolved = true;
+  freeaddrinfo(res);
+  c->dns_us = get_time_us() - start_us;
+  return true;
+}
 
-  curl_global_init(CURL_GLOBAL_ALL);
+void connect_conn (struct uring * ur, struct uconn * c, const char * host, int host_len)
+{
+  struct uring_target * t = &ur->targets[c->mirror];
+  struct io_uring_sqe * sqe;
+  int one = 1;
 
-  curlm = curl_multi_init();
-  if (!curlm)
+  c->fresh = true;
+  if (!resolve_target(ur, c, host, host_len))
   {
-    abort_("[%s] curlm init failed\n", __FUNCTION__);
+    finish_fetch(ur, c, CURLE_COULDNT_RESOLVE_HOST);
+    return;
   }
-
-  // Set max connections
-  // curl_multi_setopt(curlm, CURLMOPT_MAXCONNECTS, (long) num_threads);
-
-  for (i = 0; i < num_threads; ++i)
+  c->fd = socket(t->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (c->fd < 0)
   {
-    init_curl_for_multi_curl(curlm, &contexts[i], i, received_fragments, img);
+    finish_fetch(ur, c, CURLE_COULDNT_CONNECT);
+    return;
   }
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  setsockopt(c->fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+
+  c->state = FETCH_CONNECTING;
+  sqe = get_sqe(ur);
+  sqe->opcode = IORING_OP_CONNECT;
+  sqe->fd = c->fd;
+  sqe->addr = (uint64_t) (uintptr_t) &t->addr;
+  sqe->off = t->addrlen;
+  sqe->user_data = op_data(URING_CONNECT, c);
+  link_timeout(ur, c, sqe, CONNECT_TIMEOUT_MS);
+}
 
-  png_structp png_ptr;
-  png_infop info_ptr;
+/* host and path out of an http:// URL, as from get_url */
+void split_url (const char * url, const char ** host, int * host_len, const char ** path)
+{
+  if (!strncmp(url, "http://", 7))
+    url += 7;
+  *host = url;
+  *path = strchr(url, '/');
+  if (!*path)
+    *path = "/";
+  *host_len = strchr(url, '/') ? strchr(url, '/') - url : (int) strlen(url);
+}
 
-  png_byte * output_buffer = calloc(WIDTH*HEIGHT*4, sizeof(png_byte));
+/* send context's request, over a connection to its mirror if one is idle */
+void start_fetch (struct uring * ur, pcurl_context context)
+{
+  struct uconn * c, * best = NULL;
+  const char * host, * path;
+  int host_len, i;
 
-  mc = curl_multi_perform(curlm, &running_curls);
-  if (mc != CURLM_OK)
+  for (i = 0; i < ur->num_conns; ++i)
   {
-    abort_("[%s:%s] curl_multi_perform failed\n", __FUNCTION__, __LINE__);
-  }
-
-  do {
-    while ((msg = curl_multi_info_read(curlm, &msgs_in_queue)))
+    c = &ur->conns[i];
+    if (c->context)
+      continue;
+    if (c->fd >= 0 && c->mirror == context->mirror)
     {
-      // Check to make sure the CURL-ing is done
-      if (msg->msg == CURLMSG_DONE) {
-	curr_context = get_curl_context(contexts, num_threads, msg->easy_handle);
-	DEBUG_PRINT(("[%s] R: %d - %s <%s>\n", __FUNCTION__,
-		     msg->data.result, curl_easy_strerror(msg->data.result), curr_context->url));
+      best = c;
+      break;
+    }
+    // rather a closed one than one some other mirror might still want
+    if (!best || (best->fd >= 0 && c->fd < 0))
+      best = c;
+  }
+  if (!best)
+    abort_("[%s] more transfers than connections", __FUNCTION__);
+  c = best;
+  if (c->fd >= 0 && c->mirror != context->mirror)
+    close_socket(ur, c);
+
+  c->context = context;
+  context->conn = c;
+  c->mirror = context->mirror;
+  c->keep_alive = !forbid_reuse;
+  c->got_bytes = false;
+  c->len = 0;
+  c->sent = 0;
+  c->bytes = 0;
+  c->dns_us = c->connect_us = 0;
+  c->start_us = get_time_us();
+
+  split_url(context->url, &host, &host_len, &path);
+  c->request_len = snprintf(c->request, sizeof(c->request),
+			    "GET %s HTTP/1.1\r\nHost: %.*s\r\nAccept: */*\r\n%s\r\n",
+			    path, host_len, host, forbid_reuse ? "Connection: close\r\n" : "");
+
+  if (c->fd >= 0)
+  {
+    c->fresh = false;
+    send_request(ur, c);
+  }
+  else
+  {
+    connect_conn(ur, c, host, host_len);
+  }
+}
+
+/* an idle connection the mirror had closed; try again on a new one */
+void reconnect (struct uring * ur, struct uconn * c)
+{
+  const char * host, * path;
+  int host_len;
+
+  close_socket(ur, c);
+  c->len = 0;
+  c->sent = 0;
+  split_url(c->context->url, &host, &host_len, &path);
+  connect_conn(ur, c, host, host_len);
+}
+
+/* one line of the response head, CRLF and all; false once the response
+ * has failed */
+bool take_header_line (struct uring * ur, struct uconn * c, char * line, size_t len)
+{
+  pcurl_context context = c->context;
+  int status;
+
+  if (c->state == FETCH_STATUS)
+  {
+    if (sscanf(line, "HTTP/1.%*d %d", &status) != 1)
+    {
+      finish_fetch(ur, c, CURLE_WEIRD_SERVER_REPLY);
+      return false;
+    }
+    // what CURLOPT_FAILONERROR makes of it
+    if (status >= 400)
+    {
+      finish_fetch(ur, c, CURLE_HTTP_RETURNED_ERROR);
+      return false;
+    }
+    if (!strncmp(line, "HTTP/1.0", 8))
+      c->keep_alive = false;
+    c->state = FETCH_HEADERS;
+  }
+  else if (len > 11 && !strncasecmp(line, "Connection:", 11) && strcasestr(line, "close"))
+  {
+    c->keep_alive = false;
+  }
+  else if (len > 18 && !strncasecmp(line, "Transfer-Encoding:", 18) && strcasestr(line, "chunked"))
+  {
+    finish_fetch(ur, c, CURLE_RECV_ERROR);
+    return false;
+  }
+
+  // header_cb stops duplicates at the blank line, by taking less of it
+  if (header_cb(line, 1, len, &context->hd) != len)
+  {
+    finish_fetch(ur, c, CURLE_WRITE_ERROR);
+    return false;
+  }
+  if (len == 2 && c->state == FETCH_HEADERS)
+    c->state = FETCH_BODY;
+  return true;
+}
+
+/* make what progress the bytes in c's buffer allow */
+void parse_response (struct uring * ur, struct uconn * c)
+{
+  pcurl_context context = c->context;
+  char * p = (char *) c->buf, * end = p + c->len, * eol;
+  long want;
+  size_t n;
+
+  while (c->state == FETCH_STATUS || c->state == FETCH_HEADERS)
+  {
+    eol = memmem(p, end - p, "\r\n", 2);
+    if (!eol)
+      break;
+    eol += 2;
+    if (!take_header_line(ur, c, p, eol - p))
+      return;
+    p = eol;
+  }
+
+  if (c->state == FETCH_BODY)
+  {
+    // without a Content-Length the body runs until the mirror hangs up
+    want = context->hd.content_length;
+    n = end - p;
+    if (want >= 0 && (long) n > want - c->bytes)
+    {
+      n = want - c->bytes;
+      c->keep_alive = false;
+    }
+    if (n && (context->stream_decode ? stream_write_cb(p, 1, n, &context->sd) :
+	      write_cb(p, 1, n, &context->bd)) != n)
+    {
+      finish_fetch(ur, c, CURLE_WRITE_ERROR);
+      return;
+    }
+    c->bytes += n;
+    p = end;
+    if (want >= 0 && c->bytes == want)
+    {
+      finish_fetch(ur, c, CURLE_OK);
+      return;
+    }
+  }
+
+  c->len = end - p;
+  memmove(c->buf, p, c->len);
+  if (c->len == URING_BUF_SIZE)
+  {
+    // a header line that doesn't fit
+    finish_fetch(ur, c, CURLE_WEIRD_SERVER_REPLY);
+    return;
+  }
+  read_response(ur, c);
+}
+
+/* one completion for connection c */
+void fetch_event (struct uring * ur, struct uconn * c, enum uring_op op, int res)
+{
+  switch (op)
+  {
+  case URING_CONNECT:
+    if (res < 0)
+    {
+      finish_fetch(ur, c, res == -ECANCELED ? CURLE_OPERATION_TIMEDOUT : CURLE_COULDNT_CONNECT);
+      return;
+    }
+    c->connect_us = get_time_us();
+    send_request(ur, c);
+    break;
+
+  case URING_SEND:
+    if (res < 0 && !c->fresh)
+      reconnect(ur, c);
+    else if (res < 0)
+      finish_fetch(ur, c, CURLE_SEND_ERROR);
+    else if ((c->sent += res) < c->request_len)
+      send_request(ur, c);
+    else
+    {
+      c->state = FETCH_STATUS;
+      read_response(ur, c);
+    }
+    break;
+
+  case URING_READ:
+    if (res == -ECANCELED)
+      finish_fetch(ur, c, CURLE_OPERATION_TIMEDOUT);
+    else if (res <= 0 && !c->got_bytes && !c->fresh)
+      reconnect(ur, c);
+    else if (res == 0 && c->state == FETCH_BODY && c->context->hd.content_length < 0)
+    {
+      c->keep_alive = false;
+      finish_fetch(ur, c, CURLE_OK);
+    }
+    else if (res <= 0)
+      finish_fetch(ur, c, res < 0 ? CURLE_RECV_ERROR : c->state == FETCH_BODY ? CURLE_PARTIAL_FILE : CURLE_GOT_NOTHING);
+    else
+    {
+      if (!c->got_bytes)
+	c->ttfb_us = get_time_us();
+      c->got_bytes = true;
+      c->len += res;
+      parse_response(ur, c);
+    }
+    break;
+
+  default:
+    break;
+  }
+}
+
+//
+// Submit what's queued and wait for completions, then run the transfers
+// they're for as far as they go. Finished ones wait for next_finished.
+//
+void run_uring (struct uring * ur)
+{
+  struct io_uring_cqe * cqe;
+  struct uconn * c;
+  enum uring_op op;
+  uint64_t wakeups;
+  unsigned head;
+
+  // a transfer that failed to start is finished already
+  flush_uring(ur, !ur->num_finished);
+
+  for (head = *ur->cq_head; head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE); ++head)
+  {
+    cqe = &ur->cqes[head & *ur->cq_mask];
+    op = cqe->user_data >> 56;
+    c = &ur->conns[cqe->user_data >> 32 & 0xffffff];
+
+    if (op == URING_WAKE || op == URING_LINK)
+    {
+      // the caller collects the decoded fragments and with -D reads the
+      // link after every call
+      if (op == URING_WAKE && read(ur->wakefd, &wakeups, sizeof(wakeups)) == -1 && errno != EAGAIN)
+	abort_("[%s] could not read wakefd", __FUNCTION__);
+      if (!(cqe->flags & IORING_CQE_F_MORE))
+	poll_fd(ur, op == URING_WAKE ? ur->wakefd : ur->linkfd, op);
+    }
+    else if (op != URING_TIMEOUT && (uint32_t) cqe->user_data == c->gen && c->context &&
+	     c->state != FETCH_DONE)
+    {
+      fetch_event(ur, c, op, cqe->res);
+    }
+  }
+  __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* a finished transfer, and how it went */
+pcurl_context uring_finished (struct uring * ur, CURLcode * result)
+{
+  pcurl_context context;
+
+  if (!ur->num_finished)
+    return NULL;
+  context = ur->finished[--ur->num_finished];
+  *result = context->conn->result;
+  return context;
+}
+
+/* what end_curl does for curl: the connection goes back for the next
+ * transfer if it's still good, and is closed otherwise */
+void end_fetch (struct uring * ur, pcurl_context context)
+{
+  struct uconn * c = context->conn;
+  int i;
+
+  for (i = 0; i < ur->num_finished; ++i)
+    if (ur->finished[i] == context)
+      ur->finished[i] = ur->finished[--ur->num_finished];
+  if (c->state != FETCH_DONE || c->result != CURLE_OK || !c->keep_alive)
+    close_socket(ur, c);
+  c->state = FETCH_IDLE;
+  c->context = NULL;
+  context->conn = NULL;
+}
+
+/* what mirror_succeeded gets out of curl's timers */
+void fetch_succeeded (struct uconn * c, bool got_body)
+{
+  struct timings * t = &mirror_timings[c->mirror];
+  long ttfb_from = c->connect_us ? c->connect_us : c->start_us;
+
+  if (c->fresh)
+  {
+    record_time(t, PHASE_DNS, c->dns_us);
+    record_time(t, PHASE_CONNECT, c->connect_us - c->start_us - c->dns_us);
+  }
+  record_time(t, PHASE_TTFB, c->ttfb_us - ttfb_from);
+  record_time(t, PHASE_TRANSFER, c->end_us - c->ttfb_us);
+  record_mirror_sample(c->mirror, c->ttfb_us - c->start_us, c->end_us - c->start_us, c->bytes, got_body);
+}
+
+void cleanup_uring (struct uring * ur)
+{
+  int i;
+
+  printf("io_uring: %lu operations in %lu io_uring_enter calls%s\n", ur->ops, ur->enters,
+	 ur->fixed ? "" : " (staging buffers not registered)");
+  for (i = 0; i < ur->num_conns; ++i)
+    if (ur->conns[i].fd >= 0)
+      close(ur->conns[i].fd);
+  close(ur->fd);
+  munmap(ur->sqes, ur->sq_entries * sizeof(struct io_uring_sqe));
+  if (ur->cq_ring != ur->sq_ring)
+    munmap(ur->cq_ring, ur->cq_ring_size);
+  munmap(ur->sq_ring, ur->sq_ring_size);
+  munmap(ur->bufs, (size_t) ur->num_conns * URING_BUF_SIZE);
+  free(ur->conns);
+  free(ur->finished);
+}
+
+/* the next finished transfer, from curl or with -U the ring, and how it
+ * went */
+pcurl_context next_finished (CURLM * curlm, struct uring * ur, CURLcode * result)
+{
+  CURLMsg * msg;
+  int msgs_in_queue;
+
+  if (ur)
+    return uring_finished(ur, result);
+  if (!(msg = curl_multi_info_read(curlm, &msgs_in_queue)))
+    return NULL;
+
+  // Check to make sure the CURL-ing is done
+  if (msg->msg != CURLMSG_DONE)
+  {
+    fprintf(stderr, "E: CURLMsg (%d)\n", msg->msg);
+    abort_("[%s] curl msg not done\n", __FUNCTION__);
+  }
+  *result = msg->data.result;
+  return get_curl_context(msg->easy_handle);
+}
+
+/* mirror_succeeded, whichever engine did the transfer */
+void transfer_succeeded (pcurl_context context, bool got_body)
+{
+  if (context->conn)
+    fetch_succeeded(context->conn, got_body);
+  else
+    mirror_succeeded(context->mirror, context->curl, got_body);
+}
+
+void init_curl (CURLM * curlm, pcurl_context context, struct image * image)
+{
+  // this transfer paints into image, whichever it was painting before
+  context->image = image;
+  context->hd.received_fragments = &image->received_fragments;
+  context->sd.dest = image->output_buffer;
+  image->in_flight++;
+
+  // request appropriate URL
+  context->mirror = get_url(&context->url, image->img, context->hedge);
+  DEBUG_PRINT(("[%s] Curl #%d requesting URL %s\n", __FUNCTION__, context->curl_id, context->url));
+
+  context->bd.len = 0;
+  context->bd.pos = 0;
+  context->bd.starved = false;
+  context->hd.n = -1;
+  context->hd.duplicate = false;
+  context->hd.content_length = -1;
+  context->hd.received = 0;
+  if (context->stream_decode)
+    start_stream(&context->sd);
+  context->running = true;
+  if (context->ur)
+  {
+    start_fetch(context->ur, context);
+    return;
+  }
+
+  // the handle from the last transfer keeps its buffers, and curl its
+  // connection; only the options start over
+  curl_easy_reset(context->curl);
+  curl_easy_setopt(context->curl, CURLOPT_PRIVATE, context);
+  curl_easy_setopt(context->curl, CURLOPT_URL, context->url);
+  if (context->stream_decode)
+  {
+    curl_easy_setopt(context->curl, CURLOPT_WRITEFUNCTION, stream_write_cb);
+    curl_easy_setopt(context->curl, CURLOPT_WRITEDATA, &context->sd);
+  }
+  else
+  {
+    curl_easy_setopt(context->curl, CURLOPT_WRITEFUNCTION, write_cb);
+    curl_easy_setopt(context->curl, CURLOPT_WRITEDATA, &context->bd);
+  }
+
+  curl_easy_setopt(context->curl, CURLOPT_HEADERDATA, &context->hd);
+  curl_easy_setopt(context->curl, CURLOPT_HEADERFUNCTION, header_cb);
+  set_connection_options(context->curl);
+  // an overloaded mirror answering 5xx counts as a failure, not a fragment
+  curl_easy_setopt(context->curl, CURLOPT_FAILONERROR, 1L);
+
+  curl_multi_add_handle(curlm, context->curl);
+}
+
+/* take context's transfer out of curlm (or the ring), finished or not */
+void end_curl (CURLM * curlm, pcurl_context context)
+{
+  if (context->ur)
+    end_fetch(context->ur, context);
+  else
+    curl_multi_remove_handle(curlm, context->curl);
+  context->running = false;
+  context->image->in_flight--;
+}
+
+void init_curl_for_multi_curl (pcurl_context context, int curl_id, bool discard_duplicates,
+			       bool stream_decode, struct bufpool * pool, struct uring * ur)
+{
+  context->curl_id = curl_id;
+  context->ur = ur;
+  context->conn = NULL;
+  context->curl = ur ? NULL : curl_easy_init();
+  if (!ur && !context->curl)
+  {
+    abort_("[%s] could not init curl", __FUNCTION__);
+  }
+  context->running = false;
+  context->image = NULL;
+  context->stream_decode = stream_decode;
+
+  // Streamed transfers decode as the body arrives and need no buffer;
+  // the others take one from the pool once the body starts
+  context->sd.hd = &context->hd;
+  if (stream_decode)
+    init_stream(&context->sd);
+  context->bd.buf = NULL;
+  context->bd.max_size = 0;
+  context->bd.pool = pool;
+  context->bd.hd = &context->hd;
+
+  context->url = (char *) malloc(sizeof(char)*strlen(BASE_URL_1)+4*5);
+  if (!context->url)
+  {
+    abort_("[%s] could not malloc url", __FUNCTION__);
+  }
+
+  context->hd.discard_duplicates = discard_duplicates;
+}
+
+/***********************************************************************************/
+/* the table of transfers                                                          */
+
+/* Contexts come in slabs of SLAB_CONTEXTS that never move, so pointers to
+ * them (curl's CURLOPT_PRIVATE among them) stay good as the table grows.
+ * Idle contexts wait on a free list. set_transfer_limit() changes how
+ * many transfers may be in flight at once, at any time: raising it adds
+ * slabs as needed, and after lowering it finished transfers simply aren't
+ * replaced until the running ones are back under the limit. A slab past
+ * the one spare the limit leaves (so that the hedges coming and going
+ * don't churn curl handles) is freed once every context in it is idle;
+ * only the last slab goes, and the others are tried again next time. */
+
+#define SLAB_CONTEXTS 16
+
+struct context_table {
+  pcurl_context * slabs;
+  int num_slabs;
+  pcurl_context free_list;
+  int running;
+  int limit;
+  // for setting up new contexts
+  bool discard_duplicates;
+  bool stream_decode;
+  struct bufpool * pool;
+  struct uring * ur;
+};
+
+void cleanup_context (struct context_table * t, pcurl_context context)
+{
+  curl_easy_cleanup(context->curl);
+  release_buffer(t->pool, &context->bd);
+  if (context->stream_decode)
+    cleanup_stream(&context->sd);
+  free(context->url);
+}
+
+/* free the last slab if all of it is on the free list; false if not */
+bool free_last_slab (struct context_table * t)
+{
+  pcurl_context slab = t->slabs[t->num_slabs - 1];
+  pcurl_context * link;
+  int idle = 0;
+  int i;
+
+  for (link = &t->free_list; *link; link = &(*link)->next_free)
+    if (*link >= slab && *link < slab + SLAB_CONTEXTS)
+      idle++;
+  if (idle < SLAB_CONTEXTS)
+    return false;
+
+  for (link = &t->free_list; *link; )
+  {
+    if (*link >= slab && *link < slab + SLAB_CONTEXTS)
+      *link = (*link)->next_free;
+    else
+      link = &(*link)->next_free;
+  }
+  for (i = 0; i < SLAB_CONTEXTS; ++i)
+    cleanup_context(t, &slab[i]);
+  free(slab);
+  t->num_slabs--;
+  return true;
+}
+
+void set_transfer_limit (struct context_table * t, int limit)
+{
+  pcurl_context slab;
+  int i;
+
+  while (t->num_slabs * SLAB_CONTEXTS < limit)
+  {
+    t->slabs = realloc(t->slabs, (t->num_slabs + 1) * sizeof(pcurl_context));
+    slab = calloc(SLAB_CONTEXTS, sizeof(curl_context));
+    if (!t->slabs || !slab)
+      abort_("[%s] contexts malloc failed", __FUNCTION__);
+    for (i = SLAB_CONTEXTS - 1; i >= 0; --i)
+    {
+      init_curl_for_multi_curl(&slab[i], t->num_slabs * SLAB_CONTEXTS + i, t->discard_duplicates,
+			       t->stream_decode, t->pool, t->ur);
+      slab[i].next_free = t->free_list;
+      t->free_list = &slab[i];
+    }
+    t->slabs[t->num_slabs++] = slab;
+  }
+  while ((t->num_slabs - 2) * SLAB_CONTEXTS >= limit && free_last_slab(t))
+    ;
+  t->limit = limit;
+}
+
+void init_context_table (struct context_table * t, int limit, bool discard_duplicates,
+			 bool stream_decode, struct bufpool * pool, struct uring * ur)
+{
+  t->slabs = NULL;
+  t->num_slabs = 0;
+  t->free_list = NULL;
+  t->running = 0;
+  t->discard_duplicates = discard_duplicates;
+  t->stream_decode = stream_decode;
+  t->pool = pool;
+  t->ur = ur;
+  set_transfer_limit(t, limit);
+}
+
+/* an idle context, if another transfer fits under the limit */
+pcurl_context get_free_context (struct context_table * t)
+{
+  pcurl_context context = t->free_list;
+
+  if (t->running >= t->limit || !context)
+    return NULL;
+  t->free_list = context->next_free;
+  t->running++;
+  return context;
+}
+
+void put_free_context (struct context_table * t, pcurl_context context)
+{
+  context->next_free = t->free_list;
+  t->free_list = context;
+  t->running--;
+}
+
+/* context i of the table, running or not */
+pcurl_context get_context (struct context_table * t, int i)
+{
+  return &t->slabs[i / SLAB_CONTEXTS][i % SLAB_CONTEXTS];
+}
+
+void cleanup_context_table (struct context_table * t)
+{
+  pcurl_context context;
+  int i;
+
+  for (i = 0; i < t->num_slabs * SLAB_CONTEXTS; ++i)
+  {
+    // Clear all pointers created for each context
+    context = get_context(t, i);
+    cleanup_context(t, context);
+  }
+  for (i = 0; i < t->num_slabs; ++i)
+    free(t->slabs[i]);
+  free(t->slabs);
+}
+
+/***********************************************************************************/
+/* decoding off the event loop                                                     */
+
+/* Decoding a fragment takes milliseconds, and while the event loop does it
+ * every other transfer waits for its socket to be read. With -w, decoder
+ * threads take that over: the loop hands a finished transfer to one and
+ * goes straight back to curl, and the decoder hands the transfer back
+ * once its fragment is painted (and with -o encoded), for the loop to do
+ * the bookkeeping. Each decoder has two single-producer single-consumer
+ * rings, one from the loop and one back, so neither side takes a lock.
+ *
+ * A decoder holds PIPELINE_DEPTH transfers at most. When all of them are
+ * full, finished transfers queue up in a backlog and the loop starts no
+ * new ones until the decoders catch up; a transfer keeps its slot in the
+ * table until it is back, too. */
+
+#define PIPELINE_DEPTH 4
+
+struct ring {
+  pcurl_context slots[PIPELINE_DEPTH];
+  unsigned head;                // only the consumer moves it
+  unsigned tail;                // only the producer moves it
+};
+
+struct pipeline;
+
+struct decoder {
+  pthread_t thread;
+  struct ring todo, done;
+  int queued;                   // in either ring or being decoded; the loop's count
+  int wakefd;                   // the loop writes it after filling todo
+  struct pipeline * pipeline;
+};
+
+struct pipeline {
+  struct decoder * decoders;
+  int num_decoders;
+  bool stripes;                 // -o: the decoders encode the stripes too
+  bool stopping;
+  int wakefd;                   // the decoders write it after filling done
+  pcurl_context backlog, backlog_tail;
+};
+
+/* false if the ring is full */
+bool ring_push (struct ring * r, pcurl_context context)
+{
+  if (r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == PIPELINE_DEPTH)
+    return false;
+  r->slots[r->tail % PIPELINE_DEPTH] = context;
+  __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+/* NULL if the ring is empty */
+pcurl_context ring_pop (struct ring * r)
+{
+  pcurl_context context;
+
+  if (r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  context = r->slots[r->head % PIPELINE_DEPTH];
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+  return context;
+}
+
+//
+// Decode a downloaded fragment into its stripe of the image, and with -o
+// encode the stripe as well; false if the PNG is corrupt. Runs on the
+// event loop, or with -w on a decoder; either has an arena of its own.
+//
+bool paint_fragment (pcurl_context context, bool stripes, png_bytep * row_pointers,
+		     struct arena * arena)
+{
+  struct image * im = context->image;
+  int n = context->hd.n;
+  png_structp png_ptr;
+  png_infop info_ptr;
+  long start_us, decode_us, end_us;
+  bool ok;
+
+  png_ptr = create_read_struct(arena);
+  if (!png_ptr)
+    abort_("[%s] png_create_read_struct failed", __FUNCTION__);
+
+  // read PNG (as downloaded from network) and copy it to output buffer.
+  // libpng decodes straight into the output buffer, so all there is to
+  // painting is pointing the rows at it
+  start_us = get_time_us();
+  point_rows_at_destination(row_pointers, n, im->output_buffer);
+  decode_us = get_time_us();
+  ok = read_png_file(png_ptr, &info_ptr, &context->bd, row_pointers);
+  end_us = get_time_us();
+  context->paint_us = decode_us - start_us;
+  context->decode_us = end_us - decode_us;
+
+  // free allocated memory
+  png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+
+  context->encode_us = 0;
+  if (stripes && ok)
+  {
+    write_stripe(&im->stripes, n, im->output_buffer);
+    context->encode_us = get_time_us() - end_us;
+  }
+  return ok;
+}
+
+void *decoder_function (void * arg)
+{
+  struct decoder * d = arg;
+  pcurl_context context;
+  uint64_t wakeups;
+  struct arena arena;
+
+  png_bytep * row_pointers = malloc(sizeof(png_bytep)*BUF_HEIGHT);
+  if (!row_pointers)
+    abort_("[%s] row_pointers malloc failed", __FUNCTION__);
+  init_arena(&arena);
+
+  for (;;)
+  {
+    while ((context = ring_pop(&d->todo)))
+    {
+      context->corrupt = !paint_fragment(context, d->pipeline->stripes, row_pointers, &arena);
+      // never full: the loop gives us no more than fit in it
+      ring_push(&d->done, context);
+      signal_eventfd(d->pipeline->wakefd);
+    }
+    if (__atomic_load_n(&d->pipeline->stopping, __ATOMIC_ACQUIRE))
+      break;
+    // sleep until the loop fills todo (or stops us)
+    if (read(d->wakefd, &wakeups, sizeof(wakeups)) == -1 && errno != EINTR)
+      abort_("[%s] could not read eventfd", __FUNCTION__);
+  }
+
+  free(row_pointers);
+  cleanup_arena(&arena);
+  return NULL;
+}
+
+void init_pipeline (struct pipeline * p, int num_decoders, bool stripes)
+{
+  struct decoder * d;
+  int i;
+
+  memset(p, 0, sizeof(*p));
+  p->num_decoders = num_decoders;
+  p->stripes = stripes;
+  p->wakefd = eventfd(0, EFD_NONBLOCK);
+  p->decoders = calloc(num_decoders ? num_decoders : 1, sizeof(struct decoder));
+  if (p->wakefd == -1 || !p->decoders)
+    abort_("[%s] could not set up the decoders", __FUNCTION__);
+
+  for (i = 0; i < num_decoders; ++i)
+  {
+    d = &p->decoders[i];
+    d->pipeline = p;
+    d->wakefd = eventfd(0, 0);
+    if (d->wakefd == -1)
+      abort_("[%s] eventfd failed", __FUNCTION__);
+    if (pthread_create(&d->thread, NULL, decoder_function, d))
+      abort_("[%s] failed to create decoder thread %d", __FUNCTION__, i);
+  }
+}
+
+void push_decode (struct decoder * d, pcurl_context context)
+{
+  d->queued++;
+  ring_push(&d->todo, context);
+  signal_eventfd(d->wakefd);
+}
+
+/* hand a finished transfer to the decoder with the least to do, or to the
+ * backlog if they're all full */
+void submit_decode (struct pipeline * p, pcurl_context context)
+{
+  struct decoder * d = NULL;
+  int i;
+
+  for (i = 0; i < p->num_decoders; ++i)
+    if (p->decoders[i].queued < PIPELINE_DEPTH && (!d || p->decoders[i].queued < d->queued))
+      d = &p->decoders[i];
+
+  if (d)
+  {
+    push_decode(d, context);
+    return;
+  }
+  context->next_decode = NULL;
+  if (p->backlog)
+    p->backlog_tail->next_decode = context;
+  else
+    p->backlog = context;
+  p->backlog_tail = context;
+}
+
+/* whether the loop should hold off on new transfers */
+bool pipeline_full (struct pipeline * p)
+{
+  return p->backlog != NULL;
+}
+
+/* a transfer whose fragment a decoder is done with, if there is one; its
+ * place goes to the backlog */
+pcurl_context collect_decoded (struct pipeline * p)
+{
+  struct decoder * d;
+  pcurl_context context, next;
+  int i;
+
+  for (i = 0; i < p->num_decoders; ++i)
+  {
+    d = &p->decoders[i];
+    context = ring_pop(&d->done);
+    if (!context)
+      continue;
+    d->queued--;
+    if ((next = p->backlog))
+    {
+      p->backlog = next->next_decode;
+      push_decode(d, next);
+    }
+    return context;
+  }
+  return NULL;
+}
+
+/* every transfer must have been collected */
+void cleanup_pipeline (struct pipeline * p)
+{
+  int i;
+
+  __atomic_store_n(&p->stopping, true, __ATOMIC_RELEASE);
+  for (i = 0; i < p->num_decoders; ++i)
+    signal_eventfd(p->decoders[i].wakefd);
+  for (i = 0; i < p->num_decoders; ++i)
+  {
+    pthread_join(p->decoders[i].thread, NULL);
+    close(p->decoders[i].wakefd);
+  }
+  close(p->wakefd);
+  free(p->decoders);
+}
+
+/***********************************************************************************/
+/* routines used by curl to drive transfers from an epoll event loop               */
+
+typedef struct _event_loop
+{
+  CURLM * curlm;
+  int epfd;
+  int wakefd;
+  int linkfd;
+  bool timer_armed;
+  struct timespec deadline;
+} event_loop, * pevent_loop;
+
+//
+// curl calls this to tell us which events it wants on a socket. Sockets
+// already registered with epoll are tagged (via curl_multi_assign) so that
+// we know whether to add or modify them.
+//
+int socket_cb (CURL * curl, curl_socket_t s, int what, void * userdata, void * socketp)
+{
+  pevent_loop loop = userdata;
+  struct epoll_event ev;
+
+  if (what == CURL_POLL_REMOVE)
+  {
+    // The socket may already be closed, which removes it from epoll for us
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, s, NULL);
+    curl_multi_assign(loop->curlm, s, NULL);
+    return 0;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.data.fd = s;
+  if (what & CURL_POLL_IN)
+    ev.events |= EPOLLIN;
+  if (what & CURL_POLL_OUT)
+    ev.events |= EPOLLOUT;
+
+  if (socketp)
+  {
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, s, &ev) == -1)
+      abort_("[%s] epoll_ctl MOD failed on fd %d", __FUNCTION__, s);
+  }
+  else
+  {
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, s, &ev) == -1)
+      abort_("[%s] epoll_ctl ADD failed on fd %d", __FUNCTION__, s);
+    curl_multi_assign(loop->curlm, s, loop);
+  }
+
+  return 0;
+}
+
+//
+// curl calls this to tell us how long we may block before it needs
+// curl_multi_socket_action(CURL_SOCKET_TIMEOUT). -1 means no timer.
+// The timer is one-shot: curl only calls us again when it wants a new one.
+//
+int timer_cb (CURLM * curlm, long timeout_ms, void * userdata)
+{
+  pevent_loop loop = userdata;
+
+  if (timeout_ms < 0)
+  {
+    loop->timer_armed = false;
+    return 0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &loop->deadline);
+  loop->deadline.tv_sec += timeout_ms / 1000;
+  loop->deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (loop->deadline.tv_nsec >= 1000000000L)
+  {
+    loop->deadline.tv_sec += 1;
+    loop->deadline.tv_nsec -= 1000000000L;
+  }
+  loop->timer_armed = true;
+  return 0;
+}
+
+//
+// Milliseconds until curl's timer expires, rounded up so that we never
+// wake early. -1 (block forever) if no timer is armed.
+//
+int get_wait_ms (pevent_loop loop)
+{
+  struct timespec now;
+  long wait_ms;
+
+  if (!loop->timer_armed)
+    return -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  wait_ms = (loop->deadline.tv_sec - now.tv_sec) * 1000
+    + (loop->deadline.tv_nsec - now.tv_nsec + 999999L) / 1000000L;
+
+  return wait_ms < 0 ? 0 : (int) wait_ms;
+}
+
+//
+// wakefd is an eventfd that the decoders write to when they finish a
+// fragment, and linkfd (unless it's -1) the connection to the assembler
+//
+void init_event_loop (pevent_loop loop, CURLM * curlm, int wakefd, int linkfd)
+{
+  struct epoll_event ev;
 
-	if (msg->data.result != CURLE_OK)
-	{
-	  abort_("[%s] msg data result is not CURLE_OK\n", __FUNCTION__);
-	}
+  loop->curlm = curlm;
+  loop->wakefd = wakefd;
+  loop->linkfd = linkfd;
+  loop->timer_armed = false;
+
+  loop->epfd = epoll_create1(0);
+  if (loop->epfd == -1)
+  {
+    abort_("[%s] epoll_create1 failed", __FUNCTION__);
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = wakefd;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, wakefd, &ev) == -1)
+  {
+    abort_("[%s] epoll_ctl ADD failed on wakefd", __FUNCTION__);
+  }
+  ev.data.fd = linkfd;
+  if (linkfd != -1 && epoll_ctl(loop->epfd, EPOLL_CTL_ADD, linkfd, &ev) == -1)
+  {
+    abort_("[%s] epoll_ctl ADD failed on linkfd", __FUNCTION__);
+  }
+
+  curl_multi_setopt(curlm, CURLMOPT_SOCKETFUNCTION, socket_cb);
+  curl_multi_setopt(curlm, CURLMOPT_SOCKETDATA, loop);
+  curl_multi_setopt(curlm, CURLMOPT_TIMERFUNCTION, timer_cb);
+  curl_multi_setopt(curlm, CURLMOPT_TIMERDATA, loop);
+}
+
+//
+// Block until a socket is ready, curl's timer expires, a decoder wakes us
+// or the assembler says something, then let curl make progress on
+// whatever is ready.
+//
+void run_event_loop (pevent_loop loop)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int running_curls;
+  uint64_t wakeups;
+  int nfds;
+  int i;
+  CURLMcode mc;
+
+  nfds = epoll_wait(loop->epfd, events, MAX_EVENTS, get_wait_ms(loop));
+  if (nfds == -1)
+  {
+    if (errno == EINTR)
+      return;
+    abort_("[%s] epoll_wait failed", __FUNCTION__);
+  }
+
+  if (nfds == 0)
+  {
+    loop->timer_armed = false;
+    mc = curl_multi_socket_action(loop->curlm, CURL_SOCKET_TIMEOUT, 0, &running_curls);
+    if (mc != CURLM_OK)
+    {
+      abort_("[%s:%d] curl_multi_socket_action failed\n", __FUNCTION__, __LINE__);
+    }
+    return;
+  }
+
+  for (i = 0; i < nfds; ++i)
+  {
+    int flags = 0;
+
+    if (events[i].data.fd == loop->wakefd)
+    {
+      // the caller collects the decoded fragments after every call
+      if (read(loop->wakefd, &wakeups, sizeof(wakeups)) == -1 && errno != EAGAIN)
+	abort_("[%s] could not read wakefd", __FUNCTION__);
+      continue;
+    }
+    if (events[i].data.fd == loop->linkfd)
+    {
+      // the caller hears it out with read_link
+      continue;
+    }
+
+    if (events[i].events & EPOLLIN)
+      flags |= CURL_CSELECT_IN;
+    if (events[i].events & EPOLLOUT)
+      flags |= CURL_CSELECT_OUT;
+    if (events[i].events & (EPOLLERR | EPOLLHUP))
+      flags |= CURL_CSELECT_ERR;
+
+    mc = curl_multi_socket_action(loop->curlm, events[i].data.fd, flags, &running_curls);
+    if (mc != CURLM_OK)
+    {
+      abort_("[%s:%d] curl_multi_socket_action failed\n", __FUNCTION__, __LINE__);
+    }
+  }
+}
+
+void cleanup_event_loop (pevent_loop loop)
+{
+  close(loop->epfd);
+}
+
+/***********************************************************************************/
+/* the engine behind libpaster                                                     */
+
+/* paster_create runs what used to be main's loop on a thread of its own,
+ * with the options main used to parse (see libpaster.h). The loop never
+ * waits for images to be submitted: the queued ones go into the -a image
+ * slots as they come free, and paster_submit wakes the loop through the
+ * pipeline's eventfd, as a decoder does. It only leaves once
+ * paster_destroy has said nothing else is coming and every slot is
+ * empty, so in between the connections, the buffer pool, the arenas and
+ * what the mirrors have taught us carry over from one image to the
+ * next. */
+
+struct paster {
+  struct paster_options opts;
+  struct job_queue queue;
+  pthread_t thread;
+  int wakefd;           // pipeline.wakefd, once the engine has set it up
+};
+
+// the geometry and the mirrors are the process's
+static bool engine_running;
+
+/* call off the transfers still running for im, whose results nobody
+ * wants any more */
+void cancel_transfers (struct context_table * t, CURLM * curlm, struct bufpool * pool,
+		       struct accounts * a, struct image * im)
+{
+  pcurl_context context;
+  int i;
+
+  for (i = 0; i < t->num_slabs * SLAB_CONTEXTS; ++i)
+  {
+    context = get_context(t, i);
+    if (!context->running || context->image != im)
+      continue;
+    record_response(a, context->mirror, &context->hd);
+    end_curl(curlm, context);
+    if (context->stream_decode)
+      end_stream(&context->sd);
+    release_buffer(pool, &context->bd);
+    put_free_context(t, context);
+  }
+}
+
+/* hand a closed (or abandoned) image to its job, which frees the slot
+ * for another */
+void complete_job (struct image * im, enum paster_status status)
+{
+  struct paster_job * job = im->job;
+  struct paster_result result;
+
+  result.img = job->img;
+  result.status = status;
+  result.file_name = job->file_name;
+  result.pixels = im->pixels;
+  result.width = WIDTH;
+  result.height = HEIGHT;
+  if (job->on_complete)
+    job->on_complete(&result, job->arg);
+  else
+    free(im->pixels);
+
+  im->job = NULL;
+  im->pixels = NULL;
+  free(job->file_name);
+  free(job);
+}
+
+void *engine_function (void * arg)
+{
+  struct paster * p = arg;
+  struct paster_options * o = &p->opts;
+  int num_threads = o->threads;
+  // by default the tail runs at twice the concurrency
+  int num_hedges = o->hedges < 0 ? o->threads : o->hedges;
+  int autotune_max = o->autotune_max;
+  struct autotune at;
+  int limit;
+  int tail_at = o->tail_at;
+  bool tail = false;
+  int missing;
+  int max_active = o->max_active;
+  int active = 0;
+  bool pending, stopping;
+  bool gave_up;
+  const char * broken = NULL;   // why the engine is giving up, once it is
+  int num_failed = 0;
+  struct paster_job * job;
+  struct image * images;
+  struct image * im;
+  bool discard_duplicates = o->discard_duplicates;
+  bool stream_decode = o->stream_decode;
+  int num_decoders = o->decoders;
+  struct pipeline pipeline;
+  const char * assembler = o->assembler;
+  struct link link;
+  bool use_uring = o->uring;
+  struct uring ur;
+  struct dupstats ds = { 0 };
+  struct accounts accounts;
+  struct bufpool pool;
+  struct arena arena;
+  struct timings timings = { { { { 0 } } } };
+  struct timings main_timings = { { { { 0 } } } };
+  int level = o->level;
+  int filter = o->filter ? parse_filter(o->filter) : FILTER_ALL;
+  bool stripes = o->output == PASTER_STRIPES;
+  bool raw = o->output == PASTER_RAW;
+  const char * cache_dir = o->cache_dir;
+  long start_us;
+  bool discarded, starved, failed, corrupt, decoded;
+  enum outcome outcome = OUTCOME_NONE;
+  bool parked = false;          // waiting for the pool to take a buffer back
+  unsigned parked_at = 0;
+  struct context_table table;
+  pcurl_context context;
+  int i;
+  CURLM * curlm;
+  event_loop loop;
+  CURLcode result;
+  pcurl_context curr_context;
+
+  // a slot for each image that can be open at once
+  images = calloc(max_active, sizeof(struct image));
+  if (!images)
+  {
+    abort_("[%s] images malloc failed", __FUNCTION__);
+  }
+  init_accounts(&accounts, o->max_requests, (long) o->max_mb << 20,
+		o->image_max_requests, (long) o->image_max_mb << 20, o->ticker);
+
+  curl_global_init(CURL_GLOBAL_ALL);
+  // every transfer runs under a multi handle
+  multiplexing = true;
+
+  curlm = curl_multi_init();
+  if (!curlm)
+  {
+    abort_("[%s] curlm init failed\n", __FUNCTION__);
+  }
 
-	curl_multi_remove_handle(curlm, curr_context->curl);
-	curl_easy_cleanup(curr_context->curl);
-	curr_context->curl = NULL;
+  // -A overrides -t, which still sets the number of hedges
+  if (autotune_max)
+    init_autotune(&at, autotune_max);
+  set_multi_options(curlm, (autotune_max ? autotune_max : num_threads) + num_hedges);
+
+  // Must be set up before any handles are added so that curl hands us
+  // their sockets and timers
+  init_pipeline(&pipeline, num_decoders, stripes);
+  if (assembler)
+    open_link(&link, assembler);
+  if (use_uring)
+    init_uring(&ur, (autotune_max ? autotune_max : num_threads) + num_hedges, pipeline.wakefd,
+	       assembler ? link.fd : -1);
+  else
+    init_event_loop(&loop, curlm, pipeline.wakefd, assembler ? link.fd : -1);
+
+  png_bytep * row_pointers = malloc(sizeof(png_bytep)*BUF_HEIGHT);
+
+  init_bufpool(&pool, o->buffer_cap_mb << 20, false);
+  init_arena(&arena);
+
+  // The hedges stay idle until only tail_at fragments are missing
+  limit = autotune_max ? at.limit : num_threads;
+  init_context_table(&table, limit, discard_duplicates, stream_decode, &pool, use_uring ? &ur : NULL);
+
+  // paster_submit can wake the loop from now on
+  pthread_mutex_lock(&p->queue.lock);
+  p->wakefd = pipeline.wakefd;
+  pthread_cond_broadcast(&p->queue.ready);
+  pthread_mutex_unlock(&p->queue.lock);
+
+  for (;;) {
+    // it only leaves once every image is written
+    if (assembler && link.closed && !broken)
+      broken = "lost the assembler";
+
+    // give the queued images the free slots; one the cache (or the
+    // assembler) has all of is finished straight away
+    while (!broken && active < max_active && (job = take_job(&p->queue)))
+    {
+      for (im = images; im->open; ++im)
+	;
+      im->job = job;
+      im->img = job->img;
+      im->file_name = job->file_name;
+      im->remote = assembler != NULL;
+      im->assembled = job->assembled;
+      open_image(im, cache_dir, stripes, raw, level, filter);
+      if (im->missing)
+      {
+	active++;
+	tail = false;
       }
       else
       {
-	fprintf(stderr, "E: CURLMsg (%d)\n", msg->msg);
-	abort_("[%s] curl msg not done\n", __FUNCTION__);
+	close_image(im, cache_dir, stripes, raw, level, filter, &main_timings);
+	complete_job(im, PASTER_DONE);
       }
+    }
+    if (broken && !active)
+    {
+      // and whatever the host submits from here on is turned away
+      num_failed += fail_jobs(&p->queue);
+      if (num_failed)
+	fprintf(stderr, "giving up on %d images: %s\n", num_failed, broken);
+      break;
+    }
+    pending = jobs_pending(&p->queue, &stopping);
+    if (!active && !pending && stopping)
+      break;
 
-      png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-      if (!png_ptr)
-	abort_("[main] png_create_read_struct failed");
-
-      // read PNG (as downloaded from network) and copy it to output buffer
-      png_bytep* row_pointers = read_png_file(png_ptr, &info_ptr, &curr_context->bd);
-      paint_destination(png_ptr, row_pointers, curr_context->hd.n*BUF_WIDTH, 0, output_buffer);
-
-      // free allocated memory
-      for (int y=0; y<BUF_HEIGHT; y++)
-	free(row_pointers[y]);
-      free(row_pointers);
-      png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    // Fragments come back at random, so the last few missing ones take
+    // about as long as all the others together; that's when the hedges
+    // join in, with requests spread over every mirror. While another
+    // image is waiting for a slot, it keeps the connections busy instead
+    missing = 0;
+    for (i = 0; i < max_active; ++i)
+      if (images[i].open)
+	missing += images[i].missing;
+    if (!tail && active && !pending && missing <= tail_at)
+    {
+      tail = true;
+      if (verbose)
+	printf("%d fragments missing, hedging\n", missing);
+    }
+    limit = autotune_max ? at.limit : num_threads;
+    set_transfer_limit(&table, tail && !budget_tight(&accounts, missing) ? limit + num_hedges : limit);
+
+    // Start transfers while there's room for them; adding one arms curl's
+    // timer so the next run_event_loop starts it. Retrying a starved
+    // transfer before a buffer comes back would only fail again, and
+    // neither is there any point while the decoders are behind, nor once
+    // the budget is spent
+    if (parked && parked_at != get_releases(&pool))
+      parked = false;
+    while (!broken && !parked && !pipeline_full(&pipeline) && (im = pick_image(images, max_active, &accounts)) &&
+	   within_budget(&accounts) && (context = get_free_context(&table)))
+    {
+      context->hedge = table.running > limit;
+      init_curl(curlm, context, im);
+      record_request(&accounts);
+      im->requests++;
+    }
 
-      // check for unreceived fragments
-      received_all_fragments = true;
-      for (int i = 0; i < N; i++)
-	if (!received_fragments[i])
-	  received_all_fragments = false;
+    // An image that may have no more transfers is as finished as it will
+    // get once the last of its own is in; with -D the other workers may
+    // yet finish it. Giving up frees its slot, so go round again rather
+    // than sleep on an event that may never come
+    gave_up = false;
+    for (im = images; im < images + max_active && !assembler; ++im)
+    {
+      if (!im->open || image_busy(im) || (!accounts.spent && image_within_budget(&accounts, im)))
+	continue;
+      fprintf(stderr, "image %d: over budget after %ld requests and %ld bytes, %d fragments missing\n",
+	      im->img, im->requests, im->bytes, im->missing);
+      abandon_image(im, cache_dir, stripes, raw);
+      complete_job(im, PASTER_OVER_BUDGET);
+      accounts.over_budget++;
+      active--;
+      gave_up = true;
+    }
 
-      if (!received_all_fragments)
+    // Once the mirrors or the assembler have given out, nothing more will
+    // come for any image: call off its transfers, forget what went to the
+    // assembler and fail it as soon as its decoders are done with it
+    for (im = images; im < images + max_active && broken; ++im)
+    {
+      if (!im->open)
+	continue;
+      cancel_transfers(&table, curlm, &pool, &accounts, im);
+      if (assembler)
+	memset(im->decoding_fragments, 0, N * sizeof(bool));
+      if (image_busy(im))
+	continue;
+      abandon_image(im, cache_dir, stripes, raw);
+      complete_job(im, PASTER_FAILED);
+      num_failed++;
+      active--;
+      gave_up = true;
+    }
+    if (gave_up)
+      continue;
+
+    // Sleep until a socket is ready, a timer expires or a decoder is
+    // done, then run any curls that can make progress
+    if (use_uring)
+      run_uring(&ur);
+    else
+      run_event_loop(&loop);
+
+    // Finished transfers come from curl (or the ring), and with -w back
+    // from the decoders once they have painted them
+    for (;;)
+    {
+      decoded = false;
+      if ((curr_context = next_finished(curlm, use_uring ? &ur : NULL, &result)))
       {
-	// init a new curl
-	init_curl(curlm, curr_context);
+	DEBUG_PRINT(("[%s] R: %d - %s <%s>\n", __FUNCTION__,
+		     result, curl_easy_strerror(result), curr_context->url));
+	record_response(&accounts, curr_context->mirror, &curr_context->hd);
+	curr_context->image->bytes += curr_context->hd.received;
+
+	// header_cb stops duplicates short and write_cb stops transfers the
+	// pool has no room for; anything else is the mirror's fault
+	discarded = result == CURLE_WRITE_ERROR && curr_context->hd.duplicate;
+	starved = result == CURLE_WRITE_ERROR && curr_context->bd.starved;
+	failed = result != CURLE_OK && !discarded && !starved;
+	if (discarded)
+	{
+	  record_discard(&ds, &curr_context->hd);
+	  transfer_succeeded(curr_context, false);
+	  if (curr_context->stream_decode)
+	    end_stream(&curr_context->sd);
+	}
+	else if (starved)
+	{
+	  // Someone else has to paint this fragment, maybe us on a later
+	  // try. Retrying before a buffer comes back would only fail again.
+	  unclaim_fragment(&curr_context->hd);
+	  parked = true;
+	  parked_at = get_releases(&pool);
+	}
+	else if (failed)
+	{
+	  // quarantine the mirror; the next request goes elsewhere
+	  if (mirror_failed(curr_context->mirror, curr_context->stream_decode && curr_context->sd.corrupt ?
+			    "corrupt PNG" : curl_easy_strerror(result)))
+	    broken = "every mirror keeps failing";
+	  unclaim_fragment(&curr_context->hd);
+	  if (curr_context->stream_decode)
+	    end_stream(&curr_context->sd);
+	}
+	else
+	{
+	  transfer_succeeded(curr_context, true);
+	}
+
+	end_curl(curlm, curr_context);
+	// before painting, which would make a race look like a plain duplicate
+	outcome = starved ? OUTCOME_NONE : failed ? OUTCOME_FAILED :
+	  !curr_context->hd.duplicate ? OUTCOME_NEW :
+	  curr_context->image->painted_fragments[curr_context->hd.n] ? OUTCOME_DUPLICATE :
+	  OUTCOME_RACED;
 
-	// Run the new curl
-	mc = curl_multi_perform(curlm, &running_curls);
-	if (mc != CURLM_OK)
+	im = curr_context->image;
+	corrupt = false;
+	if (discarded || starved || failed)
+	{
+	  // nothing to paint
+	}
+	else if (curr_context->stream_decode)
+	{
+	  // stream_write_cb has painted the fragment already, unless another
+	  // transfer got it first
+	  if (!curr_context->hd.duplicate && !curr_context->sd.finished)
+	  {
+	    // the body ended before the PNG did
+	    corrupt = true;
+	  }
+	  else if (!curr_context->hd.duplicate)
+	  {
+	    record_decode(&ds, curr_context->sd.decode_time);
+	    record_time(&timings, PHASE_DECODE, curr_context->sd.decode_time * 1e6 - curr_context->sd.paint_us);
+	    record_time(&timings, PHASE_PAINT, curr_context->sd.paint_us);
+	    if (stripes && !im->painted_fragments[curr_context->hd.n])
+	    {
+	      start_us = get_time_us();
+	      write_stripe(&im->stripes, curr_context->hd.n, im->output_buffer);
+	      record_time(&timings, PHASE_ENCODE, get_time_us() - start_us);
+	    }
+	    if (cache_dir && !im->painted_fragments[curr_context->hd.n])
+	      checkpoint_stripe(&im->cache, curr_context->hd.n);
+	    im->painted_fragments[curr_context->hd.n] = true;
+	  }
+	  end_stream(&curr_context->sd);
+	}
+	else if (im->painted_fragments[curr_context->hd.n] || im->decoding_fragments[curr_context->hd.n])
+	{
+	  // The first copy of a fragment is final. Decoding another over it
+	  // gains nothing, and would spoil the stripe if the copy were corrupt
+	}
+	else if (assembler)
 	{
-	  abort_("[%s:%s] curl_multi_perform failed\n", __FUNCTION__, __LINE__);
+	  // it's the assembler's to paint, and read_link hears how that went
+	  ship_fragment(&link, im, curr_context->hd.n, curr_context->bd.buf, curr_context->bd.len);
+	}
+	else if (num_decoders)
+	{
+	  // the rest waits until a decoder hands the transfer back
+	  im->decoding_fragments[curr_context->hd.n] = true;
+	  submit_decode(&pipeline, curr_context);
+	  continue;
+	}
+	else
+	{
+	  corrupt = !paint_fragment(curr_context, stripes, row_pointers, &arena);
+	  decoded = true;
 	}
       }
-    }
+      else if ((curr_context = collect_decoded(&pipeline)))
+      {
+	im = curr_context->image;
+	im->decoding_fragments[curr_context->hd.n] = false;
+	corrupt = curr_context->corrupt;
+	decoded = true;
+	// nothing else can have painted the fragment in the meantime
+	outcome = curr_context->hd.duplicate ? OUTCOME_RACED : OUTCOME_NEW;
+      }
+      else
+      {
+	break;
+      }
 
-    // Run any new curls or continue running currently running curl
-    // Get number of remaining running_curls
-    mc = curl_multi_perform(curlm, &running_curls);
-    if (mc != CURLM_OK)
-    {
-      abort_("[%s:%s] curl_multi_perform failed\n", __FUNCTION__, __LINE__);
+      if (decoded)
+      {
+	record_time(&timings, PHASE_PAINT, curr_context->paint_us);
+	record_time(&timings, PHASE_DECODE, curr_context->decode_us);
+	record_decode(&ds, curr_context->decode_us / 1e6);
+
+	// header_cb marks a fragment received as soon as its header arrives;
+	// only stop once every fragment has actually been painted
+	if (stripes && !corrupt)
+	  record_time(&timings, PHASE_ENCODE, curr_context->encode_us);
+	if (cache_dir && !corrupt)
+	  checkpoint_stripe(&im->cache, curr_context->hd.n);
+	im->painted_fragments[curr_context->hd.n] = !corrupt;
+      }
+      if (corrupt)
+      {
+	// as much the mirror's fault as a failed transfer; the next copy
+	// paints over whatever rows this one got to
+	if (mirror_failed(curr_context->mirror, "corrupt PNG"))
+	  broken = "every mirror keeps failing";
+	unclaim_fragment(&curr_context->hd);
+	outcome = OUTCOME_FAILED;
+      }
+      if (autotune_max)
+	record_outcome(&at, outcome);
+      release_buffer(&pool, &curr_context->bd);
+      put_free_context(&table, curr_context);
     }
-  } while (!received_all_fragments);
 
-  for (i = 0; i < num_threads; ++i)
-  {
-    // Clear all pointers created for each context
-    if (contexts[i].curl)
+    if (assembler)
+      read_link(&link, images, max_active, &p->queue);
+
+    for (im = images; im < images + max_active; ++im)
     {
-      curl_multi_remove_handle(curlm, contexts[i].curl);
-      curl_easy_cleanup(contexts[i].curl);
-      contexts[i].curl = NULL;
+      if (!im->open)
+	continue;
+
+      // check for unpainted fragments
+      im->missing = 0;
+      for (int i = 0; i < N; i++)
+	if (!im->painted_fragments[i])
+	  im->missing++;
+
+      if (im->missing == 0)
+      {
+	// whatever is still in flight for it is a duplicate, and would
+	// paint into a buffer that is about to go
+	cancel_transfers(&table, curlm, &pool, &accounts, im);
+	close_image(im, cache_dir, stripes, raw, level, filter, &main_timings);
+	complete_job(im, PASTER_DONE);
+	active--;
+      }
     }
-    free(contexts[i].input_buffer);
-    free(contexts[i].url);
+
+    tick(&accounts);
   }
-  free(contexts);
+
+  cleanup_pipeline(&pipeline);
+  cleanup_context_table(&table);
+  if (assembler)
+    close_link(&link);
 
   curl_multi_cleanup(curlm);
+  if (use_uring)
+    cleanup_uring(&ur);
+  else
+    cleanup_event_loop(&loop);
   curl_global_cleanup();
+  curl_slist_free_all(connect_to);
+  connect_to = NULL;
+  print_dupstats(&ds);
+  print_accounts(&accounts);
+  print_mirror_stats();
+  if (!stream_decode)
+    cleanup_bufpool(&pool);
+  cleanup_arena(&arena);
+
+  if (o->timings_file)
+    dump_timings(o->timings_file, mirror_timings, NUM_MIRRORS, &timings, 1, &main_timings,
+		 print_accounts_json, &accounts);
+  free(row_pointers);
+  free(images);
+
+  return NULL;
+}
 
-  // now, write the array back to disk using write_png_file
-  png_bytep * output_row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * HEIGHT);
+void paster_default_options (struct paster_options * opts)
+{
+  memset(opts, 0, sizeof(*opts));
+  opts->threads = 4;
+  opts->hedges = -1;
+  opts->tail_at = DEFAULT_TAIL_AT;
+  opts->max_active = DEFAULT_ACTIVE_IMAGES;
+  opts->buffer_cap_mb = BUFPOOL_DEFAULT_CAP_MB;
+  opts->level = DEFAULT_COMPRESSION_LEVEL;
+  opts->output = PASTER_PNG;
+}
 
-  for (int i = 0; i < HEIGHT; i++)
-    output_row_pointers[i] = &output_buffer[i*WIDTH*4];
+const char * paster_check_options (const struct paster_options * opts)
+{
+  int width, height, n;
+
+  if (opts->threads <= 0 || opts->tail_at <= 0 || opts->max_active <= 0 || opts->buffer_cap_mb == 0)
+    return "threads, tail_at, max_active and buffer_cap_mb must be > 0";
+  if (opts->autotune_max < 0 || opts->decoders < 0 || opts->max_host_connections < 0 ||
+      opts->max_requests < 0 || opts->image_max_requests < 0)
+    return "autotune_max, decoders, max_host_connections, max_requests and image_max_requests can't be < 0";
+  if (opts->level < 0 || opts->level > 9)
+    return "level must be 0-9";
+  if (opts->filter && parse_filter(opts->filter) < 0)
+    return "filter must be none, sub, up, avg, paeth or all";
+  if (opts->geometry && !scan_geometry(opts->geometry, &width, &height, &n))
+    return "geometry must be WIDTHxHEIGHT/N, with N stripes of WIDTH";
+  if (opts->stream_decode && opts->decoders)
+    return "-s decodes on the event loop and -w off it; pick one";
+  if (opts->uring && (opts->http2 || opts->max_host_connections))
+    return "-U speaks plain HTTP/1.1 on a connection per transfer; -2 and -H need curl";
+  if (opts->assembler && (opts->output != PASTER_PNG || opts->cache_dir || opts->stream_decode || opts->decoders))
+    return "with -D the assembler decodes and writes the images; -o, -r, -C, -s and -w don't apply";
+  return NULL;
+}
 
-  write_png_file("output.png", output_row_pointers);
-  free(output_row_pointers);
-  free(output_buffer);
-  free(received_fragments);
+struct paster * paster_create (const struct paster_options * opts)
+{
+  struct paster * p;
+  char spec[256];
+
+  if (engine_running || paster_check_options(opts))
+    return NULL;
+
+  p = calloc(1, sizeof(struct paster));
+  if (!p)
+    abort_("[%s] malloc failed", __FUNCTION__);
+  p->opts = *opts;
+  p->wakefd = -1;
+  pthread_mutex_init(&p->queue.lock, NULL);
+  pthread_cond_init(&p->queue.ready, NULL);
+
+  set_geometry(DEFAULT_WIDTH, DEFAULT_HEIGHT, DEFAULT_FRAGMENTS);
+  if (opts->geometry)
+    parse_geometry(opts->geometry);
+  if (opts->connect_to)
+  {
+    snprintf(spec, sizeof(spec), "::%s", opts->connect_to);
+    connect_to = curl_slist_append(NULL, spec);
+    connect_addr = opts->connect_to;
+  }
+  forbid_reuse = opts->forbid_reuse;
+  use_http2 = opts->http2;
+  max_host_connections = opts->max_host_connections;
+  verbose = opts->verbose;
+  engine_running = true;
+
+  if (pthread_create(&p->thread, NULL, engine_function, p))
+    abort_("[%s] failed to create the engine thread", __FUNCTION__);
+
+  // anything submitted from now on has to wake it
+  pthread_mutex_lock(&p->queue.lock);
+  while (p->wakefd == -1)
+    pthread_cond_wait(&p->queue.ready, &p->queue.lock);
+  pthread_mutex_unlock(&p->queue.lock);
+  return p;
+}
 
+int paster_submit (struct paster * p, int img, const char * file_name,
+		   paster_callback on_complete, void * arg)
+{
+  struct paster_job * job;
+
+  // the pixels are only ever whole in memory for a PNG
+  if (img <= 0 || (!file_name && (p->opts.output != PASTER_PNG || p->opts.cache_dir)))
+    return -1;
+
+  job = calloc(1, sizeof(struct paster_job));
+  if (!job)
+    abort_("[%s] malloc failed", __FUNCTION__);
+  job->img = img;
+  job->file_name = file_name ? strdup(file_name) : NULL;
+  if (file_name && !job->file_name)
+    abort_("[%s] malloc failed", __FUNCTION__);
+  job->on_complete = on_complete;
+  job->arg = arg;
+
+  if (!push_job(&p->queue, job, p->wakefd))
+  {
+    free(job->file_name);
+    free(job);
+    return -1;
+  }
   return 0;
 }
+
+void paster_destroy (struct paster * p)
+{
+  // under the lock, as the engine closes wakefd as soon as it sees this
+  pthread_mutex_lock(&p->queue.lock);
+  p->queue.stopping = true;
+  if (!p->queue.failed)
+    signal_eventfd(p->wakefd);
+  pthread_mutex_unlock(&p->queue.lock);
+
+  pthread_join(p->thread, NULL);
+  pthread_mutex_destroy(&p->queue.lock);
+  pthread_cond_destroy(&p->queue.ready);
+  connect_addr = NULL;
+  engine_running = false;
+  free(p);
+}
+
+/***********************************************************************************/
+
+#ifndef LIBPASTER
+/* the images given up on, for the exit status */
+void count_failure (const struct paster_result * result, void * arg)
+{
+  int * failures = arg;
+
+  if (result->status != PASTER_DONE)
+    (*failures)++;
+}
+
+int main(int argc, char **argv)
+{
+  int c;
+  struct paster_options opts;
+  struct paster * p;
+  const char * error;
+  int width, height, n;
+  int img = 1;
+  int * imgs = NULL;
+  int num_images = 0;
+  char * stripe_file = NULL;
+  char * raw_file = NULL;
+  char * file_name;
+  int failures = 0, refused = 0;  // the engine counts the first, and main the second
+  int i;
+
+  paster_default_options(&opts);
+  // the command line prints each fragment, as it always has
+  opts.verbose = true;
+  while ((c = getopt (argc, argv, "t:i:b:a:dsw:m:k:x:A:c:K2H:Uj:z:f:o:C:g:r:D:q:Q:e:E:v")) != -1) {
+    switch (c) {
+    case 't':
+      opts.threads = strtoul(optarg, NULL, 10);
+      if (opts.threads == 0) {
+	printf("%s: option requires an argument > 0 -- 't'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'i':
+      img = strtoul(optarg, NULL, 10);
+      if (img == 0) {
+	printf("%s: option requires an argument > 0 -- 'i'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'b':
+      free(imgs);
+      num_images = parse_image_list(optarg, &imgs);
+      if (num_images == 0) {
+	printf("%s: option requires a list of images like 1-5,8 -- 'b'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'a':
+      opts.max_active = strtoul(optarg, NULL, 10);
+      if (opts.max_active == 0) {
+	printf("%s: option requires an argument > 0 -- 'a'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'd':
+      opts.discard_duplicates = true;
+      break;
+    case 's':
+      opts.stream_decode = true;
+      break;
+    case 'w':
+      opts.decoders = strtoul(optarg, NULL, 10);
+      if (opts.decoders == 0) {
+	printf("%s: option requires an argument > 0 -- 'w'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'm':
+      opts.buffer_cap_mb = strtoul(optarg, NULL, 10);
+      if (opts.buffer_cap_mb == 0) {
+	printf("%s: option requires an argument > 0 -- 'm'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'k':
+      opts.tail_at = strtoul(optarg, NULL, 10);
+      if (opts.tail_at == 0) {
+	printf("%s: option requires an argument > 0 -- 'k'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'x':
+      opts.hedges = strtoul(optarg, NULL, 10);
+      break;
+    case 'A':
+      opts.autotune_max = strtoul(optarg, NULL, 10);
+      if (opts.autotune_max == 0) {
+	printf("%s: option requires an argument > 0 -- 'A'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'c':
+      opts.connect_to = optarg;
+      break;
+    case 'K':
+      opts.forbid_reuse = true;
+      break;
+    case '2':
+      opts.http2 = true;
+      break;
+    case 'H':
+      opts.max_host_connections = strtoul(optarg, NULL, 10);
+      if (opts.max_host_connections == 0) {
+	printf("%s: option requires an argument > 0 -- 'H'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'U':
+      opts.uring = true;
+      break;
+    case 'j':
+      opts.timings_file = optarg;
+      break;
+    case 'q':
+      opts.max_requests = strtoul(optarg, NULL, 10);
+      if (opts.max_requests == 0) {
+	printf("%s: option requires an argument > 0 -- 'q'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'Q':
+      opts.max_mb = strtoul(optarg, NULL, 10);
+      if (opts.max_mb == 0) {
+	printf("%s: option requires an argument > 0 -- 'Q'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'e':
+      opts.image_max_requests = strtoul(optarg, NULL, 10);
+      if (opts.image_max_requests == 0) {
+	printf("%s: option requires an argument > 0 -- 'e'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'E':
+      opts.image_max_mb = strtoul(optarg, NULL, 10);
+      if (opts.image_max_mb == 0) {
+	printf("%s: option requires an argument > 0 -- 'E'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'v':
+      opts.ticker = true;
+      break;
+    case 'o':
+      stripe_file = optarg;
+      break;
+    case 'r':
+      raw_file = optarg;
+      break;
+    case 'C':
+      opts.cache_dir = optarg;
+      break;
+    case 'D':
+      opts.assembler = optarg;
+      break;
+    case 'g':
+      if (!scan_geometry(optarg, &width, &height, &n)) {
+	printf("%s: option requires an argument WIDTHxHEIGHT/N, N <= %d dividing WIDTH -- 'g'\n", argv[0], MAX_FRAGMENTS);
+	return -1;
+      }
+      opts.geometry = optarg;
+      break;
+    case 'z':
+      opts.level = strtoul(optarg, NULL, 10);
+      if (opts.level > 9) {
+	printf("%s: option requires an argument 0-9 -- 'z'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'f':
+      if (parse_filter(optarg) < 0) {
+	printf("%s: option requires none, sub, up, avg, paeth or all -- 'f'\n", argv[0]);
+	return -1;
+      }
+      opts.filter = optarg;
+      break;
+    default:
+      return -1;
+    }
+  }
+  if (stripe_file && raw_file)
+  {
+    printf("%s: -o and -r write different kinds of output; pick one\n", argv[0]);
+    return -1;
+  }
+  opts.output = stripe_file ? PASTER_STRIPES : raw_file ? PASTER_RAW : PASTER_PNG;
+  if ((error = paster_check_options(&opts)))
+  {
+    printf("%s: %s\n", argv[0], error);
+    return -1;
+  }
+
+  p = paster_create(&opts);
+  if (!p)
+  {
+    abort_("[%s] could not start the engine", __FUNCTION__);
+  }
+
+  // without -b the batch is just the -i image, written where it always was
+  if (!num_images)
+  {
+    if (paster_submit(p, img, stripe_file ? stripe_file : raw_file ? raw_file : "output.png", count_failure, &failures))
+      refused++;
+  }
+  else
+  {
+    file_name = malloc(strlen(stripe_file ? stripe_file : raw_file ? raw_file : "output.png") + 16);
+    if (!file_name)
+      abort_("[%s] file name malloc failed", __FUNCTION__);
+    for (i = 0; i < num_images; ++i)
+    {
+      if (stripe_file)
+	sprintf(file_name, "%s-%d", stripe_file, imgs[i]);
+      else if (raw_file)
+	sprintf(file_name, "%s-%d", raw_file, imgs[i]);
+      else
+	sprintf(file_name, "output-%d.png", imgs[i]);
+      // once the engine has given up it turns the rest away
+      if (paster_submit(p, imgs[i], file_name, count_failure, &failures))
+	refused++;
+    }
+    free(file_name);
+  }
+  paster_destroy(p);
+  free(imgs);
+
+  // the images that are written are still worth having
+  return failures || refused ? -1 : 0;
+}
+#endif
@@ -21,224 +21,252 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <time.h>
 
 #define PNG_DEBUG 3
 #include <png.h>
+#include <zlib.h>
 #include <curl/curl.h>
 
-#include <pthread.h>
+#include "geometry.h"
 
-struct bufdata {
-  png_bytep buf;
-  int len, pos;
-  size_t max_size;
-};
+#include <pthread.h>
 
-#define N 20
-#define WIDTH 4000
-#define HEIGHT 3000
+#include "fetch.h"
+#include "image.h"
+#include "mirrors.h"
+#include "stream.h"
+#include "autotune.h"
 
-#define BASE_URL_1 "http://berkeley.uwaterloo.ca:4590/image?img=%d"
-#define BASE_URL_2 "http://patricklam.ca:4590/image?img=%d"
-#define BASE_URL_3 "http://ece459-1.uwaterloo.ca:4590/image?img=%d"
+#define DEFAULT_COMPRESSION_LEVEL 6    // zlib's own default
 
-#define BUF_WIDTH WIDTH/N
-#define BUF_HEIGHT HEIGHT
-#define BUF_SIZE 10485760
-#define ECE459_HEADER "X-Ece459-Fragment: "
+// the share (see fetch.h) has a lock for each kind of data it holds
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
 
-#ifdef DEBUG
-#define DEBUG_PRINT(x) (printf x)
-#else
-#define DEBUG_PRINT(x) /* DEBUG is not defined/enabled */
-#endif
+/***********************************************************************************/
+/* connection reuse                                                                */
 
-/* error handling macro */
-void abort_(const char * s, ...)
+void share_lock_cb (CURL * curl, curl_lock_data data, curl_lock_access access, void * userptr)
 {
-  va_list args;
-  va_start(args, s);
-  vfprintf(stderr, s, args);
-  fprintf(stderr, "\n");
-  va_end(args);
-  abort();
+  pthread_mutex_lock(&share_locks[data]);
 }
 
-/***********************************************************************************/
-/* routines to parse PNG data and copy it to an internal buffer */
-
-void read_cb (png_structp png_ptr, png_bytep outBytes, png_size_t byteCountToRead);
-
-/* Given PNG-formatted data at bd, read the data into a buffer that we allocate
- * and return (row_pointers, here).
- *
- * Note: caller must free the returned value. */
-png_bytep* read_png_file(png_structp png_ptr, png_infop * info_ptr, struct bufdata * bd)
+void share_unlock_cb (CURL * curl, curl_lock_data data, void * userptr)
 {
-  int y;
-
-  int height;
-  png_byte bit_depth;
-
-  png_bytep * row_pointers;
-
-  if (png_sig_cmp(bd->buf, 0, 8))
-    abort_("[read_png_file] Input is not recognized as a PNG file");
-
-  *info_ptr = png_create_info_struct(png_ptr);
-  if (!*info_ptr)
-    abort_("[read_png_file] png_create_info_struct failed");
-
-  if (setjmp(png_jmpbuf(png_ptr)))
-    abort_("[read_png_file] Error during init_io");
-
-  bd->pos = 0;
-  png_set_read_fn(png_ptr, bd, read_cb);
-  png_read_info(png_ptr, *info_ptr);
-  height = png_get_image_height(png_ptr, *info_ptr);
-  bit_depth = png_get_bit_depth(png_ptr, *info_ptr);
-  if (bit_depth != 8)
-    abort_("[read_png_file] bit depth 16 PNG files unsupported");
+  pthread_mutex_unlock(&share_locks[data]);
+}
 
-  if (setjmp(png_jmpbuf(png_ptr)))
-    abort_("[read_png_file] Error during read_image");
+/* Each thread has a handle of its own, and by itself a handle only reuses
+ * connections it opened. Through the share, a thread can pick up any idle
+ * connection to its mirror, and a name any thread has looked up. */
+void init_share (void)
+{
+  int i;
 
-  row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * BUF_HEIGHT);
-  for (y=0; y<height; y++)
-    row_pointers[y] = (png_byte*) malloc(png_get_rowbytes(png_ptr, *info_ptr));
+  for (i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+    pthread_mutex_init(&share_locks[i], NULL);
+
+  share = curl_share_init();
+  if (!share)
+    abort_("[init_share] curl_share_init failed");
+  curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock_cb);
+  curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock_cb);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+}
 
-  png_read_image(png_ptr, row_pointers);
+void cleanup_share (void)
+{
+  int i;
 
-  return row_pointers;
+  curl_share_cleanup(share);
+  for (i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+    pthread_mutex_destroy(&share_locks[i]);
 }
 
-/* libpng calls this (at read_png_data's request)
- * to copy data from the in-RAM PNG into our bitmap */
-void read_cb (png_structp png_ptr, png_bytep outBytes, png_size_t byteCountToRead) {
-  struct bufdata * bd = png_get_io_ptr(png_ptr);
-
-  if (bd == NULL)
-    abort_("[read_png_file/read_cb] invalid memory passed to png reader");
-  if (bd->pos + byteCountToRead >= bd->len)
-    abort_("[read_png_file/read_cb] attempting to read beyond end of buffer");
+/***********************************************************************************/
+/* layout of the output buffer                                                     */
 
-  memcpy(outBytes, bd->buf+bd->pos, byteCountToRead);
-  bd->pos += byteCountToRead;
+/* With -S, a zeroed stripe-major buffer (see image.h) rather than a
+ * row-major one; its pages are only ever touched by whoever paints them */
+png_byte * map_stripes (void)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  png_byte * dest;
+
+  stripe_pitch = ((size_t) BUF_WIDTH*HEIGHT*4 + page - 1) / page * page;
+  dest = mmap(NULL, N*stripe_pitch, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (dest == MAP_FAILED)
+    abort_("[map_stripes] Error mapping the output buffer: %s", strerror(errno));
+  return dest;
 }
 
-/* copy from row_pointers data array to dest data array, at offset (x0, y0) */
-
-void paint_destination(png_structp png_ptr, png_bytep * row_pointers,
-		       int x0, int y0, png_byte* dest)
+void unmap_stripes (png_byte * dest)
 {
-  int x, y, i;
-
-  for (y=0; y<BUF_HEIGHT && (y0+y) < HEIGHT; y++) {
-    png_byte* row = row_pointers[y];
-    for (x=0; x<BUF_WIDTH; x++) {
-      png_byte* ptr = &(row[x*4]);
-      int index = ((y0+y)*WIDTH+(x0+x))*4;
-      for (i = 0; i < 4; i++)
-	dest[index+i] = ptr[i];
-    }
-  }
+  munmap(dest, N*stripe_pitch);
 }
 
 /***********************************************************************************/
-/* routine used by curl to read from the network                                   */
-
-/* curl calls this to transfer data from the network into RAM */
-size_t write_cb(char * ptr, size_t size, size_t nmemb, void *userdata) {
-  struct bufdata * bd = userdata;
+/* tail mode and completion                                                        */
 
-  if (size * nmemb >= bd->max_size) {
-    return 0;
-  }
+/* Fragments come back at random, so the last few missing ones take about
+ * as long as all the others together. Once no more than tail_at fragments
+ * are missing, the hedge threads, idle until then, join in with requests
+ * spread over every mirror; and the moment the last fragment is painted,
+ * every transfer still in flight is cut short.
+ *
+ * Painting a fragment is lock-free: a bit in painted_fragments and a
+ * counter, both atomic. The lock and condition variable only serve the
+ * hedge threads sleeping in wait_for_tail. */
+
+#define DEFAULT_TAIL_AT 2
+
+struct tailmode {
+  struct bitmap painted_fragments;
+  int num_painted;
+  int tail_at;
+  bool tail;
+  bool done;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+};
 
-  memcpy(bd->buf+bd->pos, ptr, size * nmemb);
-  bd->pos += size*nmemb;
-  bd->len += size*nmemb;
-  return size * nmemb;
+void init_tailmode (struct tailmode * tm, int tail_at)
+{
+  memset(tm, 0, sizeof(*tm));
+  tm->tail_at = tail_at;
+  if (pthread_mutex_init(&tm->lock, NULL) || pthread_cond_init(&tm->changed, NULL))
+    abort_("[%s] pthread_mutex_init failed", __FUNCTION__);
 }
 
-/***********************************************************************************/
-/* routine to write data to disk                                                   */
-
-/* write output_row_pointers back to PNG file as specified by file_name. */
-void write_png_file(char* file_name, png_bytep * output_row_pointers)
+void cleanup_tailmode (struct tailmode * tm)
 {
-  png_structp png_ptr;
-  png_infop info_ptr;
-
-  /* create file */
-  FILE *fp = fopen(file_name, "wb");
-  if (!fp)
-    abort_("[write_png_file] File %s could not be opened for writing", file_name);
-
-
-  /* initialize stuff */
-  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-
-  if (!png_ptr)
-    abort_("[write_png_file] png_create_write_struct failed");
-
-  info_ptr = png_create_info_struct(png_ptr);
-  if (!info_ptr)
-    abort_("[write_png_file] png_create_info_struct failed");
-
-  if (setjmp(png_jmpbuf(png_ptr)))
-    abort_("[write_png_file] Error during init_io");
+  pthread_mutex_destroy(&tm->lock);
+  pthread_cond_destroy(&tm->changed);
+}
 
-  png_init_io(png_ptr, fp);
+void wake_tail_waiters (struct tailmode * tm)
+{
+  pthread_mutex_lock(&tm->lock);
+  pthread_cond_broadcast(&tm->changed);
+  pthread_mutex_unlock(&tm->lock);
+}
 
-  /* write header */
-  if (setjmp(png_jmpbuf(png_ptr)))
-    abort_("[write_png_file] Error during writing header");
+//
+// header_cb marks a fragment received as soon as its header arrives, so
+// only stop once every fragment has actually been painted. Only the first
+// transfer to paint a fragment counts it; the release ordering makes its
+// pixels visible to whoever sees the count.
+//
+void paint_fragment (struct tailmode * tm, int n)
+{
+  int painted;
 
-  png_set_IHDR(png_ptr, info_ptr, WIDTH, HEIGHT,
-	       8, 6, PNG_INTERLACE_NONE,
-	       PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+  if (test_and_set_bit(&tm->painted_fragments, n))
+    return;
 
-  png_write_info(png_ptr, info_ptr);
+  painted = __atomic_add_fetch(&tm->num_painted, 1, __ATOMIC_ACQ_REL);
+  if (N - painted <= tm->tail_at && !__atomic_exchange_n(&tm->tail, true, __ATOMIC_ACQ_REL)) {
+    printf("%d fragments missing, hedging\n", N - painted);
+    wake_tail_waiters(tm);
+  }
+  if (painted == N) {
+    __atomic_store_n(&tm->done, true, __ATOMIC_RELEASE);
+    wake_tail_waiters(tm);
+  }
+}
 
-  /* write bytes */
-  if (setjmp(png_jmpbuf(png_ptr)))
-    abort_("[write_png_file] Error during writing bytes");
+bool is_painted (struct tailmode * tm, int n)
+{
+  return test_bit(&tm->painted_fragments, n);
+}
 
-  png_write_image(png_ptr, output_row_pointers);
+bool is_done (struct tailmode * tm)
+{
+  return __atomic_load_n(&tm->done, __ATOMIC_ACQUIRE);
+}
 
-  if (setjmp(png_jmpbuf(png_ptr)))
-    abort_("[write_png_file] Error during end of write");
+/* hedge threads wait here before their first request; returns false if
+ * the image was finished before the tail even began */
+bool wait_for_tail (struct tailmode * tm)
+{
+  pthread_mutex_lock(&tm->lock);
+  while (!__atomic_load_n(&tm->tail, __ATOMIC_ACQUIRE) && !is_done(tm))
+    pthread_cond_wait(&tm->changed, &tm->lock);
+  pthread_mutex_unlock(&tm->lock);
 
-  png_write_end(png_ptr, NULL);
+  return !is_done(tm);
+}
 
-  fclose(fp);
-  png_destroy_write_struct(&png_ptr, &info_ptr);
+/* curl calls this while a transfer runs; returning nonzero cancels it with
+ * CURLE_ABORTED_BY_CALLBACK */
+int cancel_when_done_cb (void * userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+  return is_done(userdata);
 }
 
-struct headerdata {
-  int n;
-  bool * received_fragments;
+/***********************************************************************************/
+/* adaptive concurrency                                                            */
+
+/* With -A (see autotune.h) there are -A threads from the start; before each
+ * request a thread takes one of limit permits, waiting in acquire_transfer
+ * until one is free. Hedge threads need none. The controller is under the
+ * lock, since every thread reports to it. */
+
+struct permits {
+  struct autotune at;
+  int running;          // threads holding a permit
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
 };
 
-size_t header_cb (char * buf, size_t size, size_t nmemb, void * userdata)
+void init_permits (struct permits * pm, int max)
 {
-  struct headerdata * hd = userdata;
-  int bytes_in_header = size * nmemb;
+  init_autotune(&pm->at, max);
+  pm->running = 0;
+  if (pthread_mutex_init(&pm->lock, NULL) || pthread_cond_init(&pm->changed, NULL))
+    abort_("[%s] pthread_mutex_init failed", __FUNCTION__);
+}
 
-  if (bytes_in_header > strlen(ECE459_HEADER) && strncmp(buf, ECE459_HEADER, strlen(ECE459_HEADER)) == 0) {
-    // one ought to check that buf is 0-terminated
-    //  not guaranteed by spec (!)
-    hd->n = atoi(buf+strlen(ECE459_HEADER));
+void cleanup_permits (struct permits * pm)
+{
+  pthread_mutex_destroy(&pm->lock);
+  pthread_cond_destroy(&pm->changed);
+}
 
-    hd->received_fragments[hd->n] = true;
+/* wait for a permit; returns false, with none, once the image is done */
+bool acquire_transfer (struct permits * pm, struct tailmode * tm)
+{
+  bool done;
 
-    printf("received fragment %d\n", hd->n);
-  }
+  pthread_mutex_lock(&pm->lock);
+  while (pm->running >= pm->at.limit && !is_done(tm))
+    pthread_cond_wait(&pm->changed, &pm->lock);
+  done = is_done(tm);
+  if (!done)
+    pm->running++;
+  pthread_mutex_unlock(&pm->lock);
 
-  return bytes_in_header;
+  return !done;
+}
+
+/* give the permit back; whoever waits may find the image done, or the
+ * limit changed */
+void release_transfer (struct permits * pm, enum outcome outcome)
+{
+  pthread_mutex_lock(&pm->lock);
+  pm->running--;
+  record_outcome(&pm->at, outcome);
+  pthread_cond_broadcast(&pm->changed);
+  pthread_mutex_unlock(&pm->lock);
 }
 
 /***********************************************************************************/
@@ -246,110 +274,259 @@ size_t header_cb (char * buf, size_t size, size_t nmemb, void * userdata)
 typedef struct _thread_function_context
 {
   int thread_id;
-  bool * received_fragments;
+  struct bitmap * received_fragments;
+  struct tailmode * tail;
+  struct permits * permits;     // NULL unless -A, and for hedges
+  bool hedge;           // only starts once the tail does
+  bool discard_duplicates;
+  bool stream_decode;
+  struct dupstats * ds;
+  struct timings * timings;
+  struct bufpool * pool;
+  struct stripefile * stripes;  // NULL unless -o
+  struct cache * cache;         // NULL unless -C
   int img;
   png_byte * output_buffer;
 } thread_function_context;
 
-static pthread_mutex_t get_url_lock;
-
-//
-// Get url to get image from
-//
-void get_url (char ** url, int img)
-{
-  static unsigned int counter;
-
-  pthread_mutex_lock(&get_url_lock);
-  counter = (counter + 1) % 3;
-  pthread_mutex_unlock(&get_url_lock);
-
-  switch (counter)
-  {
-  case 0:
-    sprintf(*url, BASE_URL_1, img);
-    break;
-  case 1:
-    sprintf(*url, BASE_URL_2, img);
-    break;
-  case 2:
-  default:
-    sprintf(*url, BASE_URL_3, img);
-    break;
-  }
-}
-
 //
 // Funciton that each thread will run
 //
 void *thread_function (void * context)
 {
-  bool received_all_fragments;
   thread_function_context * tf_context;
   CURL *curl;
   CURLcode res;
   png_structp png_ptr;
   png_infop info_ptr;
+  long start_us, decode_us, end_us;
+  int mirror;
+  bool permit = false;
+  enum outcome outcome = OUTCOME_NONE;
 
   tf_context = (thread_function_context *) context;
 
   printf("[%s] Thread #%d started...\n", __FUNCTION__, tf_context->thread_id);
 
+  if (tf_context->hedge && !wait_for_tail(tf_context->tail))
+    pthread_exit(0);
+
   curl = curl_easy_init();
   if (!curl)
     abort_("[%s] could not initialize curl", __FUNCTION__);
 
   char * url = malloc(sizeof(char)*strlen(BASE_URL_1)+4*5);
-  png_bytep input_buffer = malloc(sizeof(png_byte)*BUF_SIZE);
+  png_bytep * row_pointers = NULL;
+  struct arena arena;
+
+  struct headerdata hd; hd.received_fragments = tf_context->received_fragments;
+  hd.discard_duplicates = tf_context->discard_duplicates;
 
   struct bufdata bd;
-  bd.buf = input_buffer;
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_cb);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &bd);
+  struct streamdata sd;
+  if (tf_context->stream_decode)
+  {
+    // decode as the body arrives; nothing needs to be buffered
+    sd.hd = &hd;
+    sd.dest = tf_context->output_buffer;
+    init_stream(&sd);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, stream_write_cb);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sd);
+  }
+  else
+  {
+    row_pointers = malloc(sizeof(png_bytep)*BUF_HEIGHT);
+    init_arena(&arena);
+    bd.buf = NULL; bd.max_size = 0;
+    bd.pool = tf_context->pool; bd.hd = &hd;
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_cb);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &bd);
+  }
 
-  struct headerdata hd; hd.received_fragments = tf_context->received_fragments;
   curl_easy_setopt(curl, CURLOPT_HEADERDATA, &hd);
   curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_cb);
+  set_connection_options(curl);
+  // an overloaded mirror answering 5xx counts as a failure, not a fragment
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, cancel_when_done_cb);
+  curl_easy_setopt(curl, CURLOPT_XFERINFODATA, tf_context->tail);
+  curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+
+  // everything may have come from the cache
+  while (!is_done(tf_context->tail)) {
+    if (permit)
+      release_transfer(tf_context->permits, outcome);
+    permit = false;
+    if (tf_context->permits && !(permit = acquire_transfer(tf_context->permits, tf_context->tail)))
+      break;
+    outcome = OUTCOME_NONE;
 
-  do {
     // request appropriate URL
     // Calling get_url each loop iterations allows it to change
     // urls each time
-    get_url(&url, tf_context->img);
+    mirror = get_url(&url, tf_context->img, tf_context->hedge);
     DEBUG_PRINT(("[%s] thread id #%d requesting URL %s\n", __FUNCTION__, tf_context->thread_id, url));
     curl_easy_setopt(curl, CURLOPT_URL, url);
 
-    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png_ptr)
-      abort_("[%s] png_create_read_struct failed", __FUNCTION__);
+    if (tf_context->stream_decode)
+    {
+      start_stream(&sd);
+    }
+    else
+    {
+      png_ptr = create_read_struct(&arena);
+      if (!png_ptr)
+	abort_("[%s] png_create_read_struct failed", __FUNCTION__);
+    }
 
     // reset input buffer
-    bd.len = bd.pos = 0; bd.max_size = BUF_SIZE;
+    bd.len = bd.pos = 0; bd.starved = false;
+    hd.n = -1; hd.duplicate = false; hd.content_length = -1;
 
     // do curl request; check for errors
     res = curl_easy_perform(curl);
-    if(res != CURLE_OK)
-      abort_("[%s] curl_easy_perform() failed: %s\n",
-	     __FUNCTION__, curl_easy_strerror(res));
+    if (res == CURLE_WRITE_ERROR && hd.duplicate)
+    {
+      // header_cb already knew we had this one; ask again straight away
+      outcome = is_painted(tf_context->tail, hd.n) ? OUTCOME_DUPLICATE : OUTCOME_RACED;
+      record_discard(tf_context->ds, &hd);
+      mirror_succeeded(mirror, curl, false);
+      if (tf_context->stream_decode)
+	end_stream(&sd);
+      else
+	png_destroy_read_struct(&png_ptr, NULL, NULL);
+      continue;
+    }
+    if (res == CURLE_WRITE_ERROR && bd.starved)
+    {
+      // Someone else has to paint this fragment, maybe us on a later try
+      unclaim_fragment(&hd);
+      release_buffer(tf_context->pool, &bd);
+      png_destroy_read_struct(&png_ptr, NULL, NULL);
+      continue;
+    }
+    if (res == CURLE_ABORTED_BY_CALLBACK)
+    {
+      // every fragment got painted while this one was on its way
+      if (tf_context->stream_decode)
+      {
+	end_stream(&sd);
+      }
+      else
+      {
+	release_buffer(tf_context->pool, &bd);
+	png_destroy_read_struct(&png_ptr, NULL, NULL);
+      }
+      break;
+    }
+    if (res != CURLE_OK)
+    {
+      // quarantine the mirror and ask another one
+      outcome = OUTCOME_FAILED;
+      mirror_failed_or_abort(mirror, tf_context->stream_decode && sd.corrupt ?
+			     "corrupt PNG" : curl_easy_strerror(res));
+      unclaim_fragment(&hd);
+      if (tf_context->stream_decode)
+      {
+	end_stream(&sd);
+      }
+      else
+      {
+	release_buffer(tf_context->pool, &bd);
+	png_destroy_read_struct(&png_ptr, NULL, NULL);
+      }
+      continue;
+    }
+    mirror_succeeded(mirror, curl, true);
+    outcome = !hd.duplicate ? OUTCOME_NEW :
+      is_painted(tf_context->tail, hd.n) ? OUTCOME_DUPLICATE : OUTCOME_RACED;
+
+    if (tf_context->stream_decode)
+    {
+      // stream_write_cb has painted the fragment already, unless another
+      // thread got it first
+      if (!hd.duplicate && !sd.finished)
+      {
+	// the body ended before the PNG did
+	outcome = OUTCOME_FAILED;
+	mirror_failed_or_abort(mirror, "corrupt PNG");
+	unclaim_fragment(&hd);
+      }
+      else if (!hd.duplicate)
+      {
+	record_decode(tf_context->ds, sd.decode_time);
+	start_us = get_time_us();
+	paint_fragment(tf_context->tail, hd.n);
+	record_time(tf_context->timings, PHASE_DECODE, sd.decode_time * 1e6 - sd.paint_us);
+	record_time(tf_context->timings, PHASE_PAINT, sd.paint_us + get_time_us() - start_us);
+	if (tf_context->stripes)
+	{
+	  start_us = get_time_us();
+	  write_stripe(tf_context->stripes, hd.n, tf_context->output_buffer);
+	  record_time(tf_context->timings, PHASE_ENCODE, get_time_us() - start_us);
+	}
+	if (tf_context->cache)
+	  checkpoint_stripe(tf_context->cache, hd.n);
+      }
+      end_stream(&sd);
+      continue;
+    }
+
+    // The thread that claimed this fragment in header_cb paints it; two
+    // threads writing the same stripe at once would be a data race, even
+    // with identical pixels
+    if (hd.duplicate)
+    {
+      release_buffer(tf_context->pool, &bd);
+      png_destroy_read_struct(&png_ptr, NULL, NULL);
+      continue;
+    }
 
-    // read PNG (as downloaded from network) and copy it to output buffer
-    png_bytep* row_pointers = read_png_file(png_ptr, &info_ptr, &bd);
-    paint_destination(png_ptr, row_pointers, hd.n*BUF_WIDTH, 0, tf_context->output_buffer);
+    // read PNG (as downloaded from network) and copy it to output buffer.
+    // libpng decodes straight into the output buffer, so all there is to
+    // painting is pointing the rows at it and marking the fragment done
+    start_us = get_time_us();
+    point_rows_at_destination(row_pointers, hd.n, tf_context->output_buffer);
+    decode_us = get_time_us();
+    if (!read_png_file(png_ptr, &info_ptr, &bd, row_pointers))
+    {
+      // as much the mirror's fault as a failed transfer; the next copy
+      // paints over whatever rows this one got to
+      outcome = OUTCOME_FAILED;
+      mirror_failed_or_abort(mirror, "corrupt PNG");
+      unclaim_fragment(&hd);
+      png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+      release_buffer(tf_context->pool, &bd);
+      continue;
+    }
+    end_us = get_time_us();
+    record_decode(tf_context->ds, (end_us - decode_us) / 1e6);
+
+    paint_fragment(tf_context->tail, hd.n);
+    record_time(tf_context->timings, PHASE_DECODE, end_us - decode_us);
+    record_time(tf_context->timings, PHASE_PAINT, decode_us - start_us + get_time_us() - end_us);
+    if (tf_context->stripes)
+    {
+      start_us = get_time_us();
+      write_stripe(tf_context->stripes, hd.n, tf_context->output_buffer);
+      record_time(tf_context->timings, PHASE_ENCODE, get_time_us() - start_us);
+    }
+    if (tf_context->cache)
+      checkpoint_stripe(tf_context->cache, hd.n);
 
     // free allocated memory
-    for (int y=0; y<BUF_HEIGHT; y++)
-      free(row_pointers[y]);
-    free(row_pointers);
     png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    release_buffer(tf_context->pool, &bd);
 
-    // check for unreceived fragments
-    received_all_fragments = true;
-    for (int i = 0; i < N; i++)
-      if (!tf_context->received_fragments[i])
-	received_all_fragments = false;
-  } while (!received_all_fragments);
+  }
+  if (permit)
+    release_transfer(tf_context->permits, outcome);
   free(url);
-  free(input_buffer);
+  free(row_pointers);
+  if (tf_context->stream_decode)
+    cleanup_stream(&sd);
+  else
+    cleanup_arena(&arena);
 
   curl_easy_cleanup(curl);
 
@@ -362,14 +539,40 @@ int main(int argc, char **argv)
 {
   int c;
   int num_threads = 4;
+  int num_hedges = -1;
+  int autotune_max = 0;
+  struct permits permits;
+  int tail_at = DEFAULT_TAIL_AT;
   int img = 1;
-  bool * received_fragments;
+  bool discard_duplicates = false;
+  bool stream_decode = false;
+  struct bitmap received_fragments = { { 0 } };
+  struct tailmode tail;
+  struct dupstats ds = { 0 };
+  struct timings * thread_timings;
+  struct timings main_timings = { { { { 0 } } } };
+  char * timings_file = NULL;
+  int level = DEFAULT_COMPRESSION_LEVEL;
+  int filter = FILTER_ALL;
+  int num_encoders = 1;
+  char * stripe_file = NULL;
+  struct stripefile stripes;
+  char * raw_file = NULL;
+  struct rawfile raw = { 0 };
+  char * cache_dir = NULL;
+  struct cache cache = { 0 };
+  uint64_t cached = 0;
+  bool stripe_major = false;
+  long start_us;
+  size_t buffer_cap_mb = BUFPOOL_DEFAULT_CAP_MB;
+  struct bufpool pool;
   pthread_t * threads;
   thread_function_context * thread_function_contexts;
   int i;
   png_byte * output_buffer;
 
-  while ((c = getopt (argc, argv, "t:i:")) != -1) {
+  set_geometry(DEFAULT_WIDTH, DEFAULT_HEIGHT, DEFAULT_FRAGMENTS);
+  while ((c = getopt (argc, argv, "t:i:dsm:k:x:A:c:K2j:z:f:p:o:C:g:r:S")) != -1) {
     switch (c) {
     case 't':
       num_threads = strtoul(optarg, NULL, 10);
@@ -385,50 +588,198 @@ int main(int argc, char **argv)
 	return -1;
       }
       break;
+    case 'd':
+      discard_duplicates = true;
+      break;
+    case 's':
+      stream_decode = true;
+      break;
+    case 'm':
+      buffer_cap_mb = strtoul(optarg, NULL, 10);
+      if (buffer_cap_mb == 0) {
+	printf("%s: option requires an argument > 0 -- 'm'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'k':
+      tail_at = strtoul(optarg, NULL, 10);
+      if (tail_at == 0) {
+	printf("%s: option requires an argument > 0 -- 'k'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'x':
+      num_hedges = strtoul(optarg, NULL, 10);
+      break;
+    case 'A':
+      autotune_max = strtoul(optarg, NULL, 10);
+      if (autotune_max == 0) {
+	printf("%s: option requires an argument > 0 -- 'A'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'c':
+      {
+	char spec[256];
+
+	snprintf(spec, sizeof(spec), "::%s", optarg);
+	connect_to = curl_slist_append(connect_to, spec);
+      }
+      break;
+    case 'K':
+      forbid_reuse = true;
+      break;
+    case '2':
+      use_http2 = true;
+      break;
+    case 'j':
+      timings_file = optarg;
+      break;
+    case 'o':
+      stripe_file = optarg;
+      break;
+    case 'r':
+      raw_file = optarg;
+      break;
+    case 'C':
+      cache_dir = optarg;
+      break;
+    case 'g':
+      if (!parse_geometry(optarg)) {
+	printf("%s: option requires an argument WIDTHxHEIGHT/N, N <= %d dividing WIDTH -- 'g'\n", argv[0], MAX_FRAGMENTS);
+	return -1;
+      }
+      break;
+    case 'z':
+      level = strtoul(optarg, NULL, 10);
+      if (level > 9) {
+	printf("%s: option requires an argument 0-9 -- 'z'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'f':
+      filter = parse_filter(optarg);
+      if (filter < 0) {
+	printf("%s: option requires none, sub, up, avg, paeth or all -- 'f'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'p':
+      num_encoders = strtoul(optarg, NULL, 10);
+      if (num_encoders == 0) {
+	printf("%s: option requires an argument > 0 -- 'p'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'S':
+      stripe_major = true;
+      break;
     default:
       return -1;
     }
   }
+  if (stripe_file && raw_file)
+  {
+    printf("%s: -o and -r write different kinds of output; pick one\n", argv[0]);
+    return -1;
+  }
+  if (stripe_major && (cache_dir || raw_file))
+  {
+    // both paint straight into a row-major file
+    printf("%s: -S can't be combined with -C or -r\n", argv[0]);
+    return -1;
+  }
 
-  DEBUG_PRINT(("[%s] Number of threads: %d\n", __FUNCTION__, num_threads));
+  // by default the tail runs at twice the concurrency
+  if (num_hedges < 0)
+    num_hedges = num_threads;
+  // -A overrides -t, which still sets the number of hedges; there is a
+  // thread for as many transfers as there may ever be
+  if (autotune_max)
+  {
+    num_threads = autotune_max;
+    init_permits(&permits, autotune_max);
+  }
+
+  DEBUG_PRINT(("[%s] Number of threads: %d, hedges: %d\n", __FUNCTION__, num_threads, num_hedges));
   DEBUG_PRINT(("[%s] Img #: %d\n", __FUNCTION__, img));
 
-  received_fragments = calloc(N, sizeof(bool));
-  if (!received_fragments)
+  init_tailmode(&tail, tail_at);
+  if (stripe_file)
+    open_stripefile(&stripes, stripe_file, level, filter);
+  if (raw_file)
+    open_rawfile(&raw, raw_file);
+
+  // whatever the checkpoint has needn't be downloaded
+  if (cache_dir)
   {
-    abort_("[%s] received_fragments calloc failed", __FUNCTION__);
+    cached = open_cache(&cache, cache_dir, img);
+    output_buffer = cache.image;
+    printf("%d fragments from the cache\n", __builtin_popcountll(cached));
   }
-
-  output_buffer = calloc(WIDTH*HEIGHT*4, sizeof(png_byte));
-  if (!output_buffer)
+  else if (raw_file)
   {
-    abort_("[%s] output_buffer calloc failed", __FUNCTION__);
+    output_buffer = raw.image;
   }
-
-  if (pthread_mutex_init(&get_url_lock, NULL))
+  else if (stripe_major)
   {
-    abort_("[%s] get_url_lock pthread_mutex_init failed", __FUNCTION__);
+    output_buffer = map_stripes();
   }
+  else
+  {
+    output_buffer = calloc(WIDTH*HEIGHT*4, sizeof(png_byte));
+    if (!output_buffer)
+      abort_("[%s] output_buffer calloc failed", __FUNCTION__);
+  }
+  for (i = 0; i < N; ++i)
+  {
+    if (!(cached >> i & 1))
+      continue;
+    test_and_set_bit(&received_fragments, i);
+    paint_fragment(&tail, i);
+    if (stripe_file)
+      write_stripe(&stripes, i, output_buffer);
+  }
+
+  // threads block for buffers rather than hammer the server with retries
+  init_bufpool(&pool, buffer_cap_mb << 20, true);
 
-  threads = (pthread_t *) calloc(num_threads, sizeof(pthread_t));
+  threads = (pthread_t *) calloc(num_threads + num_hedges, sizeof(pthread_t));
   if (!threads)
   {
     abort_("[%s] thread calloc failed", __FUNCTION__);
   }
 
-  thread_function_contexts = (thread_function_context *) calloc(num_threads, sizeof(thread_function_context));
+  thread_function_contexts = (thread_function_context *) calloc(num_threads + num_hedges, sizeof(thread_function_context));
   if (!thread_function_contexts)
   {
     abort_("%s] thread_function_contexts calloc failed");
   }
 
+  thread_timings = (struct timings *) calloc(num_threads + num_hedges, sizeof(struct timings));
+  if (!thread_timings)
+  {
+    abort_("[%s] thread_timings calloc failed", __FUNCTION__);
+  }
+
   curl_global_init(CURL_GLOBAL_ALL);
+  init_share();
 
   printf("[%s] Dispatching threads...\n", __FUNCTION__);
-  for (i = 0; i < num_threads; ++i)
+  for (i = 0; i < num_threads + num_hedges; ++i)
   {
     thread_function_contexts[i].thread_id = i;
-    thread_function_contexts[i].received_fragments = received_fragments;
+    thread_function_contexts[i].received_fragments = &received_fragments;
+    thread_function_contexts[i].tail = &tail;
+    thread_function_contexts[i].hedge = i >= num_threads;
+    thread_function_contexts[i].permits = autotune_max && i < num_threads ? &permits : NULL;
+    thread_function_contexts[i].discard_duplicates = discard_duplicates;
+    thread_function_contexts[i].stream_decode = stream_decode;
+    thread_function_contexts[i].ds = &ds;
+    thread_function_contexts[i].timings = &thread_timings[i];
+    thread_function_contexts[i].pool = &pool;
+    thread_function_contexts[i].stripes = stripe_file ? &stripes : NULL;
+    thread_function_contexts[i].cache = cache_dir ? &cache : NULL;
     thread_function_contexts[i].img = img;
     thread_function_contexts[i].output_buffer = output_buffer;
 
@@ -439,26 +790,54 @@ int main(int argc, char **argv)
   }
 
   DEBUG_PRINT(("[%s] Waiting for threads to finish...\n", __FUNCTION__));
-  for (i = 0; i != num_threads; ++i)
+  for (i = 0; i != num_threads + num_hedges; ++i)
   {
     DEBUG_PRINT(("[%s] Waiting for thread #%d to finish\n", __FUNCTION__, i));
     pthread_join(threads[i], NULL);
     DEBUG_PRINT(("[%s] thread #%d finished\n", __FUNCTION__, i));
   }
+  print_dupstats(&ds);
+  print_mirror_stats();
+  if (!stream_decode)
+    cleanup_bufpool(&pool);
 
-  // now, write the array back to disk using write_png_file
-  png_bytep * output_row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * HEIGHT);
-
-  for (int i = 0; i < HEIGHT; i++)
-    output_row_pointers[i] = &output_buffer[i*WIDTH*4];
-
-  write_png_file("output.png", output_row_pointers);
-  free(output_row_pointers);
-  free(output_buffer);
-  free(received_fragments);
+  if (stripe_file)
+  {
+    // every stripe is on disk already
+    close_stripefile(&stripes);
+  }
+  else if (raw_file)
+  {
+    // and so is every pixel
+    close_rawfile(&raw, output_buffer);
+  }
+  else
+  {
+    // now, write the array back to disk using write_png_file
+    start_us = get_time_us();
+    if (num_encoders > 1)
+      write_png_file_parallel("output.png", output_buffer, level, filter, num_encoders);
+    else
+      write_png_file("output.png", output_buffer, level, filter);
+    record_time(&main_timings, PHASE_ENCODE, get_time_us() - start_us);
+  }
+  if (timings_file)
+    dump_timings(timings_file, mirror_timings, NUM_MIRRORS, thread_timings, num_threads + num_hedges, &main_timings, NULL, NULL);
+  if (cache_dir)
+    close_cache(&cache);
+  else if (stripe_major)
+    unmap_stripes(output_buffer);
+  else if (!raw_file)
+    free(output_buffer);
+  cleanup_tailmode(&tail);
+  if (autotune_max)
+    cleanup_permits(&permits);
   free(threads);
   free(thread_function_contexts);
+  free(thread_timings);
+  cleanup_share();
   curl_global_cleanup();
+  curl_slist_free_all(connect_to);
 
   return 0;
 }
@@ -0,0 +1,114 @@
+/*
+ * Keep one libpaster engine up and assemble whatever images are asked
+ * for on standard input, one number to a line:
+ *
+ *   seq 1 10 | paster_serve -d -t 8
+ *
+ * Each is written as output-N.png, and "wrote output-N.png" printed once
+ * it is, in whatever order they finish; one the budget (-q, or -e for
+ * each image) runs out on is reported as "gave up on output-N.png". Unlike a paster_nbio run per
+ * image, every one after the first finds the connections open and the
+ * mirrors sized up. At the end of the input the last ones are finished
+ * and the statistics printed as paster_nbio does. If the mirrors give out,
+ * whatever is open then is given up on too, and it stops reading.
+ *
+ * This software may be freely redistributed under the terms of the X11
+ * license.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "libpaster.h"
+
+void image_done (const struct paster_result * result, void * arg)
+{
+  (void) arg;
+  printf("%s %s\n", result->status == PASTER_DONE ? "wrote" : "gave up on", result->file_name);
+  fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+  int c;
+  struct paster_options opts;
+  struct paster * p;
+  const char * error;
+  char line[64], file_name[32];
+  int img;
+  int status = 0;
+
+  paster_default_options(&opts);
+  while ((c = getopt(argc, argv, "t:a:dUc:g:q:e:")) != -1) {
+    switch (c) {
+    case 't':
+      opts.threads = strtoul(optarg, NULL, 10);
+      if (opts.threads == 0) {
+	printf("%s: option requires an argument > 0 -- 't'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'a':
+      opts.max_active = strtoul(optarg, NULL, 10);
+      if (opts.max_active == 0) {
+	printf("%s: option requires an argument > 0 -- 'a'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'd':
+      opts.discard_duplicates = true;
+      break;
+    case 'U':
+      opts.uring = true;
+      break;
+    case 'c':
+      opts.connect_to = optarg;
+      break;
+    case 'g':
+      opts.geometry = optarg;
+      break;
+    case 'q':
+      opts.max_requests = strtoul(optarg, NULL, 10);
+      if (opts.max_requests == 0) {
+	printf("%s: option requires an argument > 0 -- 'q'\n", argv[0]);
+	return -1;
+      }
+      break;
+    case 'e':
+      opts.image_max_requests = strtoul(optarg, NULL, 10);
+      if (opts.image_max_requests == 0) {
+	printf("%s: option requires an argument > 0 -- 'e'\n", argv[0]);
+	return -1;
+      }
+      break;
+    default:
+      printf("usage: %s [-t threads] [-a active] [-d] [-U] [-c host:port] [-g WIDTHxHEIGHT/N] [-q requests] [-e requests] < images\n", argv[0]);
+      return -1;
+    }
+  }
+  if ((error = paster_check_options(&opts))) {
+    printf("%s: %s\n", argv[0], error);
+    return -1;
+  }
+
+  p = paster_create(&opts);
+  if (!p) {
+    fprintf(stderr, "%s: could not start the engine\n", argv[0]);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), stdin)) {
+    img = strtoul(line, NULL, 10);
+    if (img == 0)
+      continue;
+    snprintf(file_name, sizeof(file_name), "output-%d.png", img);
+    if (paster_submit(p, img, file_name, image_done, NULL)) {
+      fprintf(stderr, "%s: the engine has stopped\n", argv[0]);
+      status = -1;
+      break;
+    }
+  }
+  paster_destroy(p);
+  return status;
+}
@@ -0,0 +1,148 @@
+/*
+ * Decoding a fragment as it downloads (-s), shared by the pasters that
+ * can: paster, paster_parallel and paster_nbio.
+ *
+ * This software may be freely redistributed under the terms of the X11
+ * license.
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdbool.h>
+#include <setjmp.h>
+#include <string.h>
+#include <png.h>
+
+#include "geometry.h"
+#include "fetch.h"
+#include "image.h"
+
+/***********************************************************************************/
+/* routines to decode PNG data progressively as it arrives from the network        */
+
+struct streamdata {
+  png_structp png_ptr;
+  png_infop info_ptr;
+  struct headerdata * hd;
+  png_byte * dest;
+  bool interlaced;
+  bool finished;
+  bool corrupt;         // libpng gave up on the body
+  double decode_time;   // includes paint_us
+  long paint_us;
+  struct arena arena;   // for its read struct; see below
+};
+
+/* libpng calls this once it has parsed the PNG header */
+static void stream_info_cb (png_structp png_ptr, png_infop info_ptr)
+{
+  struct streamdata * sd = png_get_progressive_ptr(png_ptr);
+
+  if (png_get_bit_depth(png_ptr, info_ptr) != 8)
+    png_error(png_ptr, "bit depth 16 PNG files unsupported");
+
+  sd->interlaced = png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE;
+  png_set_interlace_handling(png_ptr);
+  png_read_update_info(png_ptr, info_ptr);
+
+  // rows are copied into the output buffer, and must not spill into the
+  // neighbouring stripe
+  if (png_get_image_height(png_ptr, info_ptr) > BUF_HEIGHT ||
+      png_get_rowbytes(png_ptr, info_ptr) != BUF_WIDTH*4)
+    png_error(png_ptr, "fragment does not fit its stripe");
+}
+
+/* libpng calls this with every row (or, for interlaced images, every pass
+ * over a row) as soon as it has been decoded; paint it straight away. A
+ * whole row is one contiguous span of the stripe, so it goes in with a
+ * single memcpy; only passes over an interlaced row need libpng to pick
+ * out the pixels they cover. */
+static void stream_row_cb (png_structp png_ptr, png_bytep new_row, png_uint_32 row_num, int pass)
+{
+  struct streamdata * sd = png_get_progressive_ptr(png_ptr);
+  png_byte * dest;
+  long start_us;
+
+  if (!new_row || row_num >= HEIGHT)
+    return;
+
+  start_us = get_time_us();
+  dest = stripe_row(sd->dest, sd->hd->n, row_num);
+  if (sd->interlaced)
+    png_progressive_combine_row(png_ptr, dest, new_row);
+  else
+    memcpy(dest, new_row, BUF_WIDTH * 4);
+  sd->paint_us += get_time_us() - start_us;
+}
+
+static void stream_end_cb (png_structp png_ptr, png_infop info_ptr)
+{
+  struct streamdata * sd = png_get_progressive_ptr(png_ptr);
+
+  sd->finished = true;
+}
+
+/* A stream's read struct lives as long as its transfer, and paster_nbio
+ * has one for every transfer it runs, so a decoder's arena (see image.h)
+ * won't do: each stream keeps one of its own, from one transfer to the
+ * next */
+static void init_stream (struct streamdata * sd)
+{
+  init_arena(&sd->arena);
+}
+
+static void cleanup_stream (struct streamdata * sd)
+{
+  cleanup_arena(&sd->arena);
+}
+
+/* get ready to decode the next transfer as it downloads */
+static void start_stream (struct streamdata * sd)
+{
+  sd->png_ptr = create_read_struct(&sd->arena);
+  if (!sd->png_ptr)
+    abort_("[start_stream] png_create_read_struct failed");
+
+  sd->info_ptr = png_create_info_struct(sd->png_ptr);
+  if (!sd->info_ptr)
+    abort_("[start_stream] png_create_info_struct failed");
+
+  png_set_progressive_read_fn(sd->png_ptr, sd, stream_info_cb, stream_row_cb, stream_end_cb);
+  sd->finished = false;
+  sd->corrupt = false;
+  sd->decode_time = 0;
+  sd->paint_us = 0;
+}
+
+static void end_stream (struct streamdata * sd)
+{
+  png_destroy_read_struct(&sd->png_ptr, &sd->info_ptr, NULL);
+}
+
+/* curl calls this (instead of write_cb) to hand data to libpng as soon as
+ * it arrives. header_cb has already told us which stripe it belongs to. */
+static size_t stream_write_cb(char * ptr, size_t size, size_t nmemb, void *userdata) {
+  struct streamdata * sd = userdata;
+  double start_time;
+
+  sd->hd->received += size * nmemb;
+  // some other transfer has (or is painting) this fragment already
+  if (sd->hd->duplicate)
+    return size * nmemb;
+
+  // a short count makes curl fail the transfer; the fragment gets fetched
+  // again
+  if (setjmp(png_jmpbuf(sd->png_ptr))) {
+    sd->corrupt = true;
+    return 0;
+  }
+
+  start_time = get_time();
+  png_process_data(sd->png_ptr, sd->info_ptr, (png_bytep) ptr, size * nmemb);
+  sd->decode_time += get_time() - start_time;
+
+  return size * nmemb;
+}
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * Turn a stripe file, as written by the pasters' -o option, back into an
+ * ordinary PNG.
+ *
+ *   unstripe output.stripes output.png
+ *
+ * A stripe file is the fragments' stripes as PNGs of their own, back to
+ * back in the order they were painted, followed by an index:
+ *
+ *   N times:        offset (64 bits), length (64 bits)   in fragment order
+ *   then:           width, height, N (32 bits each), "PSTRIPE1"
+ *
+ * all big-endian. This software may be freely redistributed under the
+ * terms of the X11 license.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+#include <png.h>
+
+#define STRIPEFILE_MAGIC "PSTRIPE1"
+#define TRAILER_BYTES 20
+
+/* error handling macro */
+void abort_(const char * s, ...)
+{
+  va_list args;
+  va_start(args, s);
+  vfprintf(stderr, s, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+  abort();
+}
+
+uint64_t get_uint_64 (png_bytep buf)
+{
+  return (uint64_t) png_get_uint_32(buf) << 32 | png_get_uint_32(buf + 4);
+}
+
+int main(int argc, char **argv)
+{
+  FILE * fp;
+  png_byte trailer[TRAILER_BYTES];
+  png_bytep index, stripe, image;
+  png_image png;
+  uint32_t width, height, n, stripe_width, i;
+  uint64_t offset, length;
+
+  if (argc != 3) {
+    printf("usage: %s stripe-file output.png\n", argv[0]);
+    return -1;
+  }
+
+  fp = fopen(argv[1], "rb");
+  if (!fp)
+    abort_("[main] File %s could not be opened for reading", argv[1]);
+
+  if (fseek(fp, -TRAILER_BYTES, SEEK_END) || fread(trailer, 1, TRAILER_BYTES, fp) != TRAILER_BYTES ||
+      memcmp(trailer + 12, STRIPEFILE_MAGIC, 8))
+    abort_("[main] %s is not a stripe file", argv[1]);
+  width = png_get_uint_32(trailer);
+  height = png_get_uint_32(trailer + 4);
+  n = png_get_uint_32(trailer + 8);
+  if (!n || width % n)
+    abort_("[main] %s has %u stripes, which don't divide its width %u", argv[1], n, width);
+  stripe_width = width / n;
+
+  index = malloc(n * 16);
+  image = malloc((size_t) width * height * 4);
+  if (!index || !image)
+    abort_("[main] malloc failed");
+  if (fseek(fp, -TRAILER_BYTES - (long) n * 16, SEEK_END) || fread(index, 16, n, fp) != n)
+    abort_("[main] Error reading the index of %s", argv[1]);
+
+  for (i = 0; i < n; ++i) {
+    offset = get_uint_64(&index[i*16]);
+    length = get_uint_64(&index[i*16 + 8]);
+
+    stripe = malloc(length);
+    if (!stripe)
+      abort_("[main] malloc failed");
+    if (fseek(fp, offset, SEEK_SET) || fread(stripe, 1, length, fp) != length)
+      abort_("[main] Error reading stripe %u of %s", i, argv[1]);
+
+    // decode straight into the stripe's columns of the image
+    memset(&png, 0, sizeof(png));
+    png.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_memory(&png, stripe, length))
+      abort_("[main] stripe %u: %s", i, png.message);
+    if (png.width != stripe_width || png.height != height)
+      abort_("[main] stripe %u is %ux%u, not %ux%u", i, png.width, png.height, stripe_width, height);
+    png.format = PNG_FORMAT_RGBA;
+    if (!png_image_finish_read(&png, NULL, &image[i*stripe_width*4], width*4, NULL))
+      abort_("[main] stripe %u: %s", i, png.message);
+    free(stripe);
+  }
+  fclose(fp);
+
+  memset(&png, 0, sizeof(png));
+  png.version = PNG_IMAGE_VERSION;
+  png.width = width;
+  png.height = height;
+  png.format = PNG_FORMAT_RGBA;
+  if (!png_image_write_to_file(&png, argv[2], 0, image, width*4, NULL))
+    abort_("[main] %s: %s", argv[2], png.message);
+
+  free(index);
+  free(image);
+  return 0;
+}